@@ -0,0 +1,810 @@
+/*
+ * Yet Another Malloc
+ * ya_arena.c
+ * Defines arenas and the segments backing their heaps
+ */
+
+/*---------------------*/
+/* Feature test macros */
+/*---------------------*/
+
+#define _GNU_SOURCE // for MAP_ANONYMOUS, MAP_NORESERVE and mremap
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ya_debug.h"
+#include "ya_arena.h"
+#include "ya_block.h"
+#include "ya_freelist.h"
+#include "ya_pagemap.h"
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* big enough to hold a pointer */
+static const size_t WORD_SIZE = sizeof(intptr_t);
+/* grow heaps 8k by 8k */
+static const size_t CHUNK_SIZE = 8192;
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+static struct arena arenas[MAX_ARENAS] = {
+    [0] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+static int n_arenas = 1;
+static atomic_uint next_arena = 0;
+// initial-exec: in the shared library, the default model would go through
+// __tls_get_addr, which may allocate
+static _Thread_local struct arena *thread_arena
+        __attribute__((tls_model("initial-exec"))) = NULL;
+
+static atomic_size_t direct_threshold_bytes = DIRECT_THRESHOLD_MIN;
+static bool direct_adaptive = true;
+
+static atomic_long decay_ms = DECAY_DEFAULT_MS;
+
+static size_t fast_budget_bytes = FAST_DEFAULT_BYTES;
+
+static bool huge_pages = true;
+
+struct sys_stats sys_stats;
+
+/*---------*/
+/* Inlines */
+/*---------*/
+
+/* Returns the offset of the first block of a segment: enough room for the
+ * segment header and the block's header, rounded to a dword. */
+static inline size_t first_offset() {
+    return round_to(sizeof(struct segment) + WORD_SIZE, 2 * WORD_SIZE);
+}
+
+/* Returns the first block of seg. */
+static inline intptr_t *segment_first(struct segment *seg) {
+    return (intptr_t *) ((char *) seg + first_offset());
+}
+
+/* Returns the first word past the end of seg's mapping. */
+static inline intptr_t *segment_limit(struct segment *seg) {
+    return (intptr_t *) ((char *) seg + seg->size);
+}
+
+/* Marks end as the epilogue of a heap whose last block is allocated or not. */
+static inline void epilogue_init(intptr_t *end, bool prev_alloc) {
+    end[-1] = TAG_ALLOC | (prev_alloc ? TAG_PREV_ALLOC : 0); // size 0
+}
+
+/* Adds n to the system call or direct segment counter. */
+static inline void sys_count(atomic_size_t *counter, size_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+/*-----------*/
+/* Functions */
+/*-----------*/
+
+/* Returns the system page size. */
+static size_t page_size() {
+    static size_t size = 0;
+    if (!size) {
+        size = sysconf(_SC_PAGESIZE);
+    }
+    return size;
+}
+
+/* Maps size bytes aligned on SEGMENT_SIZE with the given protection.
+ * Returns a pointer to the mapping or NULL in case of failure. */
+static void *map_aligned(size_t size, int prot) {
+    char *ptr = mmap(NULL, size + SEGMENT_SIZE, prot,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    sys_count(&sys_stats.maps, 1);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    char *base = (char *) round_to((intptr_t) ptr, SEGMENT_SIZE);
+    size_t lead = base - ptr;
+    if (lead) {
+        munmap(ptr, lead);
+    }
+    if (SEGMENT_SIZE - lead) {
+        munmap(base + size, SEGMENT_SIZE - lead);
+    }
+    sys_count(&sys_stats.unmaps, (lead > 0) + (lead < SEGMENT_SIZE));
+    return base;
+}
+
+/* Reserves a new heap segment for arena, with an empty heap and its first
+ * COMMIT_MIN bytes accessible.
+ * Returns a pointer to the segment or NULL in case of failure. */
+static struct segment *segment_create(struct arena *arena) {
+    struct segment *seg = map_aligned(SEGMENT_SIZE, PROT_NONE);
+    if (!seg) {
+        return NULL;
+    }
+    sys_count(&sys_stats.commits, 1);
+    if (mprotect(seg, COMMIT_MIN, PROT_READ | PROT_WRITE)) {
+        munmap(seg, SEGMENT_SIZE);
+        sys_count(&sys_stats.unmaps, 1);
+        return NULL;
+    }
+    seg->committed = (char *) seg + COMMIT_MIN;
+    seg->arena = arena;
+    seg->size = SEGMENT_SIZE;
+    seg->start = segment_first(seg);
+    seg->end = seg->start;
+    seg->mapped = (char *) seg;
+    epilogue_init(seg->end, true);
+    seg->next = arena->segments;
+    arena->segments = seg;
+    ya_debug("segment_create: arena = %p, segment = %p, start = %p\n",
+            arena, seg, seg->start);
+    return seg;
+}
+
+/* Sets the number of arenas, clamped to [1, MAX_ARENAS]. Must be called
+ * before any thread other than the main one starts. */
+void arena_setup(int count) {
+    if (count < 1) {
+        count = 1;
+    } else if (count > MAX_ARENAS) {
+        count = MAX_ARENAS;
+    }
+    for (int i = n_arenas; i < count; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+    n_arenas = count;
+}
+
+/* Returns the number of arenas. */
+int arena_count() {
+    return n_arenas;
+}
+
+/* Returns the i-th arena. */
+struct arena *arena_at(int i) {
+    return &arenas[i];
+}
+
+/* Returns the calling thread's arena, assigning one if necessary. */
+struct arena *arena_get() {
+    if (!thread_arena) {
+        thread_arena = &arenas[atomic_fetch_add(&next_arena, 1) % n_arenas];
+    }
+    return thread_arena;
+}
+
+/* Enables or disables transparent huge pages for large heaps. Must be called
+ * before any thread other than the main one starts. */
+void huge_pages_setup(bool enabled) {
+    huge_pages = enabled;
+}
+
+/* Returns the size in words of the largest block a heap segment can hold. */
+intptr_t arena_max_block() {
+    // the epilogue's header takes the block's last word
+    return ((SEGMENT_SIZE - first_offset()) / WORD_SIZE) & -2;
+}
+
+/* Enters the pages of seg's heap up to end in the page map.
+ * Returns false in case of failure. */
+static bool segment_map(struct segment *seg, intptr_t *end) {
+    char *limit = (char *) round_to((intptr_t) end, page_size());
+    if (limit <= seg->mapped) {
+        return true;
+    }
+    if (!pagemap_set(seg->mapped, limit, (uintptr_t) seg)) {
+        return false;
+    }
+    seg->mapped = limit;
+    return true;
+}
+
+/* Makes the pages of seg's reservation up to end accessible, committing at
+ * least as many bytes as are already accessible, in whole huge pages once
+ * there is one, and advising the kernel to back them with transparent huge
+ * pages past the first HUGE_PAGES_FROM bytes.
+ * Returns false in case of failure. */
+static bool segment_commit(struct segment *seg, char *end) {
+    if (end <= seg->committed) {
+        return true;
+    }
+    size_t committed = seg->committed - (char *) seg;
+    size_t align = committed >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : page_size();
+    char *limit = (char *) segment_limit(seg);
+    char *new_end = seg->committed + committed;
+    if (new_end < end) {
+        new_end = (char *) round_to((intptr_t) end, align);
+    }
+    if (new_end > limit) {
+        new_end = limit;
+    }
+    size_t size = new_end - seg->committed;
+    sys_count(&sys_stats.commits, 1);
+    if (mprotect(seg->committed, size, PROT_READ | PROT_WRITE)) {
+        return false;
+    }
+    if (huge_pages && committed >= HUGE_PAGES_FROM) {
+        madvise(seg->committed, size, MADV_HUGEPAGE);
+    }
+    ya_debug("segment_commit: segment = %p, committed %zu -> %zu bytes\n",
+            seg, committed, new_end - (char *) seg);
+    seg->committed = new_end;
+    return true;
+}
+
+/* Extends the segment's heap so that its last block is free and at least
+ * size words large. The arena's lock must be held.
+ * Returns a pointer to the last block, which is in the free list, or NULL if
+ * the segment is too small. */
+intptr_t *segment_extend(struct arena *arena, struct segment *seg,
+        intptr_t size) {
+    intptr_t *last = segment_last_free(seg);
+    uint64_t since = 0; // fresh pages are clean
+    if (last) {
+        if (block_size(last) >= size) {
+            return last;
+        }
+        size -= block_size(last);
+        since = block_dirty_since(last);
+    }
+    intptr_t room = (segment_limit(seg) - seg->end) & -2;
+    if (size > room) {
+        return NULL;
+    }
+    size = round_to(size, CHUNK_SIZE / WORD_SIZE);
+    if (size > room) {
+        size = room;
+    }
+    intptr_t *block = seg->end; // the old epilogue
+    if (!segment_commit(seg, (char *) (block + size))
+            || !segment_map(seg, block + size)) {
+        return NULL;
+    }
+    block_init(block, size, block_flags(block) & TAG_PREV_ALLOC);
+    seg->end = block + size;
+    epilogue_init(seg->end, false);
+    fl_join(&arena->fl, block);
+    block = block_join(block);
+    block_set_dirty(block, since);
+    fl_free(&arena->fl, block);
+    ya_debug("segment_extend: segment = %p, end = %p, last = %p:%ld\n",
+            seg, seg->end, block, block_size(block));
+    return block;
+}
+
+/* Extends the arena's most recent segment, or maps a new one, so that a free
+ * block of at least size words is available. The arena's lock must be held.
+ * Returns a pointer to the block, which is in the free list, or NULL in case
+ * of failure. */
+intptr_t *arena_extend(struct arena *arena, intptr_t size) {
+    if (arena->segments) {
+        intptr_t *block = segment_extend(arena, arena->segments, size);
+        if (block) {
+            return block;
+        }
+    }
+    struct segment *seg = segment_create(arena);
+    if (!seg) {
+        return NULL;
+    }
+    return segment_extend(arena, seg, size);
+}
+
+/* Drops the whole pages between start and end.
+ * Returns the number of bytes released. */
+static size_t range_purge(intptr_t *start, intptr_t *end) {
+    intptr_t first = round_to((intptr_t) start, page_size());
+    intptr_t last = (intptr_t) end & -page_size();
+    if (last <= first) {
+        return 0;
+    }
+    madvise((void *) first, last - first, MADV_DONTNEED);
+    return last - first;
+}
+
+/* Drops the whole pages inside the free block, keeping its header, free list
+ * words, the time it became dirty and its footer in place.
+ * Returns the number of bytes released. */
+static size_t block_purge(intptr_t *block) {
+    return range_purge(block + 5, block + block_size(block) - 2);
+}
+
+/* Purges the free block and marks it clean.
+ * Returns the number of bytes released. */
+static size_t arena_purge(struct arena *arena, intptr_t *block) {
+    size_t released = block_purge(block);
+    block_set_dirty(block, 0);
+    arena->purged += released;
+    return released;
+}
+
+/* Unlinks seg from the arena's segments and unmaps it. */
+static void segment_destroy(struct arena *arena, struct segment *seg) {
+    struct segment **link = &arena->segments;
+    while (*link != seg) {
+        link = &(*link)->next;
+    }
+    *link = seg->next;
+    ya_debug("segment_destroy: arena = %p, segment = %p\n", arena, seg);
+    pagemap_set(seg, seg->mapped, 0);
+    munmap(seg, seg->size);
+    sys_count(&sys_stats.unmaps, 1);
+}
+
+/* Unmaps seg if its heap is empty and it is not the arena's most recent
+ * segment. Otherwise moves its heap's end down to keep pad bytes past the
+ * last allocated block and drops the pages past the end. The arena's lock
+ * must be held.
+ * Returns the number of bytes released. */
+size_t segment_trim(struct arena *arena, struct segment *seg, size_t pad) {
+    intptr_t *last = segment_last_free(seg);
+    if (!last) {
+        return 0;
+    }
+    if (last == seg->start && seg != arena->segments) {
+        size_t released = (char *) seg->end - (char *) seg;
+        fl_alloc(&arena->fl, last);
+        segment_destroy(arena, seg);
+        arena->purged += released;
+        return released;
+    }
+    intptr_t *end = (intptr_t *) round_to(
+            (intptr_t) (last + MIN_BLOCK_SIZE) + pad, page_size());
+    intptr_t *old_end = seg->end;
+    if (end >= old_end) {
+        return 0;
+    }
+    fl_alloc(&arena->fl, last);
+    block_init(last, end - last, block_flags(last));
+    fl_free(&arena->fl, last);
+    seg->end = end;
+    epilogue_init(end, false);
+    size_t released = round_to((intptr_t) old_end, page_size()) - (intptr_t) end;
+    madvise(end, released, MADV_DONTNEED);
+    arena->purged += released;
+    ya_debug("segment_trim: segment = %p, end %p -> %p\n", seg, old_end, end);
+    return released;
+}
+
+/* Purges every free block of the arena, then trims each segment, keeping pad
+ * bytes at the end of the most recent one. The arena's lock must be held.
+ * Returns the number of bytes released. */
+size_t arena_trim(struct arena *arena, size_t pad) {
+    size_t released = 0;
+    struct segment *next;
+    for (struct segment *seg = arena->segments; seg; seg = next) {
+        next = seg->next;
+        for (intptr_t *block = seg->start; block < seg->end;
+                block = block_next(block)) {
+            if (!block_is_alloc(block)) {
+                released += arena_purge(arena, block);
+            }
+        }
+        released += segment_trim(arena, seg, pad);
+    }
+    return released;
+}
+
+/* Sets the number of bytes each arena's fast bins may hold before they are
+ * consolidated, 0 disabling them. Must be called before any thread other
+ * than the main one starts. */
+void fast_setup(size_t bytes) {
+    fast_budget_bytes = bytes;
+}
+
+/* Returns the number of bytes each arena's fast bins may hold. */
+size_t fast_budget() {
+    return fast_budget_bytes;
+}
+
+/* Sets the decay time in milliseconds. */
+void decay_setup(long ms) {
+    atomic_store_explicit(&decay_ms, ms, memory_order_relaxed);
+}
+
+/* Returns the decay time in milliseconds. */
+long decay_time() {
+    return atomic_load_explicit(&decay_ms, memory_order_relaxed);
+}
+
+/* Returns the current time in milliseconds, never 0. */
+uint64_t decay_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+/* Runs a decay pass over every arena every decay time / DECAY_STEPS. */
+static void *decay_main(void *arg) {
+    for (;;) {
+        long ms = decay_time() / DECAY_STEPS;
+        if (ms < 1) {
+            ms = 1;
+        }
+        struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+        nanosleep(&ts, NULL);
+        if (decay_time() <= 0) {
+            continue;
+        }
+        for (int i = 0; i < n_arenas; i++) {
+            struct arena *arena = &arenas[i];
+            pthread_mutex_lock(&arena->lock);
+            arena_decay(arena, decay_now());
+            pthread_mutex_unlock(&arena->lock);
+        }
+    }
+    return NULL;
+}
+
+/* Starts the background thread running decay passes over every arena. */
+void decay_start() {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&thread, &attr, decay_main, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+/* Marks the free block, which holds the size words just freed at freed,
+ * dirty since now unless it already was. With a decay time of 0, purges the
+ * freed words and trims the block's segment right away instead. Otherwise
+ * runs a decay pass if one is due. The arena's lock must be held. */
+void arena_dirty(struct arena *arena, intptr_t *block, intptr_t *freed,
+        intptr_t size) {
+    if (block_size(block) < DECAY_MIN_BLOCK) {
+        return;
+    }
+    long decay = decay_time();
+    if (!decay) {
+        // stay clear of the block's header, free list words and footer
+        intptr_t *start = freed - 1 > block + 5 ? freed - 1 : block + 5;
+        intptr_t *end = block + block_size(block) - 2;
+        if (freed + size - 1 < end) {
+            end = freed + size - 1;
+        }
+        arena->purged += range_purge(start, end);
+        struct segment *seg = segment_of(block);
+        if (block_next(block) == seg->end) {
+            segment_trim(arena, seg, TRIM_PAD);
+        }
+        return;
+    }
+    uint64_t now = decay_now();
+    if (!block_dirty_since(block)) {
+        block_set_dirty(block, now);
+    }
+    if (decay > 0 && now - arena->decayed_at >= decay / DECAY_STEPS) {
+        arena_decay(arena, now);
+    }
+}
+
+/* A decay pass over one arena. */
+struct decay_pass {
+    struct arena *arena;
+    uint64_t before; // purge blocks dirty since before this time
+};
+
+static void decay_visit(intptr_t *block, void *arg) {
+    struct decay_pass *pass = arg;
+    uint64_t since = block_dirty_since(block);
+    if (since && since < pass->before) {
+        arena_purge(pass->arena, block);
+    }
+}
+
+/* Purges the free blocks of the arena dirty since before now minus the decay
+ * time and trims the segments ending with a clean free block. The arena's
+ * lock must be held.
+ * Returns the number of bytes released. */
+size_t arena_decay(struct arena *arena, uint64_t now) {
+    size_t purged = arena->purged;
+    struct decay_pass pass = { arena, now - decay_time() };
+    arena->decayed_at = now;
+    fl_visit(&arena->fl, DECAY_MIN_BLOCK, decay_visit, &pass);
+    struct segment *next;
+    for (struct segment *seg = arena->segments; seg; seg = next) {
+        next = seg->next;
+        intptr_t *last = segment_last_free(seg);
+        if (last && !block_dirty_since(last)) {
+            segment_trim(arena, seg, TRIM_PAD);
+        }
+    }
+    return arena->purged - purged;
+}
+
+/* Sets the direct threshold in bytes. 0 selects the adaptive threshold. */
+void direct_setup(size_t threshold) {
+    direct_adaptive = !threshold;
+    atomic_store_explicit(&direct_threshold_bytes,
+            threshold ? threshold : DIRECT_THRESHOLD_MIN,
+            memory_order_relaxed);
+}
+
+/* Returns the current direct threshold in bytes. */
+size_t direct_threshold() {
+    return atomic_load_explicit(&direct_threshold_bytes, memory_order_relaxed);
+}
+
+/* Returns true iff a block of size words should get a direct segment. */
+bool direct_wanted(intptr_t size) {
+    return size > arena_max_block() || size * WORD_SIZE >= direct_threshold();
+}
+
+/* Returns the offset in a direct segment of a block aligned on align bytes:
+ * just past the segment header unless align requires more. */
+static inline size_t direct_offset(size_t align) {
+    return round_to(first_offset(), align > first_offset() ? align : 1);
+}
+
+/* Returns the number of bytes to map for a direct block of size words at
+ * offset bytes into its segment. */
+static inline size_t direct_bytes(intptr_t size, size_t offset) {
+    // the block's header is part of offset
+    return round_to(offset + (size - 1) * WORD_SIZE, page_size());
+}
+
+/* Lays out a direct block at offset bytes into the direct segment seg, using
+ * all of the rest of the segment.
+ * Returns a pointer to the block. */
+static intptr_t *direct_init(struct segment *seg, size_t bytes,
+        size_t offset) {
+    seg->arena = NULL;
+    seg->next = NULL;
+    seg->size = bytes;
+    seg->committed = (char *) seg + bytes;
+    intptr_t *block = (intptr_t *) ((char *) seg + offset);
+    intptr_t size = (segment_limit(seg) - block + 1) & -2;
+    block_init(block, size, TAG_ALLOC | TAG_PREV_ALLOC);
+    seg->start = block;
+    seg->end = block + size;
+    return block;
+}
+
+/* Enters the page holding the direct segment seg's block, offset bytes into
+ * the segment, in the page map, or removes it if seg is NULL.
+ * Returns false in case of failure. */
+static bool direct_map(void *base, size_t offset, struct segment *seg) {
+    char *block = (char *) base + offset;
+    return pagemap_set(block, block + 1, (uintptr_t) seg);
+}
+
+/* Maps a direct segment holding an allocated block at least size words large
+ * and aligned on align bytes, a power of two of at most SEGMENT_SIZE / 2.
+ * Returns a pointer to the block or NULL in case of failure. */
+intptr_t *direct_alloc(intptr_t size, size_t align) {
+    size_t offset = direct_offset(align);
+    size_t bytes = direct_bytes(size, offset);
+    struct segment *seg = map_aligned(bytes, PROT_READ | PROT_WRITE);
+    if (!seg) {
+        return NULL;
+    }
+    if (!direct_map(seg, offset, seg)) {
+        munmap(seg, bytes);
+        sys_count(&sys_stats.unmaps, 1);
+        return NULL;
+    }
+    sys_count(&sys_stats.direct_segments, 1);
+    sys_count(&sys_stats.direct_bytes, bytes);
+    intptr_t *block = direct_init(seg, bytes, offset);
+    ya_debug("direct_alloc: segment = %p, block = %p:%ld\n",
+            seg, block, block_size(block));
+    return block;
+}
+
+/* Resizes the direct segment holding block to hold at least size words,
+ * moving its pages without copying them if it cannot grow in place. The
+ * block keeps its alignment.
+ * Returns a pointer to the block, which may have moved, or NULL in case of
+ * failure, leaving the block untouched. */
+intptr_t *direct_realloc(intptr_t *block, intptr_t size) {
+    struct segment *seg = segment_of(block);
+    size_t offset = (char *) block - (char *) seg;
+    size_t bytes = direct_bytes(size, offset);
+    size_t old_bytes = seg->size;
+    if (bytes == old_bytes) {
+        return block;
+    }
+    void *ptr = mremap(seg, seg->size, bytes, 0);
+    sys_count(&sys_stats.maps, 1);
+    if (ptr == MAP_FAILED) {
+        // reserve an aligned destination and move the pages there
+        void *dest = map_aligned(bytes, PROT_READ | PROT_WRITE);
+        if (!dest) {
+            return NULL;
+        }
+        if (!direct_map(dest, offset, dest)) {
+            munmap(dest, bytes);
+            sys_count(&sys_stats.unmaps, 1);
+            return NULL;
+        }
+        ptr = mremap(seg, seg->size, bytes, MREMAP_MAYMOVE | MREMAP_FIXED,
+                dest);
+        sys_count(&sys_stats.maps, 1);
+        if (ptr == MAP_FAILED) {
+            direct_map(dest, offset, NULL);
+            munmap(dest, bytes);
+            sys_count(&sys_stats.unmaps, 1);
+            return NULL;
+        }
+        direct_map(seg, offset, NULL);
+    }
+    // the count goes down by wrapping around when the segment shrinks
+    sys_count(&sys_stats.direct_bytes, bytes - old_bytes);
+    block = direct_init(ptr, bytes, offset);
+    ya_debug("direct_realloc: segment %p -> %p, block = %p:%ld\n",
+            seg, ptr, block, block_size(block));
+    return block;
+}
+
+/* Faults in the pages holding the first n_bytes bytes of the block of a
+ * direct segment at once, ahead of writing them all, which costs a fraction
+ * of faulting them in one by one. Does nothing on kernels older than 5.14,
+ * which lack MADV_POPULATE_WRITE. */
+void direct_populate(intptr_t *block, size_t n_bytes) {
+#ifdef MADV_POPULATE_WRITE
+    intptr_t first = (intptr_t) block & -page_size();
+    intptr_t last = round_to((intptr_t) block + n_bytes, page_size());
+    madvise((void *) first, last - first, MADV_POPULATE_WRITE);
+#endif
+}
+
+/* Unmaps the direct segment holding block, adjusting the adaptive direct
+ * threshold. */
+void direct_free(intptr_t *block) {
+    struct segment *seg = segment_of(block);
+    ya_debug("direct_free: segment = %p, block = %p:%ld\n",
+            seg, block, block_size(block));
+    if (direct_adaptive && seg->size > direct_threshold()
+            && seg->size <= DIRECT_THRESHOLD_MAX) {
+        atomic_store_explicit(&direct_threshold_bytes, seg->size,
+                memory_order_relaxed);
+    }
+    direct_map(seg, (char *) block - (char *) seg, NULL);
+    sys_count(&sys_stats.direct_segments, -1);
+    sys_count(&sys_stats.direct_bytes, -seg->size);
+    munmap(seg, seg->size);
+    sys_count(&sys_stats.unmaps, 1);
+}
+
+#ifdef YA_DEBUG
+
+/* Prints every block of the arena, then its free list. */
+void arena_print(struct arena *arena) {
+    for (struct segment *seg = arena->segments; seg; seg = seg->next) {
+        ya_debug("Segment %p:\n", seg);
+        block_print_range(seg->start, seg->end);
+    }
+    ya_debug("Free blocks:\n");
+    fl_debug_print(&arena->fl);
+}
+
+/* Checks one heap segment and each of its blocks for consistency.
+ * Returns -1 on error, the total number of free blocks otherwise. */
+static int segment_check(struct arena *arena, struct segment *seg) {
+    if (seg != segment_of(seg->start) || seg->arena != arena) {
+        ya_debug("segment_check: segment %p misplaced\n", seg);
+        return -1;
+    }
+    if ((intptr_t) seg->start & (2 * WORD_SIZE - 1)) {
+        ya_debug("segment_check: start %p not aligned\n", seg->start);
+        return -1;
+    }
+    if ((seg->end - seg->start) & 1 || seg->end > segment_limit(seg)) {
+        ya_debug("segment_check: end %p invalid\n", seg->end);
+        return -1;
+    }
+    if (!block_prev_alloc(seg->start)
+            || (seg->end[-1] & ~TAG_PREV_ALLOC) != TAG_ALLOC) {
+        ya_debug("segment_check: segment %p not bounded\n", seg);
+        return -1;
+    }
+    int num_free = 0;
+    int num_runs = 0;
+    bool prev_free = false;
+    intptr_t *block;
+    for (block = seg->start; block < seg->end; block += block_size(block)) {
+        if (block_check(block)) {
+            return -1;
+        }
+        int cls = entry_class(pagemap_get(block));
+        if (cls >= 0) {
+            if ((uintptr_t) block % SLAB_RUN_SIZE != SLAB_RUN_OFFSET
+                    || block_size(block) != SLAB_RUN_WORDS
+                    || !block_is_alloc(block)
+                    || slab_run_of(block)->size_class != cls) {
+                ya_debug("segment_check: block %p in a run page\n", block);
+                return -1;
+            }
+            num_runs++;
+        }
+        if (prev_free && !block_is_alloc(block)) {
+            ya_debug("segment_check: block %p and prev are both free\n",
+                    block);
+            return -1;
+        }
+        prev_free = !block_is_alloc(block);
+        num_free += prev_free;
+    }
+    if (block != seg->end) {
+        ya_debug("segment_check: last block overflows end %p\n", seg->end);
+        return -1;
+    }
+    if (seg->committed < (char *) seg->end) {
+        ya_debug("segment_check: heap past the accessible pages %p\n",
+                seg->committed);
+        return -1;
+    }
+    if (seg->mapped < (char *) seg->end) {
+        ya_debug("segment_check: heap past the mapped pages %p\n",
+                seg->mapped);
+        return -1;
+    }
+    for (char *page = (char *) seg; page < seg->mapped;
+            page += (size_t) 1 << PAGEMAP_PAGE_SHIFT) {
+        uintptr_t entry = pagemap_get(page);
+        if (entry_segment(entry) != seg) {
+            ya_debug("segment_check: page %p not mapped to its segment\n",
+                    page);
+            return -1;
+        }
+        num_runs -= entry_class(entry) >= 0;
+    }
+    if (num_runs) {
+        ya_debug("segment_check: run pages without a run\n");
+        return -1;
+    }
+    return num_free;
+}
+
+/* Checks that the blocks in the arena's fast bins are allocated and tagged
+ * fast, of their bin's size, and add up to the fast bins' byte count.
+ * Returns -1 on error, 0 otherwise. */
+static int fast_check(struct arena *arena) {
+    size_t bytes = 0;
+    for (int bin = 0; bin < FAST_NUM_BINS; bin++) {
+        for (intptr_t *block = arena->fast[bin]; block;
+                block = (intptr_t *) block[0]) {
+            if ((block[-1] & (TAG_ALLOC | TAG_FAST)) != (TAG_ALLOC | TAG_FAST)
+                    || fast_bin(block_size(block)) != bin) {
+                ya_debug("fast_check: block %p:%ld in bin %d\n",
+                        block, block_size(block), bin);
+                return -1;
+            }
+            bytes += block_size(block) * WORD_SIZE;
+        }
+    }
+    if (bytes != arena->fast_bytes) {
+        ya_debug("fast_check: %zu bytes in the fast bins, counted %zu\n",
+                bytes, arena->fast_bytes);
+        return -1;
+    }
+    return 0;
+}
+
+/* Checks each segment of the arena and each block for consistency, and the
+ * fast bins. Does not check the free list. The arena's lock must be held.
+ * Returns -1 on error, the total number of free blocks otherwise. */
+int arena_check(struct arena *arena) {
+    int num_free = 0;
+    for (struct segment *seg = arena->segments; seg; seg = seg->next) {
+        int seg_free = segment_check(arena, seg);
+        if (seg_free == -1) {
+            return -1;
+        }
+        num_free += seg_free;
+    }
+    return fast_check(arena) ? -1 : num_free;
+}
+
+#endif // def YA_DEBUG
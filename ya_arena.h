@@ -0,0 +1,364 @@
+/*
+ * Yet Another Malloc
+ * ya_arena.h
+ */
+
+/* Arenas and segments.
+ *
+ * An arena is an independent heap with its own lock and free list. Threads
+ * are assigned to arenas round-robin on their first allocation. An arena's
+ * memory comes from segments: SEGMENT_SIZE bytes of address space reserved
+ * with mmap, inaccessible, and aligned on SEGMENT_SIZE. A segment's heap grows
+ * CHUNK_SIZE by CHUNK_SIZE up to the end of the reservation, after which the
+ * arena maps a new segment. The pages under the heap are made accessible
+ * ahead of it with mprotect, COMMIT_MIN bytes first, then as many bytes as
+ * are already accessible each time, so that a growing heap takes a handful
+ * of system calls. Commits past the first HUGE_PAGES_FROM bytes of a segment
+ * are advised to be backed by transparent huge pages, which cut TLB misses
+ * and page faults on large heaps, at the cost of memory for partly used huge
+ * pages, while smaller heaps stay on small pages.
+ *
+ * Segment layout:
+ *
+ * +---------+------ - - - ------+----------+ - - - - - - + - - - - - - +
+ * | segment | blocks...         | epilogue |   unused    |  reserved   |
+ * +---------+------ - - - ------+----------+ - - - - - - + - - - - - - +
+ * ^          ^                  ^                        ^             ^
+ * base       start              end              committed   base + size
+ *
+ * The first block's header says its previous block is allocated, and the
+ * epilogue is an allocated block header of size 0. They keep coalescing
+ * within the segment.
+ *
+ * Memory goes back to the system in three ways. Trimming moves the epilogue
+ * down over a free last block and drops the pages past it with
+ * MADV_DONTNEED, keeping the mapping so the heap can grow back. A segment
+ * left empty, other than the arena's most recent one, is unmapped. Purging
+ * drops the whole pages inside a free block, between its header and footer.
+ *
+ * Freed memory is not purged right away, since it is often reused soon after.
+ * Free blocks of at least DECAY_MIN_BLOCK words record in their fifth data
+ * word, past the free list words, the time since which their pages may be
+ * dirty, 0 once purged, and coalescing keeps the oldest time so that steady
+ * reuse next to dirty pages does not keep them from decaying. Decay passes
+ * purge the blocks dirty for longer than the decay time, then trim the
+ * segments whose last block is clean. They run at most DECAY_STEPS times
+ * per decay time, on frees of large blocks, and from an optional background
+ * thread for idle processes. A decay time of 0 purges memory as soon as it is
+ * freed, a negative one only on malloc_trim.
+ *
+ * Freed blocks of up to FAST_MAX_BLOCK words are not coalesced right away
+ * either, since the next request of the same size would split them off
+ * again: they go to the arena's fast bins, LIFO lists per size through their
+ * first data word, still marked allocated so that their neighbors do not
+ * coalesce with them, and tagged TAG_FAST so that freeing them again is
+ * caught however many blocks were freed in between. Requests of these sizes are served from the fast bins
+ * first. The fast bins are consolidated, every block in them coalesced and
+ * added to the free list, when they hold more than the fast bin budget, when
+ * a request finds no fitting free block, and on malloc_trim.
+ *
+ * Blocks of at least the direct threshold, or too large for a segment, get
+ * their own direct segment holding a single allocated block, placed just past
+ * the header or further in to honor an alignment. The block is resized with
+ * mremap and the segment unmapped when the block is freed. Unless set
+ * explicitly, the threshold adapts like glibc's: freeing a direct block
+ * larger than the threshold raises the threshold to its size, up to
+ * DIRECT_THRESHOLD_MAX, so that programs repeatedly allocating large
+ * temporary buffers serve them from the heap instead of paying for mmap and
+ * munmap each time.
+ *
+ * Every segment is aligned on SEGMENT_SIZE and every block starts within the
+ * first SEGMENT_SIZE bytes of its segment, so the segment owning a block is
+ * found by masking the block's address. Pointers passed in by the user are
+ * looked up in the page map (see ya_pagemap.h) instead, which rejects memory
+ * that is not ours. The entry of each page of a heap, and of the page holding
+ * a direct segment's block, holds the address of its segment, plus 1 + the slab
+ * class for pages holding runs (see ya_slab.h), so that free tells small
+ * objects, which have no header, from blocks.
+ */
+
+#ifndef YA_ARENA_H
+#define YA_ARENA_H
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h> // for size_t
+#include <stdint.h> // for intptr_t
+
+#include "ya_block.h"
+#include "ya_freelist.h"
+#include "ya_pagemap.h"
+#include "ya_slab.h"
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* size and alignment of heap segments */
+#define SEGMENT_SIZE ((size_t) 64 << 20)
+
+/* bytes of a heap segment first made accessible */
+#define COMMIT_MIN ((size_t) 256 << 10)
+
+/* size of transparent huge pages */
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+
+/* bytes of a heap segment accessible before commits use huge pages */
+#define HUGE_PAGES_FROM ((size_t) 16 << 20)
+
+/* maximum number of arenas */
+#define MAX_ARENAS 64
+
+/* bytes kept past the last allocated block when trimming after a free */
+#define TRIM_PAD ((size_t) 128 << 10)
+
+/* smallest free block that may hold a whole 4 KB page past its header and
+ * records when it became dirty */
+#define DECAY_MIN_BLOCK ((intptr_t) (8192 / sizeof(intptr_t)))
+
+/* default decay time in milliseconds */
+#define DECAY_DEFAULT_MS 1000
+
+/* decay passes per decay time */
+#define DECAY_STEPS 10
+
+/* largest block kept in the fast bins, in words: 1 KB */
+#define FAST_MAX_BLOCK ((intptr_t) (1024 / sizeof(intptr_t)))
+
+/* one fast bin per block size, even, from MIN_BLOCK_SIZE to FAST_MAX_BLOCK */
+#define FAST_NUM_BINS ((FAST_MAX_BLOCK - MIN_BLOCK_SIZE) / 2 + 1)
+
+/* default number of bytes each arena's fast bins hold before consolidating */
+#define FAST_DEFAULT_BYTES ((size_t) 64 << 10)
+
+/* initial and maximum adaptive direct thresholds, in bytes */
+#define DIRECT_THRESHOLD_MIN ((size_t) 128 << 10)
+#define DIRECT_THRESHOLD_MAX ((size_t) 32 << 20)
+
+/*-------*/
+/* Types */
+/*-------*/
+
+struct arena;
+
+/* Header at the base of each segment. */
+struct segment {
+    struct arena *arena;   // NULL for direct segments
+    struct segment *next;  // next segment of the arena
+    size_t size;           // bytes mapped
+    intptr_t *start;       // first block
+    intptr_t *end;         // epilogue, first block outside the heap
+    char *mapped;          // end of the pages entered in the page map
+    char *committed;       // end of the accessible pages
+};
+
+struct arena {
+    pthread_mutex_t lock;     // protects everything below
+    struct freelist fl;
+    struct slab slab;
+    struct segment *segments; // most recently mapped first
+    uint64_t decayed_at;      // time of the last decay pass in ms
+    size_t purged;            // bytes purged or trimmed
+    size_t reused;            // dirty bytes allocated again before decaying
+    intptr_t *fast[FAST_NUM_BINS]; // freed blocks not coalesced yet, by size
+    size_t fast_bytes;        // bytes in the fast bins
+    size_t fast_hits;         // requests served from the fast bins
+    size_t fast_consolidations;
+    size_t splits;            // blocks split
+    size_t coalesces;         // free blocks coalesced with a neighbor
+};
+
+/* System calls and direct segments, counted for all arenas. */
+struct sys_stats {
+    atomic_size_t maps;    // calls to mmap and mremap
+    atomic_size_t unmaps;  // calls to munmap
+    atomic_size_t commits; // calls to mprotect
+    atomic_size_t direct_segments;
+    atomic_size_t direct_bytes;
+};
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+extern struct sys_stats sys_stats;
+
+/*---------*/
+/* Inlines */
+/*---------*/
+
+/* Returns the segment holding block. */
+static inline struct segment *segment_of(intptr_t *block) {
+    return (struct segment *) ((uintptr_t) block & ~(SEGMENT_SIZE - 1));
+}
+
+/* Returns the segment owning the page with the page map entry, NULL if the
+ * page is not ours. */
+static inline struct segment *entry_segment(uintptr_t entry) {
+    return (struct segment *) (entry & ~(SEGMENT_SIZE - 1));
+}
+
+/* Returns the slab class of the run in the page with the page map entry, -1
+ * if the page holds no run. */
+static inline int entry_class(uintptr_t entry) {
+    return (int) (entry & (SEGMENT_SIZE - 1)) - 1;
+}
+
+/* Records in the page map that the heap page holding ptr holds a run of the
+ * slab class cls, or no run if cls is -1. */
+static inline void page_set_run(void *ptr, int cls) {
+    pagemap_set(ptr, (char *) ptr + 1, (uintptr_t) segment_of(ptr) + cls + 1);
+}
+
+/* Returns the last block of the segment's heap if it is free, NULL
+ * otherwise. */
+static inline intptr_t *segment_last_free(struct segment *seg) {
+    return block_prev_alloc(seg->end) ? NULL : block_prev(seg->end);
+}
+
+/* Returns the fast bin of blocks of size words, or -1 if they are too large
+ * for the fast bins. */
+static inline int fast_bin(intptr_t size) {
+    return size <= FAST_MAX_BLOCK ? (size - MIN_BLOCK_SIZE) / 2 : -1;
+}
+
+/* Returns the time in ms since which the free block's pages may be dirty,
+ * or 0 if they are clean or the block is too small to purge. */
+static inline uint64_t block_dirty_since(intptr_t *block) {
+    return block_size(block) >= DECAY_MIN_BLOCK ? block[4] : 0;
+}
+
+/* Records the time in ms since which the free block's pages may be dirty,
+ * 0 if they are clean. Does nothing for blocks too small to purge. */
+static inline void block_set_dirty(intptr_t *block, uint64_t since) {
+    if (block_size(block) >= DECAY_MIN_BLOCK) {
+        block[4] = since;
+    }
+}
+
+/*--------------*/
+/* Declarations */
+/*--------------*/
+
+/* Sets the number of arenas, clamped to [1, MAX_ARENAS]. Must be called
+ * before any thread other than the main one starts. */
+void arena_setup(int count);
+
+/* Returns the number of arenas. */
+int arena_count();
+
+/* Returns the i-th arena. */
+struct arena *arena_at(int i);
+
+/* Returns the calling thread's arena, assigning one if necessary. */
+struct arena *arena_get();
+
+/* Enables or disables transparent huge pages for large heaps. Must be called
+ * before any thread other than the main one starts. */
+void huge_pages_setup(bool enabled);
+
+/* Returns the size in words of the largest block a heap segment can hold. */
+intptr_t arena_max_block();
+
+/* Extends the segment's heap so that its last block is free and at least
+ * size words large. The arena's lock must be held.
+ * Returns a pointer to the last block, which is in the free list, or NULL if
+ * the segment is too small. */
+intptr_t *segment_extend(struct arena *arena, struct segment *seg,
+        intptr_t size);
+
+/* Extends the arena's most recent segment, or maps a new one, so that a free
+ * block of at least size words is available. The arena's lock must be held.
+ * Returns a pointer to the block, which is in the free list, or NULL in case
+ * of failure. */
+intptr_t *arena_extend(struct arena *arena, intptr_t size);
+
+/* Unmaps seg if its heap is empty and it is not the arena's most recent
+ * segment. Otherwise moves its heap's end down to keep pad bytes past the
+ * last allocated block and drops the pages past the end. The arena's lock
+ * must be held.
+ * Returns the number of bytes released. */
+size_t segment_trim(struct arena *arena, struct segment *seg, size_t pad);
+
+/* Purges every free block of the arena, then trims each segment, keeping pad
+ * bytes at the end of the most recent one. The arena's lock must be held.
+ * Returns the number of bytes released. */
+size_t arena_trim(struct arena *arena, size_t pad);
+
+/* Sets the number of bytes each arena's fast bins may hold before they are
+ * consolidated, 0 disabling them. */
+void fast_setup(size_t bytes);
+
+/* Returns the number of bytes each arena's fast bins may hold. */
+size_t fast_budget();
+
+/* Sets the decay time in milliseconds. */
+void decay_setup(long ms);
+
+/* Returns the decay time in milliseconds. */
+long decay_time();
+
+/* Returns the current time in milliseconds, never 0. */
+uint64_t decay_now();
+
+/* Starts the background thread running decay passes over every arena. */
+void decay_start();
+
+/* Marks the free block, which holds the size words just freed at freed,
+ * dirty since now unless it already was. With a decay time of 0, purges the
+ * freed words and trims the block's segment right away instead. Otherwise
+ * runs a decay pass if one is due. The arena's lock must be held. */
+void arena_dirty(struct arena *arena, intptr_t *block, intptr_t *freed,
+        intptr_t size);
+
+/* Purges the free blocks of the arena dirty since before now minus the decay
+ * time and trims the segments ending with a clean free block. The arena's
+ * lock must be held.
+ * Returns the number of bytes released. */
+size_t arena_decay(struct arena *arena, uint64_t now);
+
+/* Sets the direct threshold in bytes. 0 selects the adaptive threshold. */
+void direct_setup(size_t threshold);
+
+/* Returns the current direct threshold in bytes. */
+size_t direct_threshold();
+
+/* Returns true iff a block of size words should get a direct segment. */
+bool direct_wanted(intptr_t size);
+
+/* Maps a direct segment holding an allocated block at least size words large
+ * and aligned on align bytes, a power of two of at most SEGMENT_SIZE / 2.
+ * Returns a pointer to the block or NULL in case of failure. */
+intptr_t *direct_alloc(intptr_t size, size_t align);
+
+/* Resizes the direct segment holding block to hold at least size words,
+ * moving its pages without copying them if it cannot grow in place. The
+ * block keeps its alignment.
+ * Returns a pointer to the block, which may have moved, or NULL in case of
+ * failure, leaving the block untouched. */
+intptr_t *direct_realloc(intptr_t *block, intptr_t size);
+
+/* Faults in the pages holding the first n_bytes bytes of the block of a
+ * direct segment at once, ahead of writing them all. */
+void direct_populate(intptr_t *block, size_t n_bytes);
+
+/* Unmaps the direct segment holding block, adjusting the adaptive direct
+ * threshold. */
+void direct_free(intptr_t *block);
+
+#ifdef YA_DEBUG
+/* Prints every block of the arena, then its free list. */
+void arena_print(struct arena *arena);
+
+/* Checks each segment of the arena and each block for consistency, and the
+ * fast bins. Does not check the free list. The arena's lock must be held.
+ * Returns -1 on error, the total number of free blocks otherwise. */
+int arena_check(struct arena *arena);
+#endif
+
+#endif // ndef YA_ARENA_H
@@ -1,25 +1,17 @@
 /*
  * Yet Another Malloc
  * ya_block.c
- * Defines operations on blocks and boundary tags
+ * Defines operations on blocks and their headers and footers
  */
 
-/*---------------------*/
-/* Feature test macros */
-/*---------------------*/
-
-#define _DEFAULT_SOURCE // for sbrk
-
 /*----------*/
 /* Includes */
 /*----------*/
 
-#include <unistd.h>
 #include <stdio.h>
 
 #include "ya_debug.h"
 #include "ya_block.h"
-#include "ya_freelist.h"
 
 /*-----------*/
 /* Constants */
@@ -27,74 +19,45 @@
 
 /* big enough to hold a pointer */
 static const size_t WORD_SIZE = sizeof(intptr_t);
-/* request memory 8k by 8k from OS */
-static const size_t CHUNK_SIZE = 8192;
-/* smallest non-empty dword-aligned block with 4 boundary tags */
-static const size_t MIN_BLOCK_SIZE = 6;
-
-/*---------*/
-/* Globals */
-/*---------*/
-
-intptr_t *heap_start = NULL; // with space for 2 words before
-intptr_t *heap_end = NULL;   // first block outside heap
-
-/*---------*/
-/* Inlines */
-/*---------*/
-
-/* Returns the smallest number p such that n <= p*m. */
-static inline intptr_t round_div(intptr_t n, intptr_t m) {
-    return (n + m - 1) / m;
-}
-
-/* Returns the smallest multiple of m that is >= n. */
-static inline intptr_t round_to(intptr_t n, intptr_t m) {
-    return round_div(n,m) * m;
-}
-
-static inline intptr_t inner_bytes(intptr_t *block) {
-    return (block_size(block) - 4) * WORD_SIZE;
-}
 
 /*----------------------*/
 /* Function definitions */
 /*----------------------*/
 
-/* Initializes the block's boundary tags. */
-void block_init(intptr_t *block, intptr_t size) {
-    block[-1]     = size;
-    block[size-4] = size;
+/* Writes the header of a block of size words with the given flags, and its
+ * footer unless TAG_ALLOC is set. Does not touch the next block. */
+void block_init(intptr_t *block, intptr_t size, intptr_t flags) {
+    block[-1] = size * WORD_SIZE | flags;
+    if (!(flags & TAG_ALLOC)) {
+        block[size-2] = size * WORD_SIZE;
+    }
 }
 
-/* Sets the allocated bit in the block's boundary tags. */
+/* Marks the block allocated, and the next block's previous block too. */
 void block_alloc(intptr_t *block) {
     intptr_t size = block_size(block);
-    block[-1]     |= 1;
-    block[size-4] |= 1;
+    block[-1]     |= TAG_ALLOC;
+    block[size-1] |= TAG_PREV_ALLOC;
 }
 
-/* Erases the allocated bit in the block's boundary tags. */
+/* Marks the block free, writing its footer, and the next block's previous
+ * block too. */
 void block_free(intptr_t *block) {
     intptr_t size = block_size(block);
-    block[-1]     &= -2;
-    block[size-4] &= -2;
-}
-
-/* Fills block with zeros. */
-void block_clear(intptr_t *block) {
-    intptr_t *end = block + block_size(block) - 4;
-    for (intptr_t *p = block; p < end; p++) {
-        *p = 0;
-    }
+    block[-1]     &= ~TAG_ALLOC;
+    block[size-2] = size * WORD_SIZE;
+    block[size-1] &= ~TAG_PREV_ALLOC;
 }
 
 /* Returns the size in words of the smallest block that can
- * store n_bytes bytes. Takes alignment and boundary tags into account */
+ * store n_bytes bytes. Takes alignment and the header into account */
 intptr_t block_fit(size_t n_bytes) {
     intptr_t n_words = round_div(n_bytes, WORD_SIZE); // size in words
-    // round to dword and make space for tags 
-    intptr_t size = 4 + round_to(n_words, 2);
+    // make space for the header and round to dword
+    intptr_t size = round_to(n_words + 1, 2);
+    if (size < MIN_BLOCK_SIZE) {
+        size = MIN_BLOCK_SIZE;
+    }
     ya_debug("block_fit: requested = %ld, allocating = %ld * %ld = %ld\n",
             n_bytes, size, WORD_SIZE, size * WORD_SIZE);
     return size;
@@ -103,16 +66,13 @@ intptr_t block_fit(size_t n_bytes) {
 /* Tries to coalesce a block with its previous neighbor.
  * Returns a pointer to the coalesced block. */
 intptr_t *block_join_prev(intptr_t *block) {
-    if (block < heap_start + MIN_BLOCK_SIZE) {
-        return block; // there cannot be a previous block
-    }
-    intptr_t prev_size = tag_size(block[-4]);
-    intptr_t *prev = block - prev_size;
-    if (prev <= heap_start || block_is_alloc(prev)) {
+    if (block_prev_alloc(block)) {
         return block;
     }
+    intptr_t *prev = block_prev(block);
+    intptr_t prev_size = block_size(prev);
     intptr_t size = block_size(block);
-    block_init(prev, prev_size + size);
+    block_init(prev, prev_size + size, block_flags(prev));
     ya_debug("block_join_prev: joining %p:%ld and %p:%ld -> %p:%ld\n",
             block, size, prev, prev_size, prev, prev_size + size);
     return prev;
@@ -122,12 +82,12 @@ intptr_t *block_join_prev(intptr_t *block) {
  * Returns the unchanged pointer to the block. */
 intptr_t *block_join_next(intptr_t *block) {
     intptr_t size = block_size(block);
-    intptr_t *next = block + size;
-    if (next >= heap_end || block_is_alloc(next)) {
+    intptr_t *next = block_next(block);
+    if (block_is_alloc(next)) {
         return block;
     }
     intptr_t next_size = block_size(next);
-    block_init(block, size + next_size);
+    block_init(block, size + next_size, block_flags(block));
     ya_debug("block_join_next: joining %p:%ld and %p:%ld -> %p:%ld\n",
             block, size, next, next_size, block, size + next_size);
     return block;
@@ -141,144 +101,46 @@ intptr_t *block_join(intptr_t *block) {
     return block_join_next(block);
 }
 
-/* Split the block [block_size] into [size, block_size - size] if possible
+/* Split the block [block_size] into [size, block_size - size] if possible.
+ * The first block keeps its flags, the second one is free.
  * Returns a pointer to the second block or NULL if no split occurred. */
 intptr_t *block_split(intptr_t *block, intptr_t size) {
     intptr_t next_size = block_size(block) - size;
     if (next_size < MIN_BLOCK_SIZE) {
         return NULL; // not enough space to warrant a split
     }
-    block_init(block, size);
-    block_init(block + size, next_size);
-    return block + size;
-}
-
-/* Try to find a free block at least size min_size words large by walking the
- * boundary tags. Does not grow the heap.
- * Returns a pointer to the block or NULL in case of failure. */
-intptr_t *block_find(intptr_t min_size) {
-    intptr_t *block;
-    intptr_t size;
-    for (block = heap_start; block < heap_end; block += size) {
-        size = block_size(block);
-        if (!block_is_alloc(block) && min_size <= size) {
-            return block;
-        }
-    }
-    // could not find block
-    return NULL;
-}
-
-/* Initializes the heap by calling sbrk to allocate some starter memory.
- * Sets heap_start and heap_end to their appropriate values.
- * Returns the pointer to the start of the heap or NULL in case of failure. */
-intptr_t *heap_init() {
-    intptr_t size = block_fit(CHUNK_SIZE); 
-    void *ptr = sbrk(WORD_SIZE * (size + 2));
-    if (ptr == (void*) -1) {
-        heap_start = NULL;
-        heap_end = NULL;
-        return NULL;
-    }
-    heap_start     = ptr; // cast to intptr_t *
-    heap_start    += 2; // space for the first block's tags + dword alignment
-    heap_end       = heap_start + size;
-    block_init(heap_start, size);
-    fl_free(heap_start);
-    ya_debug("heap_init: start = %p, end = %p, size = %ld\n",
-            heap_start, heap_end, size);
-    return heap_start;
-}
-
-/* Extends the heap enough for the last block to be at least n_bytes bytes
- * large by calling sbrk.
- * Returns a pointer to the last (free) block or NULL in case of failure. */
-intptr_t *heap_extend(size_t n_bytes) {
-    intptr_t *last = fl_get_end();
-    if (last) {
-        intptr_t last_bytes = inner_bytes(last);
-        if (last_bytes >= n_bytes) {
-            return last;
-        }
-        n_bytes -= last_bytes;
-    }
-    // request an integer number of blocks
-    intptr_t size = block_fit(round_to(n_bytes, CHUNK_SIZE));
-    void *ptr = sbrk(WORD_SIZE * size);
-    if (ptr == (void *) -1) {
-        return NULL;
-    }
-    intptr_t *block = ptr; // == old heap_end
-    heap_end        = block + size;
-    block_init(block, size);
-    fl_free(block);
-    fl_join(block);
-    block = block_join(block);
-    ya_debug("heap_extend: old end = %p, new end = %p, size = %ld\n",
-            block, heap_end, size);
-    ya_print_blocks();
-    return block;
+    intptr_t flags = block_flags(block);
+    block_init(block, size, flags);
+    intptr_t *next = block + size;
+    block_init(next, next_size, flags & TAG_ALLOC ? TAG_PREV_ALLOC : 0);
+    next[next_size-1] &= ~TAG_PREV_ALLOC;
+    return next;
 }
 
 #ifdef YA_DEBUG
 
-/* Checks one block for consistency. Does not check the free list tags.
+/* Checks one block for consistency. Does not check the free list words.
  * Returns -1 on error, 0 otherwise. */
 int block_check(intptr_t *block) {
-    if ((intptr_t) block & (WORD_SIZE-1)) {
+    if ((intptr_t) block & (2*WORD_SIZE-1)) {
         ya_debug("block_check(%p): not aligned\n", block);
         return -1;
     }
     intptr_t size = block_size(block);
-    if (size & 1) {
-        ya_debug("block_check(%p): size %ld not aligned\n", block, size);
-        return -1;
-    }
-    if (block[-1] != block[size-4]) {
-        ya_debug("block_check(%p): tags don't match %ld != %ld\n",
-                block, block[-1], block[size-4]);
-        return -1;
-    }
-    return 0;
-}
-
-/* Checks the heap and each block for consistency.
- * Does not check the free list.
- * Returns -1 on error, the total number of free blocks otherwise. */
-int heap_check() {
-    if (!heap_start || !heap_end) {
-        ya_debug("heap_check: heap not initialized correctly %p-%p\n",
-                heap_start, heap_end);
+    if (size & 1 || size < MIN_BLOCK_SIZE) {
+        ya_debug("block_check(%p): size %ld invalid\n", block, size);
         return -1;
     }
-    if ((intptr_t) heap_start & (WORD_SIZE-1)) {
-        ya_debug("heap_check: heap start %p not aligned\n", heap_start);
+    if (!block_is_alloc(block) && block[size-2] != size * WORD_SIZE) {
+        ya_debug("block_check(%p): footer doesn't match %ld != %ld\n",
+                block, block[size-2], size * WORD_SIZE);
         return -1;
     }
-    if ((intptr_t) heap_end & (WORD_SIZE-1)) {
-        ya_debug("heap_check: heap end %p not aligned\n", heap_end);
+    if (block_prev_alloc(block + size) != block_is_alloc(block)) {
+        ya_debug("block_check(%p): next block's flags don't match\n", block);
         return -1;
     }
-    if ((heap_end - heap_start) & 1) {
-        ya_debug("heap_check: heap size %p not aligned\n",
-                heap_end - heap_start);
-        return -1;
-    }
-    int num_free = 0;
-    bool prev_free = false;
-    intptr_t *block;
-    for (block = heap_start; block < heap_end; block += block_size(block)) {
-        if (block_check(block)) {
-            return -1;
-        }
-        if (prev_free && !block_is_alloc(block)) {
-            ya_debug("heap_check: block %p and prev are both free\n", block);
-            return -1;
-        }
-        prev_free = !block_is_alloc(block);
-        num_free += prev_free;
-    }
-    return num_free;
+    return 0;
 }
 
 void block_print_range(intptr_t *start, intptr_t *end) {
@@ -5,11 +5,30 @@
 
 /* Block layout:
  *
- * -2     -1     0                               size-4 size-3
- * +------+------+-------- - - - - - - - --------+------+------+
- * | prev | size | data...                       | size | next |
- * +------+------+-------- - - - - - - - --------+------+------+
+ * Allocated block:
  *
+ * -1     0                                    size-1
+ * +------+-------- - - - - - - - - - --------+
+ * | head | data...                           |
+ * +------+-------- - - - - - - - - - --------+
+ *
+ * Free block:
+ *
+ * -1     0                             size-2 size-1
+ * +------+-------- - - - - - - --------+------+
+ * | head | free list words...          | foot |
+ * +------+-------- - - - - - - --------+------+
+ *
+ * The header holds the block's size in bytes, a multiple of a dword, and
+ * flags in its low bits: whether the block is allocated, whether the previous
+ * block is, and whether the block waits in a fast bin (see ya_arena.h). The footer, the size in bytes, exists only while the
+ * block is free: it lets the next block find its free neighbor to coalesce
+ * with, and is part of the data otherwise. An allocated block thus costs a
+ * single word on top of its data.
+ *
+ * Every heap starts with a block whose previous block counts as allocated and
+ * ends with an allocated header of size 0 (see ya_arena.h), so a block's
+ * neighbors are never coalesced across heaps.
  */
 
 #ifndef YA_BLOCK_H
@@ -23,75 +42,95 @@
 #include <stdint.h> // for intptr_t
 #include <stdbool.h>
 
-/*---------*/
-/* Externs */
-/*---------*/
+/*-----------*/
+/* Constants */
+/*-----------*/
 
-extern intptr_t *heap_start; // with space for 2 words before
-extern intptr_t *heap_end  ; // first block outside heap
+/* smallest dword-aligned block with room for a header, two free list words
+ * and a footer */
+#define MIN_BLOCK_SIZE 4
+
+/* header flags */
+#define TAG_ALLOC      ((intptr_t) 1) // the block is allocated
+#define TAG_PREV_ALLOC ((intptr_t) 2) // the previous block is allocated
+#define TAG_FAST       ((intptr_t) 4) // the allocated block is in a fast bin
+#define TAG_FLAGS      (TAG_ALLOC | TAG_PREV_ALLOC | TAG_FAST)
 
 /*---------*/
 /* Inlines */
 /*---------*/
 
-/* Returns true iff the boundary tag has the allocated bit set. */
-static inline bool tag_is_alloc(intptr_t tag) {
-    return tag & 1;
+/* Returns the smallest number p such that n <= p*m. */
+static inline intptr_t round_div(intptr_t n, intptr_t m) {
+    return (n + m - 1) / m;
 }
 
-/* Returns true iff the block's boundary tag has the allocated bit set. */
-static inline bool block_is_alloc(intptr_t *block) {
-    return tag_is_alloc(block[-1]);
+/* Returns the smallest multiple of m that is >= n. */
+static inline intptr_t round_to(intptr_t n, intptr_t m) {
+    return round_div(n,m) * m;
 }
 
-/* Returns the size stored in the boundary tag. */
+/* Returns the size in words stored in a header or footer. */
 static inline intptr_t tag_size(intptr_t tag) {
-    return tag & -2;
+    return (tag & ~TAG_FLAGS) / (intptr_t) sizeof(intptr_t);
+}
+
+/* Returns the header flags of the block. */
+static inline intptr_t block_flags(intptr_t *block) {
+    return block[-1] & TAG_FLAGS;
 }
 
-/* Returns the size stored in the block's boundary tag. */
+/* Returns true iff the block is allocated. */
+static inline bool block_is_alloc(intptr_t *block) {
+    return block[-1] & TAG_ALLOC;
+}
+
+/* Returns true iff the block preceding block in the heap is allocated. */
+static inline bool block_prev_alloc(intptr_t *block) {
+    return block[-1] & TAG_PREV_ALLOC;
+}
+
+/* Returns the size of the block in words. */
 static inline intptr_t block_size(intptr_t *block) {
     return tag_size(block[-1]);
 }
 
+/* Returns the block preceding block in the heap, which must be free. */
+static inline intptr_t *block_prev(intptr_t *block) {
+    return block - tag_size(block[-2]);
+}
+
+/* Returns the block following block in the heap. */
+static inline intptr_t *block_next(intptr_t *block) {
+    return block + block_size(block);
+}
+
 /*--------------*/
 /* Declarations */
 /*--------------*/
 
-/* Initializes the heap by calling sbrk to allocate some starter memory.
- * Sets heap_start and heap_end to their appropriate values.
- * Returns the pointer to the start of the heap or NULL in case of failure. */
-intptr_t *heap_init();
-
-/* Extends the heap enough for the last block to be at least n_bytes bytes
- * large by calling sbrk.
- * Returns a pointer to the last (free) block or NULL in case of failure. */
-intptr_t *heap_extend(size_t n_bytes);
-
 #ifdef YA_DEBUG
 /* Prints each block in the range from the block at start to the one at end */
 void block_print_range(intptr_t *start, intptr_t *end);
 
-/* Checks the heap and each block for consistency.
- * Does not check the free list.
- * Returns -1 on error, the total number of free blocks otherwise. */
-int heap_check();
+/* Checks one block for consistency. Does not check the free list words.
+ * Returns -1 on error, 0 otherwise. */
+int block_check(intptr_t *block);
 #endif
 
-/* Initializes the block's boundary tags. */
-void block_init(intptr_t *block, intptr_t size);
+/* Writes the header of a block of size words with the given flags, and its
+ * footer unless TAG_ALLOC is set. Does not touch the next block. */
+void block_init(intptr_t *block, intptr_t size, intptr_t flags);
 
-/* Sets the allocated bit in the block's boundary tags. */
+/* Marks the block allocated, and the next block's previous block too. */
 void block_alloc(intptr_t *block);
 
-/* Erases the allocated bit in the block's boundary tags. */
+/* Marks the block free, writing its footer, and the next block's previous
+ * block too. */
 void block_free(intptr_t *block);
 
-/* Fills block with zeros. */
-void block_clear(intptr_t *block);
-
 /* Returns the size in words of the smallest block that can
- * store n_bytes bytes. Takes alignment and boundary tags into account */
+ * store n_bytes bytes. Takes alignment and the header into account */
 intptr_t block_fit(size_t n_bytes);
 
 /* Tries to coalesce a block with its previous neighbor.
@@ -106,13 +145,9 @@ intptr_t *block_join_next(intptr_t *block);
  * Returns a pointer to the coalesced block. */
 intptr_t *block_join(intptr_t *block);
 
-/* Split the block [block_size] into [size, block_size - size] if possible
+/* Split the block [block_size] into [size, block_size - size] if possible.
+ * The first block keeps its flags, the second one is free.
  * Returns a pointer to the second block or NULL if no split occurred. */
 intptr_t *block_split(intptr_t *block, intptr_t size);
 
-/* Try to find a free block at least min_size words large by walking the
- * boundary tags. Does not grow the heap.
- * Returns a pointer to the block or NULL in case of failure. */
-intptr_t *block_find(intptr_t min_size);
-
 #endif
@@ -16,215 +16,450 @@
 /* Globals */
 /*---------*/
 
-intptr_t *fl_start = NULL; // sorted increasing
-intptr_t *fl_end = NULL;   // sorted decreasing
+enum fl_policy fl_policy = FL_FIRST_FIT;
+
+/*---------*/
+/* Helpers */
+/*---------*/
+
+/* Returns true iff block a is ordered before block b in their bin. */
+static inline bool fl_less(intptr_t *a, intptr_t *b) {
+    if (fl_policy == FL_BEST_FIT && block_size(a) != block_size(b)) {
+        return block_size(a) < block_size(b);
+    }
+    return a < b;
+}
+
+/* Recomputes block's max field from its size and its children. */
+static void fl_update(intptr_t *block) {
+    intptr_t max = block_size(block);
+    intptr_t *left = fl_left(block);
+    intptr_t *right = fl_right(block);
+    if (left && fl_max(left) > max) {
+        max = fl_max(left);
+    }
+    if (right && fl_max(right) > max) {
+        max = fl_max(right);
+    }
+    fl_set_max(block, max);
+}
+
+/* Replaces child with new_child as parent's child, or as the root of bin if
+ * parent is NULL. */
+static void fl_replace_child(struct freelist *fl, int bin, intptr_t *parent, intptr_t *child,
+        intptr_t *new_child) {
+    if (new_child) {
+        fl_set_parent(new_child, parent);
+    }
+    if (!parent) {
+        fl->root[bin] = new_child;
+    } else if (fl_left(parent) == child) {
+        fl_set_left(parent, new_child);
+    } else {
+        fl_set_right(parent, new_child);
+    }
+}
+
+/* Rotates block above its parent, preserving address order. */
+static void fl_rotate_up(struct freelist *fl, int bin, intptr_t *block) {
+    intptr_t *parent = fl_parent(block);
+    fl_replace_child(fl, bin, fl_parent(parent), parent, block);
+    if (fl_left(parent) == block) {
+        intptr_t *inner = fl_right(block);
+        fl_set_left(parent, inner);
+        if (inner) {
+            fl_set_parent(inner, parent);
+        }
+        fl_set_right(block, parent);
+    } else {
+        intptr_t *inner = fl_left(block);
+        fl_set_right(parent, inner);
+        if (inner) {
+            fl_set_parent(inner, parent);
+        }
+        fl_set_left(block, parent);
+    }
+    fl_set_parent(parent, block);
+    fl_update(parent);
+    fl_update(block);
+}
+
+/* Returns the first block in the subtree rooted at block. */
+static intptr_t *fl_first(intptr_t *block) {
+    while (fl_left(block)) {
+        block = fl_left(block);
+    }
+    return block;
+}
+
+/* Returns the lowest-addressed block at least min_size words long in the
+ * subtree rooted at block, or NULL if there is none. */
+static intptr_t *fl_first_fit(intptr_t *block, intptr_t min_size) {
+    if (!block || fl_max(block) < min_size) {
+        return NULL;
+    }
+    for (;;) {
+        intptr_t *left = fl_left(block);
+        if (left && fl_max(left) >= min_size) {
+            block = left;
+        } else if (block_size(block) >= min_size) {
+            return block;
+        } else {
+            block = fl_right(block); // must hold the fitting block
+        }
+    }
+}
+
+/* Returns the smallest, then lowest-addressed, block at least min_size words
+ * long in the subtree rooted at block, or NULL if there is none. */
+static intptr_t *fl_best_fit(intptr_t *block, intptr_t min_size) {
+    intptr_t *best = NULL;
+    while (block) {
+        if (block_size(block) >= min_size) {
+            best = block;
+            block = fl_left(block);
+        } else {
+            block = fl_right(block);
+        }
+    }
+    return best;
+}
 
 /*-----------*/
 /* Functions */
 /*-----------*/
 
-/* Splices the allocated block out of the free list. */
-void fl_alloc(intptr_t *block) {
-    intptr_t size  = block_size(block);
-    intptr_t *prev = fl_prev(block);
-    intptr_t *next = fl_next(block);
-    fl_set_prev(block, NULL);
-    fl_set_next(block, NULL);
+/* Selects the allocation policy. Must be called while all free lists are
+ * empty. */
+void fl_init(enum fl_policy policy) {
+    fl_policy = policy;
+}
+
+/* Splices the block out of the first bin's list. */
+static void fl_list_alloc(struct freelist *fl, intptr_t *block) {
+    intptr_t *next = fl_list_next(block);
+    intptr_t *prev = fl_list_prev(block);
     if (prev) {
-        fl_set_next(prev, next);
+        fl_set_list_next(prev, next);
     } else {
-        fl_start = next;
+        fl->root[0] = next;
     }
     if (next) {
-        fl_set_prev(next, prev);
-    } else {
-        fl_end = prev;
+        fl_set_list_prev(next, prev);
+    }
+    if (!fl->root[0]) {
+        fl->bitmap &= ~(uint64_t) 1;
     }
 }
 
-/* Adds the freed block to the appropriate in the free list, which is kept
- * in sorted increasing order. */
-void fl_free(intptr_t *block) {
-    if (!fl_start && !fl_end) {
-        // add to empty list
-        fl_set_prev(block, NULL);
-        fl_set_next(block, NULL);
-        fl_start = block;
-        fl_end = block;
-        return;
+/* Pushes the block onto the first bin's list. */
+static void fl_list_free(struct freelist *fl, intptr_t *block) {
+    intptr_t *next = fl->root[0];
+    fl_set_list_next(block, next);
+    fl_set_list_prev(block, NULL);
+    if (next) {
+        fl_set_list_prev(next, block);
     }
-    if (block < fl_start) {
-        // preprend block to the free list
-        fl_set_prev(block, NULL);
-        fl_set_next(block, fl_start);
-        fl_set_prev(fl_start, block);
-        fl_start = block;
+    fl->root[0] = block;
+    fl->bitmap |= 1;
+}
+
+/* Splices the allocated block out of its bin. */
+void fl_alloc(struct freelist *fl, intptr_t *block) {
+    int bin = fl_bin(block_size(block));
+    fl->n_blocks--;
+    fl->n_words -= block_size(block);
+    if (!bin) {
+        fl_list_alloc(fl, block);
         return;
     }
-    if (block > fl_end) {
-        // append block to the free list
-        fl_set_prev(block, fl_end);
-        fl_set_next(block, NULL);
-        fl_set_next(fl_end, block);
-        fl_end = block;
-        return;
+    // rotate block down until it has at most one child
+    for (;;) {
+        intptr_t *left = fl_left(block);
+        intptr_t *right = fl_right(block);
+        if (left && right) {
+            if (fl_priority(left) > fl_priority(right)) {
+                fl_rotate_up(fl, bin, left);
+            } else {
+                fl_rotate_up(fl, bin, right);
+            }
+            continue;
+        }
+        intptr_t *parent = fl_parent(block);
+        fl_replace_child(fl, bin, parent, block, left ? left : right);
+        for (; parent; parent = fl_parent(parent)) {
+            fl_update(parent);
+        }
+        break;
     }
-    // splice the block in the middle of the list
-    intptr_t *next;
-    for (next = fl_start; next && next < block; next = fl_next(next)) {
-        // *whistle*
+    fl_set_left(block, NULL);
+    fl_set_right(block, NULL);
+    fl_set_parent(block, NULL);
+    if (!fl->root[bin]) {
+        fl->bitmap &= ~((uint64_t) 1 << bin);
     }
-    intptr_t *prev = fl_prev(next);
-    fl_set_prev(block, prev);
-    fl_set_next(block, next);
-    fl_set_prev(next, block);
-    fl_set_next(prev, block);
 }
 
-/* Returns the first block in the free list at min_size words long.
- * Returns NULL if no adequate block is found. Does not grow the heap. */
-intptr_t *fl_find(intptr_t min_size) {
-    for (intptr_t *block = fl_start; block != NULL; block = fl_next(block)) {    
-        if (min_size <= block_size(block)) {
-            return block;
+/* Adds the freed block to its bin, keeping the bin in order. */
+void fl_free(struct freelist *fl, intptr_t *block) {
+    intptr_t size = block_size(block);
+    int bin = fl_bin(size);
+    fl->n_blocks++;
+    fl->n_words += size;
+    if (!bin) {
+        fl_list_free(fl, block);
+        return;
+    }
+    fl_set_left(block, NULL);
+    fl_set_right(block, NULL);
+    fl_set_max(block, size);
+    // insert as a leaf, raising the max of each ancestor on the way down
+    intptr_t *parent = NULL;
+    intptr_t *node = fl->root[bin];
+    while (node) {
+        parent = node;
+        if (fl_max(node) < size) {
+            fl_set_max(node, size);
         }
+        node = fl_less(block, node) ? fl_left(node) : fl_right(node);
     }
-    return NULL;
-}
-
-/* Mends the free list after a free block has just been split into two blocks,
- * block and new_next. */
-void fl_mend_split(intptr_t *block, intptr_t *new_next) {
-    if (!new_next) {
-        return; // block was not split
+    fl_set_parent(block, parent);
+    if (!parent) {
+        fl->root[bin] = block;
+        fl->bitmap |= (uint64_t) 1 << bin;
+        return;
     }
-    intptr_t *old_next = fl_next(new_next);
-    fl_set_next(block, new_next);
-    fl_set_prev(new_next, block);
-    if (old_next) {
-        fl_set_prev(old_next, new_next);
+    if (fl_less(block, parent)) {
+        fl_set_left(parent, block);
     } else {
-        fl_end = new_next;
+        fl_set_right(parent, block);
+    }
+    // restore the heap property on priorities
+    uint64_t priority = fl_priority(block);
+    while (fl_parent(block) && fl_priority(fl_parent(block)) < priority) {
+        fl_rotate_up(fl, bin, block);
     }
 }
 
-void fl_join_next(intptr_t *block) {
-    intptr_t *next = block + block_size(block);
-    if (fl_next(block) == next) {
-        // skip a block
-        ya_debug("fl_join_next: %p:%ld + %p:%ld -> %p:%ld\n",
-                block, block_size(block), next, block_size(next),
-                block, block_size(block) + block_size(next));
-        fl_set_next(block, fl_next(next));
-        fl_set_prev(next, fl_prev(block));
-        if (fl_next(next) == NULL) {
-            fl_end = block;
-        }
+/* Returns a free block at least min_size words long: the first fitting block
+ * in min_size's bin according to the policy, or else the first block of the
+ * next non-empty bin.
+ * Returns NULL if no adequate block is found. Does not grow the heap. */
+intptr_t *fl_find(struct freelist *fl, intptr_t min_size) {
+    int bin = fl_bin(min_size);
+    intptr_t *block;
+    if (!bin) {
+        block = fl->root[0]; // every block of the first bin fits
+    } else if (fl_policy == FL_BEST_FIT) {
+        block = fl_best_fit(fl->root[bin], min_size);
+    } else {
+        block = fl_first_fit(fl->root[bin], min_size);
     }
+    if (block) {
+        return block;
+    }
+    // any block in a larger bin fits
+    uint64_t larger = fl->bitmap & ((~(uint64_t) 1) << bin);
+    if (!larger) {
+        return NULL;
+    }
+    return fl_first(fl->root[__builtin_ctzll(larger)]);
 }
 
-void fl_join_prev(intptr_t *block) {
-    intptr_t *free_prev = fl_prev(block);
-    if (!free_prev) {
-        return;
+/* Calls visit on every block of the subtree rooted at block. */
+static void fl_visit_tree(intptr_t *block,
+        void (*visit)(intptr_t *block, void *arg), void *arg) {
+    while (block) {
+        fl_visit_tree(fl_left(block), visit, arg);
+        intptr_t *right = fl_right(block);
+        visit(block, arg);
+        block = right;
     }
-    // will not segfault because there is at least one block preceding
-    intptr_t *prev = block - block[-4];
-    if (prev == free_prev) {
-        ya_debug("fl_join_prev: %p:%ld + %p:%ld -> %p:%ld\n",
-                block, block_size(block), prev, block_size(prev),
-                prev, block_size(block) + block_size(prev));
-        fl_set_prev(block, fl_prev(prev));
-        fl_set_next(prev, fl_next(block));
-        if (fl_next(block) == NULL) {
-            fl_end = prev;
+}
+
+/* Calls visit on every block of the free list at least min_size words long,
+ * and on some shorter blocks sharing a bin with them. visit must not change
+ * the free list. */
+void fl_visit(struct freelist *fl, intptr_t min_size,
+        void (*visit)(intptr_t *block, void *arg), void *arg) {
+    uint64_t bins = fl->bitmap & (~(uint64_t) 0 << fl_bin(min_size));
+    if (bins & 1) {
+        intptr_t *block = fl->root[0];
+        while (block) {
+            intptr_t *next = fl_list_next(block);
+            visit(block, arg);
+            block = next;
         }
+        bins &= ~(uint64_t) 1;
+    }
+    while (bins) {
+        int bin = __builtin_ctzll(bins);
+        fl_visit_tree(fl->root[bin], visit, arg);
+        bins &= bins - 1;
     }
 }
 
-void fl_join(intptr_t *block) {
-    fl_join_next(block);
-    fl_join_prev(block);
+/* Splices block's next neighbor out of its bin if it is free, so that
+ * the two may be coalesced. */
+void fl_join_next(struct freelist *fl, intptr_t *block) {
+    intptr_t *next = block_next(block);
+    if (!block_is_alloc(next)) {
+        ya_debug("fl_join_next: %p:%ld + %p:%ld\n",
+                block, block_size(block), next, block_size(next));
+        fl_alloc(fl, next);
+    }
 }
 
-/* Returns a pointer to the first free block. */
-intptr_t *fl_get_start() {
-    return fl_start;
+/* Splices block's previous neighbor out of its bin if it is free, so that
+ * the two may be coalesced. */
+void fl_join_prev(struct freelist *fl, intptr_t *block) {
+    if (!block_prev_alloc(block)) {
+        intptr_t *prev = block_prev(block);
+        ya_debug("fl_join_prev: %p:%ld + %p:%ld\n",
+                block, block_size(block), prev, block_size(prev));
+        fl_alloc(fl, prev);
+    }
 }
 
-/* Returns a pointer to the last free block. */
-intptr_t *fl_get_end() {
-    return fl_end;
+/* Splices both of block's free neighbors out of their bins. */
+void fl_join(struct freelist *fl, intptr_t *block) {
+    fl_join_next(fl, block);
+    fl_join_prev(fl, block);
 }
 
 #ifdef YA_DEBUG
 
-void fl_debug_print() {
-    for (intptr_t *block = fl_start; block != NULL; block = fl_next(block)) {
-        ya_debug("%p:%ld\n", block, block_size(block));
+/* Prints the subtree rooted at block in order. */
+static void fl_debug_print_tree(int bin, intptr_t *block) {
+    if (!block) {
+        return;
+    }
+    fl_debug_print_tree(bin, fl_left(block));
+    ya_debug("[%d] %p:%ld\n", bin, block, block_size(block));
+    fl_debug_print_tree(bin, fl_right(block));
+}
+
+void fl_debug_print(struct freelist *fl) {
+    for (intptr_t *block = fl->root[0]; block; block = fl_list_next(block)) {
+        ya_debug("[0] %p:%ld\n", block, block_size(block));
+    }
+    for (int bin = 1; bin < FL_NUM_BINS; bin++) {
+        fl_debug_print_tree(bin, fl->root[bin]);
     }
 }
 
-/* Checks that block's information is consistent. The previous pointer should
- * point to correct_prev, which was the previous free block during free list
- * iteration.
+/* Checks that block's information is consistent. Its parent pointer should
+ * point to parent, and it should be ordered between low and high.
  * Returns -1 on error, 0 otherwise. */
-int fl_check_one(intptr_t *block, intptr_t *correct_prev) {
-    if (block < heap_start || block >= heap_end) {
-        ya_debug("fl_check_one: block %p out of bounds\n", block);
+int fl_check_one(intptr_t *block, intptr_t *parent, int bin,
+        intptr_t *low, intptr_t *high) {
+    if (fl_bin(block_size(block)) != bin) {
+        ya_debug("fl_check_one: block %p:%ld in bin %d instead of %d\n",
+                block, block_size(block), bin, fl_bin(block_size(block)));
+        return -1;
+    }
+    if (block_is_alloc(block)) {
+        ya_debug("fl_check_one: block %p is allocated\n", block);
         return -1;
     }
-    intptr_t *prev = fl_prev(block);
-    if (prev && (prev < heap_start || prev >= heap_end)) {
-        ya_debug("fl_check_one: previous pointer %p out of bounds [%p,%p[\n",
-                prev, heap_start, heap_end);
+    if (fl_parent(block) != parent) {
+        ya_debug("fl_check_one(%p): parent pointer mismatch, "
+                "should be %p, not %p\n", block, parent, fl_parent(block));
         return -1;
     }
-    if (correct_prev != prev) {
-        ya_debug("fl_check_one(%p): previous pointer mismatch, "
-                "should be %p, not %p\n", block, correct_prev, prev);
+    if ((low && !fl_less(low, block)) || (high && !fl_less(block, high))) {
+        ya_debug("fl_check_one(%p): not sorted within ]%p,%p[\n",
+                block, low, high);
         return -1;
     }
-    intptr_t *next = fl_next(block);
-    if (next && (next < heap_start || next >= heap_end)) {
-        ya_debug("fl_check_one: next pointer %p out of bounds [%p,%p[\n",
-                next, heap_start, heap_end);
+    if (parent && fl_priority(parent) < fl_priority(block)) {
+        ya_debug("fl_check_one(%p): priority above parent %p\n",
+                block, parent);
+        return -1;
+    }
+    intptr_t max = fl_max(block);
+    fl_update(block);
+    if (fl_max(block) != max) {
+        ya_debug("fl_check_one(%p): max is %ld, not %ld\n",
+                block, max, fl_max(block));
         return -1;
     }
     return 0;
 }
 
-/* Checks the free list for consistency.
- * Returns -1 on error, the total number of free blocks otherwise. */
-int fl_check() {
-    if (!fl_start) {
-        if (fl_end) {
-            ya_debug("fl_check: fl_start == NULL but fl_end == %p\n", fl_end);
-            return -1;
-        }
+/* Checks the subtree rooted at block, which should be ordered between low
+ * and high.
+ * Returns -1 on error, the number of blocks in the subtree otherwise. */
+static int fl_check_tree(intptr_t *block, intptr_t *parent, int bin,
+        intptr_t *low, intptr_t *high) {
+    if (!block) {
         return 0;
     }
-    if (!fl_end) {
-        ya_debug("fl_check: fl_end == NULL but fl_start == %p\n", fl_start);
+    if (fl_check_one(block, parent, bin, low, high)) {
         return -1;
     }
-    if (fl_start < heap_start || fl_start >= heap_end) {
-        ya_debug("fl_check: fl_start %p out of bounds\n", fl_start);
+    int num_left = fl_check_tree(fl_left(block), block, bin, low, block);
+    if (num_left == -1) {
         return -1;
     }
-    if (fl_end < heap_start || fl_end >= heap_end) {
-        ya_debug("fl_check: fl_ebd %p out of bounds\n", fl_end);
+    int num_right = fl_check_tree(fl_right(block), block, bin, block, high);
+    if (num_right == -1) {
         return -1;
     }
+    return num_left + 1 + num_right;
+}
+
+/* Checks the first bin's list.
+ * Returns -1 on error, the number of blocks in the list otherwise. */
+static int fl_check_list(struct freelist *fl) {
     int num_free = 0;
     intptr_t *prev = NULL;
-    intptr_t *block;
-    for (block = fl_start; block; block = fl_next(block)) {
-        num_free++;
-        if (fl_check_one(block, prev)) {
+    for (intptr_t *block = fl->root[0]; block; block = fl_list_next(block)) {
+        if (block_size(block) != MIN_BLOCK_SIZE || block_is_alloc(block)) {
+            ya_debug("fl_check_list: block %p:%ld invalid\n",
+                    block, block_size(block));
+            return -1;
+        }
+        if (fl_list_prev(block) != prev) {
+            ya_debug("fl_check_list(%p): prev pointer mismatch, "
+                    "should be %p, not %p\n", block, prev, fl_list_prev(block));
             return -1;
         }
         prev = block;
+        num_free++;
+    }
+    return num_free;
+}
+
+/* Adds the size of block to the word count at arg. */
+static void fl_check_words(intptr_t *block, void *arg) {
+    *(size_t *) arg += block_size(block);
+}
+
+/* Checks the free list for consistency.
+ * Returns -1 on error, the total number of free blocks otherwise. */
+int fl_check(struct freelist *fl) {
+    int num_free = 0;
+    for (int bin = 0; bin < FL_NUM_BINS; bin++) {
+        bool bit = fl->bitmap & ((uint64_t) 1 << bin);
+        if (bit != !!fl->root[bin]) {
+            ya_debug("fl_check: bin %d root %p but bit %d\n",
+                    bin, fl->root[bin], bit);
+            return -1;
+        }
+        int num_bin = bin ? fl_check_tree(fl->root[bin], NULL, bin, NULL, NULL)
+                : fl_check_list(fl);
+        if (num_bin == -1) {
+            return -1;
+        }
+        num_free += num_bin;
+    }
+    size_t n_words = 0;
+    fl_visit(fl, MIN_BLOCK_SIZE, fl_check_words, &n_words);
+    if ((size_t) num_free != fl->n_blocks || n_words != fl->n_words) {
+        ya_debug("fl_check: %d blocks of %zu words, counted as %zu of %zu\n",
+                num_free, n_words, fl->n_blocks, fl->n_words);
+        return -1;
     }
     return num_free;
 }
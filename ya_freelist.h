@@ -3,15 +3,39 @@
  * ya_freelist.h
  */
 
-/* Block layout:
+/* Free block layout:
  *
- * -2     -1     0                               size-4 size-3
- * +------+------+-------- - - - - - - - --------+------+------+
- * | prev | size | data...                       | size | next |
- * +------+------+-------- - - - - - - - --------+------+------+
+ * -1     0        1     2      3       4             size-2 size-1
+ * +------+--------+-----+------+-------+---- - - ----+------+
+ * | head | parent | max | left | right | ...         | foot |
+ * +------+--------+-----+------+-------+---- - - ----+------+
+ *
+ * Blocks of MIN_BLOCK_SIZE words only have room for two words:
+ *
+ * -1     0      1      2
+ * +------+------+------+------+
+ * | head | next | prev | foot |
+ * +------+------+------+------+
  *
  */
 
+/* Free blocks are kept in segregated free lists, or bins, according to their
+ * size. Each of the small bins holds blocks of a single size, the large bins
+ * hold blocks whose size falls between two consecutive powers of two.
+ *
+ * Each bin is a treap threaded through the first four data words of its
+ * blocks: parent, the largest block size in the subtree, then left and right
+ * children. Priorities are derived from a hash of the block's address so they
+ * need no storage. Insertion and removal take O(log n) expected time. Blocks
+ * of MIN_BLOCK_SIZE words are too small for a treap node, so their bin, the
+ * first one, is a LIFO doubly-linked list instead. A bitmap records which
+ * bins are non-empty.
+ *
+ * Under the first-fit policy bins are ordered by address, and the max field
+ * lets fl_find() descend straight to the lowest-addressed block that fits.
+ * Under the best-fit policy bins are ordered by size then address, and
+ * fl_find() returns the smallest, then lowest-addressed, block that fits. */
+
 #ifndef YA_FREELIST_H
 #define YA_FREELIST_H
 
@@ -19,29 +43,110 @@
 /* Includes */
 /*----------*/
 
+#include <stddef.h> // for size_t
 #include <stdint.h> // for intptr_t
 
 #include "ya_block.h"
 #include "ya_debug.h"
 
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+#define FL_NUM_SMALL_BINS 32
+#define FL_NUM_BINS 64
+
+/* smallest block size that goes in a large bin */
+#define FL_SMALL_MAX (MIN_BLOCK_SIZE + 2 * FL_NUM_SMALL_BINS)
+
+/*-------*/
+/* Types */
+/*-------*/
+
+enum fl_policy {
+    FL_FIRST_FIT, // address-ordered first fit
+    FL_BEST_FIT,  // address-ordered best fit
+};
+
+/* The bins of one heap. */
+struct freelist {
+    intptr_t *root[FL_NUM_BINS]; // treap roots
+    uint64_t bitmap;             // bit i set iff bin i is non-empty
+    size_t n_blocks;             // blocks in the bins
+    size_t n_words;              // total size of the blocks in words
+};
+
 /*---------*/
 /* Inlines */
 /*---------*/
 
-static inline intptr_t *fl_prev(intptr_t *block) {
-    return (intptr_t *) block[-2];
+/* Returns the index of the bin holding blocks of the given size. */
+static inline int fl_bin(intptr_t size) {
+    if (size < FL_SMALL_MAX) {
+        return (size - MIN_BLOCK_SIZE) / 2;
+    }
+    // FL_SMALL_MAX lies between 2^6 and 2^7
+    int bin = FL_NUM_SMALL_BINS + (63 - __builtin_clzll(size)) - 6;
+    return bin < FL_NUM_BINS ? bin : FL_NUM_BINS - 1;
+}
+
+static inline intptr_t *fl_left(intptr_t *block) {
+    return (intptr_t *) block[2];
+}
+
+static inline intptr_t *fl_right(intptr_t *block) {
+    return (intptr_t *) block[3];
+}
+
+static inline intptr_t *fl_parent(intptr_t *block) {
+    return (intptr_t *) block[0];
 }
 
-static inline intptr_t *fl_next(intptr_t *block) {
-    return (intptr_t *) block[block_size(block)-3];
+/* Returns the size of the largest block in block's subtree. */
+static inline intptr_t fl_max(intptr_t *block) {
+    return block[1];
 }
 
-static inline void fl_set_prev(intptr_t *block, intptr_t *prev) {
-    block[-2] = (intptr_t) prev;   
+static inline void fl_set_left(intptr_t *block, intptr_t *left) {
+    block[2] = (intptr_t) left;
 }
 
-static inline void fl_set_next(intptr_t *block, intptr_t *next) {
-    block[block_size(block)-3] = (intptr_t) next;
+static inline void fl_set_right(intptr_t *block, intptr_t *right) {
+    block[3] = (intptr_t) right;
+}
+
+static inline void fl_set_parent(intptr_t *block, intptr_t *parent) {
+    block[0] = (intptr_t) parent;
+}
+
+static inline void fl_set_max(intptr_t *block, intptr_t max) {
+    block[1] = max;
+}
+
+/* Links of the blocks in the first bin. */
+static inline intptr_t *fl_list_next(intptr_t *block) {
+    return (intptr_t *) block[0];
+}
+
+static inline intptr_t *fl_list_prev(intptr_t *block) {
+    return (intptr_t *) block[1];
+}
+
+static inline void fl_set_list_next(intptr_t *block, intptr_t *next) {
+    block[0] = (intptr_t) next;
+}
+
+static inline void fl_set_list_prev(intptr_t *block, intptr_t *prev) {
+    block[1] = (intptr_t) prev;
+}
+
+/* Returns the treap priority of block, a hash of its address. */
+static inline uint64_t fl_priority(intptr_t *block) {
+    uint64_t x = (uint64_t) block;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
 }
 
 /*--------------*/
@@ -51,38 +156,45 @@ static inline void fl_set_next(intptr_t *block, intptr_t *next) {
 #ifdef YA_DEBUG
 
 /* Prints debug information about the free list. */
-void fl_debug_print();
+void fl_debug_print(struct freelist *fl);
 
 /* Checks the free list for consistency.
  * Returns -1 on error, the total number of free blocks otherwise. */
-int fl_check();
+int fl_check(struct freelist *fl);
 
 #endif
 
-/* Splices the allocated block out of the free list. */
-void fl_alloc(intptr_t *block);
-
-/* Adds the freed block to the appropriate place in free list. */
-void fl_free(intptr_t *block);
+/* Selects the allocation policy. Must be called while all free lists are
+ * empty. */
+void fl_init(enum fl_policy policy);
 
-/* Returns the first block in the free list at min_size words long.
- * Returns NULL if no adequate block is found. Does not grow the heap. */
-intptr_t *fl_find(intptr_t min_size);
+/* Splices the allocated block out of its bin. */
+void fl_alloc(struct freelist *fl, intptr_t *block);
 
-/* Mends the free list after a free block has just been split into two blocks,
- * block and new_next. */
-void fl_mend_split(intptr_t *block, intptr_t *new_next);
+/* Adds the freed block to the appropriate place in its bin. */
+void fl_free(struct freelist *fl, intptr_t *block);
 
-void fl_join_prev(intptr_t *block);
+/* Returns a free block at least min_size words long: the first fitting block
+ * in min_size's bin according to the policy, or else the first block of the
+ * next non-empty bin.
+ * Returns NULL if no adequate block is found. Does not grow the heap. */
+intptr_t *fl_find(struct freelist *fl, intptr_t min_size);
 
-void fl_join_next(intptr_t *block);
+/* Calls visit on every block of the free list at least min_size words long,
+ * and on some shorter blocks sharing a bin with them. visit must not change
+ * the free list. */
+void fl_visit(struct freelist *fl, intptr_t min_size,
+        void (*visit)(intptr_t *block, void *arg), void *arg);
 
-void fl_join(intptr_t *block);
+/* Splices block's previous neighbor out of its bin if it is free, so that
+ * the two may be coalesced. */
+void fl_join_prev(struct freelist *fl, intptr_t *block);
 
-/* Returns a pointer to the first free block. */
-intptr_t *fl_get_start();
+/* Splices block's next neighbor out of its bin if it is free, so that
+ * the two may be coalesced. */
+void fl_join_next(struct freelist *fl, intptr_t *block);
 
-/* Returns a pointer to the last free block. */
-intptr_t *fl_get_end();
+/* Splices both of block's free neighbors out of their bins. */
+void fl_join(struct freelist *fl, intptr_t *block);
 
 #endif
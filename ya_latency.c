@@ -0,0 +1,354 @@
+/*
+ * Yet Another Malloc
+ * ya_latency.c
+ */
+
+/*---------------------*/
+/* Feature test macros */
+/*---------------------*/
+
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h> // for atexit
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "ya_latency.h"
+#include "ya_stats.h" // for stats_add
+
+/*-------*/
+/* Types */
+/*-------*/
+
+struct lat_hist {
+    atomic_size_t counts[LAT_NUM_BUCKETS];
+    atomic_size_t ticks; // sum of the durations
+};
+
+struct lat_thread {
+    struct lat_hist hists[YA_LAT_OPS][YA_LAT_PATHS];
+    struct lat_thread *next; // other threads' histograms, or free records
+    struct lat_thread *prev;
+};
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+_Thread_local int lat_path __attribute__((tls_model("initial-exec"))) = 0;
+
+// initial-exec: see thread_arena in ya_arena.c
+static _Thread_local struct lat_thread *lat_thread
+        __attribute__((tls_model("initial-exec"))) = NULL;
+static _Thread_local bool lat_exited
+        __attribute__((tls_model("initial-exec"))) = false;
+
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lat_thread *lat_threads = NULL; // linked histograms
+static struct lat_thread *lat_pool = NULL;    // records of exited threads
+static struct lat_hist lat_totals[YA_LAT_OPS][YA_LAT_PATHS]; // exited threads
+static pthread_key_t lat_key;
+static bool lat_key_valid = false;
+static uint64_t lat_epoch_ticks = 0; // at the first record
+static uint64_t lat_epoch_ns = 0;
+static char lat_dump_path[256];
+
+static const char *const lat_op_names[YA_LAT_OPS] = {
+    "malloc", "free", "calloc", "realloc",
+};
+static const char *const lat_path_names[YA_LAT_PATHS] = {
+    "cache", "slab", "fast", "fit", "split", "coalesce", "inplace", "copy",
+    "extend", "direct",
+};
+
+/*---------*/
+/* Helpers */
+/*---------*/
+
+/* Returns the monotonic time in nanoseconds. */
+static uint64_t lat_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Adds the histogram from to the histogram to. The lock must be held, unless
+ * to is only written by the calling thread. */
+static void lat_merge(struct lat_hist *to, struct lat_hist *from) {
+    for (int bucket = 0; bucket < LAT_NUM_BUCKETS; bucket++) {
+        stats_add(&to->counts[bucket], from->counts[bucket]);
+    }
+    stats_add(&to->ticks, from->ticks);
+}
+
+/* Adds ticks to the histogram. */
+static inline void lat_add(struct lat_hist *hist, uint64_t ticks) {
+    stats_add(&hist->counts[lat_bucket(ticks)], 1);
+    stats_add(&hist->ticks, ticks);
+}
+
+/* Stores in sum the histogram of op that took path, or any path if path is
+ * YA_LAT_ANY_PATH, of every thread. */
+static void lat_sum(int op, int path, struct lat_hist *sum) {
+    *sum = (struct lat_hist) {0};
+    int first = path == YA_LAT_ANY_PATH ? 0 : path;
+    int last = path == YA_LAT_ANY_PATH ? YA_LAT_PATHS - 1 : path;
+    pthread_mutex_lock(&lat_lock);
+    for (int p = first; p <= last; p++) {
+        lat_merge(sum, &lat_totals[op][p]);
+        for (struct lat_thread *t = lat_threads; t; t = t->next) {
+            lat_merge(sum, &t->hists[op][p]);
+        }
+    }
+    pthread_mutex_unlock(&lat_lock);
+}
+
+/* Returns the number of nanoseconds per tick, measured since the first
+ * record, or 0 if there was none. */
+static double lat_ns_per_tick() {
+    pthread_mutex_lock(&lat_lock);
+    uint64_t ticks = lat_ticks() - lat_epoch_ticks;
+    uint64_t ns = lat_now_ns() - lat_epoch_ns;
+    bool recorded = lat_epoch_ns;
+    pthread_mutex_unlock(&lat_lock);
+    return recorded && ticks ? (double) ns / ticks : 0;
+}
+
+/* Returns the smallest duration in ticks counted in bucket. */
+static uint64_t lat_bucket_ticks(int bucket) {
+    if (bucket < (1 << LAT_SUB_BITS)) {
+        return bucket;
+    }
+    int e = (bucket >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    uint64_t mantissa = (1 << LAT_SUB_BITS)
+            + (bucket & ((1 << LAT_SUB_BITS) - 1));
+    return mantissa << (e - LAT_SUB_BITS);
+}
+
+/* Returns the duration in ticks under which lie a fraction q of those of
+ * hist, holding count, as the upper bound of its bucket. */
+static uint64_t lat_hist_quantile(struct lat_hist *hist, size_t count,
+        double q) {
+    size_t rank = q * count;
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    size_t seen = 0;
+    int bucket = 0;
+    for (; bucket < LAT_NUM_BUCKETS - 1; bucket++) {
+        seen += hist->counts[bucket];
+        if (seen > rank) {
+            break;
+        }
+    }
+    return lat_bucket_ticks(bucket + 1);
+}
+
+/* Links the calling thread's histograms, or counts in the totals if it is
+ * exiting or no memory is left for them, then records ticks. */
+static void lat_record_slow(int op, int path, uint64_t ticks) {
+    pthread_mutex_lock(&lat_lock);
+    if (!lat_epoch_ns) {
+        lat_epoch_ticks = lat_ticks();
+        lat_epoch_ns = lat_now_ns();
+    }
+    struct lat_thread *thread = NULL;
+    if (!lat_exited) {
+        thread = lat_pool;
+        if (thread) {
+            lat_pool = thread->next;
+            memset(thread, 0, sizeof(*thread));
+        } else {
+            thread = mmap(NULL, sizeof(struct lat_thread),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                    0);
+            thread = thread != MAP_FAILED ? thread : NULL;
+        }
+    }
+    if (!thread) {
+        lat_add(&lat_totals[op][path], ticks);
+        pthread_mutex_unlock(&lat_lock);
+        return;
+    }
+    thread->next = lat_threads;
+    if (lat_threads) {
+        lat_threads->prev = thread;
+    }
+    lat_threads = thread;
+    lat_thread = thread;
+    lat_add(&thread->hists[op][path], ticks);
+    pthread_mutex_unlock(&lat_lock);
+    // may allocate, which records through lat_thread
+    if (lat_key_valid) {
+        pthread_setspecific(lat_key, thread);
+    }
+}
+
+/* Folds the exiting thread's histograms into the totals and gives their
+ * record back to the pool. */
+static void lat_destroy(void *arg) {
+    struct lat_thread *thread = arg;
+    pthread_mutex_lock(&lat_lock);
+    for (int op = 0; op < YA_LAT_OPS; op++) {
+        for (int path = 0; path < YA_LAT_PATHS; path++) {
+            lat_merge(&lat_totals[op][path], &thread->hists[op][path]);
+        }
+    }
+    if (thread->prev) {
+        thread->prev->next = thread->next;
+    } else {
+        lat_threads = thread->next;
+    }
+    if (thread->next) {
+        thread->next->prev = thread->prev;
+    }
+    thread->next = lat_pool;
+    lat_pool = thread;
+    lat_thread = NULL;
+    lat_exited = true;
+    pthread_mutex_unlock(&lat_lock);
+}
+
+/* Dumps the histograms to the file named by lat_init. */
+static void lat_dump_at_exit() {
+    ya_latency_dump(lat_dump_path);
+}
+
+/*-----------*/
+/* Functions */
+/*-----------*/
+
+/* Creates the key whose destructor folds each thread's histograms into the
+ * totals when it exits, and has them dumped at exit to the file at path,
+ * standard error if path is "-", unless path is NULL. Must be called before
+ * any thread other than the main one starts. */
+void lat_init(const char *path) {
+    lat_key_valid = !pthread_key_create(&lat_key, lat_destroy);
+    if (path) {
+        snprintf(lat_dump_path, sizeof(lat_dump_path), "%s", path);
+        atexit(lat_dump_at_exit);
+    }
+}
+
+/* Adds ticks to the histogram of the operation op that took the path path,
+ * for the calling thread. */
+void lat_record(int op, int path, uint64_t ticks) {
+    struct lat_thread *thread = lat_thread;
+    if (!thread) {
+        lat_record_slow(op, path, ticks);
+        return;
+    }
+    lat_add(&thread->hists[op][path], ticks);
+}
+
+/* Fork handlers: the child gets a consistent list and a usable lock. The
+ * histograms of the threads that do not exist in the child stay linked. */
+void lat_prefork() {
+    pthread_mutex_lock(&lat_lock);
+}
+
+void lat_postfork_parent() {
+    pthread_mutex_unlock(&lat_lock);
+}
+
+void lat_postfork_child() {
+    pthread_mutex_init(&lat_lock, NULL);
+}
+
+/* Stores in counts, unless it is NULL, the histogram of the durations of op
+ * that took path, or any path if path is YA_LAT_ANY_PATH.
+ * Returns the number of operations counted, 0 for invalid arguments. */
+size_t ya_latency(int op, int path, size_t counts[YA_LAT_BUCKETS]) {
+    if (op < 0 || op >= YA_LAT_OPS || path < YA_LAT_ANY_PATH
+            || path >= YA_LAT_PATHS) {
+        return 0;
+    }
+    struct lat_hist sum;
+    lat_sum(op, path, &sum);
+    size_t count = 0;
+    for (int bucket = 0; bucket < LAT_NUM_BUCKETS; bucket++) {
+        count += sum.counts[bucket];
+        if (counts) {
+            counts[bucket] = sum.counts[bucket];
+        }
+    }
+    return count;
+}
+
+/* Returns the shortest duration in nanoseconds counted in bucket, or 0 if
+ * there is no such bucket. */
+double ya_latency_bucket_ns(int bucket) {
+    if (bucket < 0 || bucket >= LAT_NUM_BUCKETS) {
+        return 0;
+    }
+    return lat_bucket_ticks(bucket) * lat_ns_per_tick();
+}
+
+/* Returns the duration in nanoseconds under which lie a fraction q of those
+ * of op that took path, or any path if path is YA_LAT_ANY_PATH, rounded up to
+ * the bound of its bucket, or 0 if none was recorded. */
+double ya_latency_quantile(int op, int path, double q) {
+    if (op < 0 || op >= YA_LAT_OPS || path < YA_LAT_ANY_PATH
+            || path >= YA_LAT_PATHS) {
+        return 0;
+    }
+    struct lat_hist sum;
+    lat_sum(op, path, &sum);
+    size_t count = 0;
+    for (int bucket = 0; bucket < LAT_NUM_BUCKETS; bucket++) {
+        count += sum.counts[bucket];
+    }
+    if (!count) {
+        return 0;
+    }
+    return lat_hist_quantile(&sum, count, q) * lat_ns_per_tick();
+}
+
+/* Writes a table of the histograms recorded so far to the file at path, or to
+ * standard error if path is "-": for each operation and path taken, the
+ * number of operations, their mean duration and quantiles in nanoseconds.
+ * Returns 0 on success, -1 with errno set otherwise. */
+int ya_latency_dump(const char *path) {
+    bool to_stderr = !strcmp(path, "-");
+    FILE *file = to_stderr ? stderr : fopen(path, "w");
+    if (!file) {
+        return -1;
+    }
+    double ns_per_tick = lat_ns_per_tick();
+    fprintf(file, "%-8s %-9s %12s %10s %10s %10s %10s %10s\n", "op", "path",
+            "count", "mean_ns", "p50_ns", "p99_ns", "p99.9_ns", "max_ns");
+    for (int op = 0; op < YA_LAT_OPS; op++) {
+        for (int path = YA_LAT_ANY_PATH; path < YA_LAT_PATHS; path++) {
+            struct lat_hist sum;
+            lat_sum(op, path, &sum);
+            size_t count = 0;
+            for (int bucket = 0; bucket < LAT_NUM_BUCKETS; bucket++) {
+                count += sum.counts[bucket];
+            }
+            if (!count) {
+                continue;
+            }
+            fprintf(file, "%-8s %-9s %12zu %10.1f %10.1f %10.1f %10.1f "
+                    "%10.1f\n", lat_op_names[op],
+                    path == YA_LAT_ANY_PATH ? "any" : lat_path_names[path],
+                    count, (double) sum.ticks / count * ns_per_tick,
+                    lat_hist_quantile(&sum, count, 0.5) * ns_per_tick,
+                    lat_hist_quantile(&sum, count, 0.99) * ns_per_tick,
+                    lat_hist_quantile(&sum, count, 0.999) * ns_per_tick,
+                    lat_hist_quantile(&sum, count, 1) * ns_per_tick);
+        }
+    }
+    if (to_stderr) {
+        return fflush(file) ? -1 : 0;
+    }
+    return fclose(file) ? -1 : 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Yet Another Malloc
+ * ya_latency.h
+ */
+
+/* Latency histograms, recorded by builds with YA_INSTRUMENT defined.
+ *
+ * malloc, free, calloc and realloc read a cycle counter, the time stamp
+ * counter on x86-64 and the monotonic clock elsewhere, before and after their
+ * work, and add the difference to a histogram of the operation and of the
+ * slowest internal path it took, which the code along the way marks with
+ * lat_take. Histograms are log-linear: exact below 2^LAT_SUB_BITS ticks, then
+ * 2^LAT_SUB_BITS buckets per power of two, so that a bucket is at most 1/8th
+ * wide relative to its values. Each thread records into histograms of its
+ * own, mapped on its first operation, with plain loads and stores; reading
+ * them sums every thread's and those of exited threads under a lock, like the
+ * counters of ya_stats.h. Ticks are converted to nanoseconds with the rate
+ * measured between the first record and the reading.
+ *
+ * Without YA_INSTRUMENT, the inlines below compile to nothing, nothing is
+ * ever recorded and the histograms read as empty. */
+
+#ifndef YA_LATENCY_H
+#define YA_LATENCY_H
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stdint.h>
+
+#include "yamalloc.h"
+
+#if defined(YA_INSTRUMENT) && defined(__x86_64__)
+#include <x86intrin.h> // for __rdtsc
+#elif defined(YA_INSTRUMENT)
+#include <time.h>
+#endif
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* log2 of the number of buckets per power of two */
+#define LAT_SUB_BITS 3
+
+/* number of buckets: up to 2^40 ticks, longer operations counting in the
+ * last one */
+#define LAT_NUM_BUCKETS YA_LAT_BUCKETS
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+#ifdef YA_INSTRUMENT
+// initial-exec: see thread_arena in ya_arena.c
+extern _Thread_local int lat_path
+        __attribute__((tls_model("initial-exec")));
+#endif
+
+/*--------------*/
+/* Declarations */
+/*--------------*/
+
+/* Creates the key whose destructor folds each thread's histograms into the
+ * totals when it exits, and has them dumped at exit to the file at path,
+ * standard error if path is "-", unless path is NULL. Must be called before
+ * any thread other than the main one starts. */
+void lat_init(const char *path);
+
+/* Adds ticks to the histogram of the operation op that took the path path,
+ * for the calling thread. */
+void lat_record(int op, int path, uint64_t ticks);
+
+/* Fork handlers: the child gets a consistent list and a usable lock. */
+void lat_prefork();
+void lat_postfork_parent();
+void lat_postfork_child();
+
+/*---------*/
+/* Inlines */
+/*---------*/
+
+/* Returns the bucket of a duration of ticks. */
+static inline int lat_bucket(uint64_t ticks) {
+    if (ticks < (1 << LAT_SUB_BITS)) {
+        return ticks;
+    }
+    int e = 63 - __builtin_clzll(ticks);
+    int bucket = ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+            + (ticks >> (e - LAT_SUB_BITS) & ((1 << LAT_SUB_BITS) - 1));
+    return bucket < LAT_NUM_BUCKETS ? bucket : LAT_NUM_BUCKETS - 1;
+}
+
+/* Returns the cycle counter. */
+static inline uint64_t lat_ticks() {
+#if defined(YA_INSTRUMENT) && defined(__x86_64__)
+    return __rdtsc();
+#elif defined(YA_INSTRUMENT)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+/* Starts timing an operation of the calling thread, on the fastest path.
+ * Returns the start time, for lat_end. */
+static inline uint64_t lat_start() {
+#ifdef YA_INSTRUMENT
+    lat_path = 0;
+#endif
+    return lat_ticks();
+}
+
+/* Marks the operation being timed as having taken path, unless it took a
+ * slower one already. */
+static inline void lat_take(int path) {
+#ifdef YA_INSTRUMENT
+    if (path > lat_path) {
+        lat_path = path;
+    }
+#endif
+}
+
+/* Records the operation op started at start. */
+static inline void lat_end(int op, uint64_t start) {
+#ifdef YA_INSTRUMENT
+    lat_record(op, lat_path, lat_ticks() - start);
+#endif
+}
+
+#endif // ndef YA_LATENCY_H
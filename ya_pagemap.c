@@ -0,0 +1,78 @@
+/*
+ * Yet Another Malloc
+ * ya_pagemap.c
+ */
+
+/*---------------------*/
+/* Feature test macros */
+/*---------------------*/
+
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS and MAP_NORESERVE
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stddef.h> // for NULL
+#include <sys/mman.h>
+
+#include "ya_pagemap.h"
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+atomic_uintptr_t *_Atomic pagemap_root[PAGEMAP_ROOT_SIZE];
+
+/*-----------*/
+/* Functions */
+/*-----------*/
+
+/* Returns the leaf holding the entry of page, creating it if needed.
+ * Returns NULL in case of failure. */
+static atomic_uintptr_t *pagemap_leaf(uintptr_t page) {
+    atomic_uintptr_t *_Atomic *slot = &pagemap_root[page >> PAGEMAP_LEAF_BITS];
+    atomic_uintptr_t *leaf = atomic_load_explicit(slot, memory_order_acquire);
+    if (leaf) {
+        return leaf;
+    }
+    atomic_uintptr_t *new_leaf = mmap(NULL,
+            PAGEMAP_LEAF_SIZE * sizeof(atomic_uintptr_t),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+            -1, 0);
+    if (new_leaf == MAP_FAILED) {
+        return NULL;
+    }
+    // another thread may have created the leaf meanwhile, without a lock that
+    // a fork could leave held
+    if (atomic_compare_exchange_strong_explicit(slot, &leaf, new_leaf,
+                memory_order_acq_rel, memory_order_acquire)) {
+        return new_leaf;
+    }
+    munmap(new_leaf, PAGEMAP_LEAF_SIZE * sizeof(atomic_uintptr_t));
+    return leaf;
+}
+
+/* Sets the entry of every page overlapping [start, end) to value, creating
+ * leaves as needed.
+ * Returns false if a leaf could not be created or the range is outside the
+ * address space the map covers, true otherwise. */
+bool pagemap_set(const void *start, const void *end, uintptr_t value) {
+    uintptr_t first = (uintptr_t) start >> PAGEMAP_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t) end - 1) >> PAGEMAP_PAGE_SHIFT;
+    if (last >> (PAGEMAP_ROOT_BITS + PAGEMAP_LEAF_BITS)) {
+        return false;
+    }
+    atomic_uintptr_t *leaf = NULL;
+    for (uintptr_t page = first; page <= last; page++) {
+        if (!leaf || !(page & (PAGEMAP_LEAF_SIZE - 1))) {
+            leaf = pagemap_leaf(page);
+            if (!leaf) {
+                return false;
+            }
+        }
+        atomic_store_explicit(&leaf[page & (PAGEMAP_LEAF_SIZE - 1)], value,
+                memory_order_relaxed);
+    }
+    return true;
+}
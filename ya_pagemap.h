@@ -0,0 +1,82 @@
+/*
+ * Yet Another Malloc
+ * ya_pagemap.h
+ */
+
+/* Page map.
+ *
+ * A two-level radix tree mapping the number of every 4 KB page of the
+ * address space to one word, 0 for pages that are not ours. The root is a
+ * static array, mostly never touched, and each leaf covers 1 GB of address
+ * space with PAGEMAP_LEAF_SIZE words mapped with MAP_NORESERVE, so only the
+ * parts of leaves describing pages in use become resident. Leaves are
+ * created on demand and never freed.
+ *
+ * Lookups take no lock: leaves are published with a compare-and-swap, and
+ * entries are read and written atomically. An entry only changes while the
+ * memory it describes is not handed out, so a reader looking up memory it
+ * owns always sees a stable entry. */
+
+#ifndef YA_PAGEMAP_H
+#define YA_PAGEMAP_H
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* pages are 4 KB */
+#define PAGEMAP_PAGE_SHIFT 12
+
+/* bits of page numbers resolved by each leaf and by the root, covering the
+ * 47-bit user address space */
+#define PAGEMAP_LEAF_BITS 18
+#define PAGEMAP_ROOT_BITS (47 - PAGEMAP_PAGE_SHIFT - PAGEMAP_LEAF_BITS)
+
+#define PAGEMAP_LEAF_SIZE ((uintptr_t) 1 << PAGEMAP_LEAF_BITS)
+#define PAGEMAP_ROOT_SIZE ((uintptr_t) 1 << PAGEMAP_ROOT_BITS)
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+/* leaves indexed by the high bits of page numbers, NULL until needed */
+extern atomic_uintptr_t *_Atomic pagemap_root[PAGEMAP_ROOT_SIZE];
+
+/*---------*/
+/* Inlines */
+/*---------*/
+
+/* Returns the entry of the page holding ptr, 0 if the page is not ours. */
+static inline uintptr_t pagemap_get(const void *ptr) {
+    uintptr_t page = (uintptr_t) ptr >> PAGEMAP_PAGE_SHIFT;
+    if (page >> (PAGEMAP_ROOT_BITS + PAGEMAP_LEAF_BITS)) {
+        return 0;
+    }
+    atomic_uintptr_t *leaf = atomic_load_explicit(
+            &pagemap_root[page >> PAGEMAP_LEAF_BITS], memory_order_acquire);
+    if (!leaf) {
+        return 0;
+    }
+    return atomic_load_explicit(&leaf[page & (PAGEMAP_LEAF_SIZE - 1)],
+            memory_order_relaxed);
+}
+
+/*--------------*/
+/* Declarations */
+/*--------------*/
+
+/* Sets the entry of every page overlapping [start, end) to value, creating
+ * leaves as needed.
+ * Returns false if a leaf could not be created or the range is outside the
+ * address space the map covers, true otherwise. */
+bool pagemap_set(const void *start, const void *end, uintptr_t value);
+
+#endif // ndef YA_PAGEMAP_H
@@ -0,0 +1,413 @@
+/*
+ * Yet Another Malloc
+ * ya_prof.c
+ */
+
+/*---------------------*/
+/* Feature test macros */
+/*---------------------*/
+
+#define _GNU_SOURCE // for MAP_ANONYMOUS and SA_RESTART
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h> // for snprintf
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ya_prof.h"
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* buckets of the table of live samples, a power of two */
+#define PROF_BUCKET_BITS 16
+#define PROF_NUM_BUCKETS ((size_t) 1 << PROF_BUCKET_BITS)
+
+/* memory mapped at once for sample records */
+#define PROF_POOL_BYTES ((size_t) 64 << 10)
+
+/* longest piece of text written to a dump at once */
+#define PROF_PIECE_MAX 256
+
+/* longest count down drawn, in bytes */
+#define PROF_MAX_DRAW (INTPTR_MAX / 2)
+
+/* ln 2 */
+static const double LN_2 = 0.6931471805599453;
+
+/*-------*/
+/* Types */
+/*-------*/
+
+struct prof_sample {
+    struct prof_sample *next; // next sample in the bucket or free record
+    void *ptr;
+    size_t n_bytes; // usable bytes
+    int depth;      // number of return addresses
+    void *stack[PROF_MAX_DEPTH];
+};
+
+struct prof_thread {
+    uint64_t rng; // xorshift state, 0 until seeded
+    bool drawn;   // prof_left counts down to a sample, not to a check
+    bool busy;    // sampling, so allocations made meanwhile are not sampled
+};
+
+/* Buffered output of a dump. */
+struct prof_out {
+    int fd;
+    size_t len;
+    int error; // errno of the first failed write, 0 if none
+    char buf[4096];
+};
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+_Thread_local intptr_t prof_left
+        __attribute__((tls_model("initial-exec"))) = 0;
+atomic_size_t prof_live = 0;
+
+static _Thread_local struct prof_thread prof_thread
+        __attribute__((tls_model("initial-exec")));
+
+static atomic_size_t prof_interval = 0;
+static atomic_size_t prof_rate = 0; // last interval other than 0
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_sample *prof_buckets[PROF_NUM_BUCKETS];
+// one bit per bucket, set if it is not empty: 8 KB that stay in cache for
+// frees to check, where the buckets would not
+static atomic_ulong prof_occupied[PROF_NUM_BUCKETS / 64];
+static struct prof_sample *prof_pool = NULL; // free records
+static atomic_bool prof_dump_flagged = false;
+static unsigned prof_dumps = 0; // dumps written for the signal so far
+static char prof_prefix[256] = "yamalloc";
+
+/*---------*/
+/* Helpers */
+/*---------*/
+
+/* Returns the bucket of ptr in the table of live samples. */
+static inline size_t prof_bucket(void *ptr) {
+    return ((uint64_t) (uintptr_t) ptr >> 4) * 0x9e3779b97f4a7c15ULL
+            >> (64 - PROF_BUCKET_BITS);
+}
+
+/* Updates the bit of bucket in prof_occupied. The lock must be held. */
+static inline void prof_update_occupied(size_t bucket) {
+    unsigned long bit = 1UL << bucket % 64;
+    unsigned long word = atomic_load_explicit(&prof_occupied[bucket / 64],
+            memory_order_relaxed);
+    word = prof_buckets[bucket] ? word | bit : word & ~bit;
+    atomic_store_explicit(&prof_occupied[bucket / 64], word,
+            memory_order_relaxed);
+}
+
+/* Returns ln x for x > 0, closely enough for drawing intervals without libm:
+ * with x = 2^e * f and f in [1, 2), ln f = 2 atanh((f - 1) / (f + 1)), whose
+ * series converges fast. */
+static double prof_ln(uint64_t x) {
+    int e = 63 - __builtin_clzll(x);
+    double f = (double) x / (double) ((uint64_t) 1 << e);
+    double y = (f - 1) / (f + 1);
+    double y2 = y * y;
+    return e * LN_2 + 2 * y * (1 + y2 * (1.0 / 3 + y2 * (1.0 / 5 + y2 / 7)));
+}
+
+/* Draws the number of bytes the calling thread allocates before its next
+ * sample, from the exponential distribution whose mean is interval. */
+static intptr_t prof_draw(size_t interval) {
+    uint64_t x = prof_thread.rng;
+    if (!x) {
+        x = ((uintptr_t) &prof_thread ^ (uint64_t) getpid() << 32) | 1;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    prof_thread.rng = x;
+    // uniform in [1, 2^53]: -ln u / 2^53 is exponential of mean 1
+    uint64_t u = (x * 0x2545f4914f6cdd1dULL >> 11) + 1;
+    double draw = (53 * LN_2 - prof_ln(u)) * interval;
+    return draw < PROF_MAX_DRAW ? (intptr_t) draw + 1 : PROF_MAX_DRAW;
+}
+
+/* Returns a free sample record, mapping more if needed. The lock must be
+ * held.
+ * Returns NULL in case of failure. */
+static struct prof_sample *prof_record() {
+    if (!prof_pool) {
+        struct prof_sample *pool = mmap(NULL, PROF_POOL_BYTES,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool == MAP_FAILED) {
+            return NULL;
+        }
+        size_t n = PROF_POOL_BYTES / sizeof(struct prof_sample);
+        for (size_t i = 0; i < n; i++) {
+            pool[i].next = i + 1 < n ? &pool[i + 1] : NULL;
+        }
+        prof_pool = pool;
+    }
+    struct prof_sample *sample = prof_pool;
+    prof_pool = sample->next;
+    return sample;
+}
+
+/* Writes the buffered output to its file. */
+static void prof_flush(struct prof_out *out) {
+    for (size_t done = 0; done < out->len && !out->error; ) {
+        ssize_t n = write(out->fd, out->buf + done, out->len - done);
+        if (n < 0) {
+            out->error = errno;
+        } else {
+            done += n;
+        }
+    }
+    out->len = 0;
+}
+
+/* Appends the text formatted like printf, up to PROF_PIECE_MAX bytes, to the
+ * output. */
+static void prof_printf(struct prof_out *out, const char *format, ...) {
+    if (out->len + PROF_PIECE_MAX > sizeof(out->buf)) {
+        prof_flush(out);
+    }
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(out->buf + out->len, PROF_PIECE_MAX, format, args);
+    va_end(args);
+    if (n > 0) {
+        out->len += n < PROF_PIECE_MAX ? n : PROF_PIECE_MAX - 1;
+    }
+}
+
+/* Appends the mappings of the process to the output. */
+static void prof_print_maps(struct prof_out *out) {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    for (;;) {
+        if (out->len == sizeof(out->buf)) {
+            prof_flush(out);
+        }
+        ssize_t n = read(fd, out->buf + out->len, sizeof(out->buf) - out->len);
+        if (n <= 0) {
+            break;
+        }
+        out->len += n;
+    }
+    close(fd);
+}
+
+/* Writes the dump flagged by the signal to the next numbered file. */
+static void prof_dump_flagged_now() {
+    char path[sizeof(prof_prefix) + 32];
+    pthread_mutex_lock(&prof_lock);
+    unsigned seq = prof_dumps++;
+    pthread_mutex_unlock(&prof_lock);
+    snprintf(path, sizeof(path), "%s.%d.%u.heap", prof_prefix, (int) getpid(),
+            seq);
+    prof_dump(path);
+}
+
+/* Flags a dump for the next sampled allocation. */
+static void prof_handler(int signal) {
+    atomic_store_explicit(&prof_dump_flagged, true, memory_order_relaxed);
+}
+
+/*-----------*/
+/* Functions */
+/*-----------*/
+
+/* Sets the mean sampling interval in bytes, 0 stopping sampling, the signal
+ * flagging a dump, 0 for none, and the prefix of the files it writes. Must be
+ * called before any thread other than the main one starts. */
+void prof_init(size_t interval, int signal, const char *prefix) {
+    if (prefix) {
+        snprintf(prof_prefix, sizeof(prof_prefix), "%s", prefix);
+    }
+    if (signal > 0) {
+        struct sigaction action = {0};
+        action.sa_handler = prof_handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(signal, &action, NULL);
+    }
+    prof_set_interval(interval);
+}
+
+/* Sets the mean sampling interval in bytes, 0 stopping sampling. Threads
+ * pick it up within PROF_RECHECK bytes, or their next sample. */
+void prof_set_interval(size_t interval) {
+    static atomic_bool loaded = false;
+    if (interval && !atomic_exchange(&loaded, true)) {
+        // the first backtrace loads the unwinder, which allocates: better
+        // outside of a sample
+        void *frame;
+        backtrace(&frame, 1);
+    }
+    if (interval) {
+        atomic_store_explicit(&prof_rate, interval, memory_order_relaxed);
+    }
+    atomic_store_explicit(&prof_interval, interval, memory_order_relaxed);
+}
+
+/* Samples ptr, allocated with n_bytes usable bytes by the calling thread,
+ * whose count down ran out, and draws the next one. Writes a dump first if
+ * the signal flagged one. A count down to a check only draws the first one. */
+void prof_sample(void *ptr, size_t n_bytes) {
+    if (prof_thread.busy) {
+        prof_left = PROF_RECHECK;
+        return;
+    }
+    prof_thread.busy = true;
+    if (atomic_load_explicit(&prof_dump_flagged, memory_order_relaxed)
+            && atomic_exchange(&prof_dump_flagged, false)) {
+        prof_dump_flagged_now();
+    }
+    size_t interval = atomic_load_explicit(&prof_interval,
+            memory_order_relaxed);
+    bool sampled = prof_thread.drawn && interval;
+    prof_thread.drawn = interval;
+    prof_left = interval ? prof_draw(interval) : PROF_RECHECK;
+    if (sampled) {
+        void *stack[PROF_MAX_DEPTH + 1];
+        // leave out this function
+        int depth = backtrace(stack, PROF_MAX_DEPTH + 1) - 1;
+        pthread_mutex_lock(&prof_lock);
+        struct prof_sample *sample = prof_record();
+        if (sample) {
+            sample->ptr = ptr;
+            sample->n_bytes = n_bytes;
+            sample->depth = depth > 0 ? depth : 0;
+            memcpy(sample->stack, stack + 1, sample->depth * sizeof(void *));
+            size_t bucket = prof_bucket(ptr);
+            sample->next = prof_buckets[bucket];
+            prof_buckets[bucket] = sample;
+            // a thread freeing ptr got it from this one, after these stores
+            prof_update_occupied(bucket);
+            atomic_fetch_add_explicit(&prof_live, 1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&prof_lock);
+    }
+    prof_thread.busy = false;
+}
+
+/* Forgets the sample of ptr, if it is one, unless its bucket is empty. */
+void prof_unsample(void *ptr) {
+    size_t bucket = prof_bucket(ptr);
+    if (!(atomic_load_explicit(&prof_occupied[bucket / 64],
+                    memory_order_relaxed) & 1UL << bucket % 64)) {
+        return;
+    }
+    pthread_mutex_lock(&prof_lock);
+    struct prof_sample *prev = NULL;
+    struct prof_sample *sample = prof_buckets[bucket];
+    while (sample && sample->ptr != ptr) {
+        prev = sample;
+        sample = sample->next;
+    }
+    if (sample) {
+        if (prev) {
+            prev->next = sample->next;
+        } else {
+            prof_buckets[bucket] = sample->next;
+            prof_update_occupied(bucket);
+        }
+        sample->next = prof_pool;
+        prof_pool = sample;
+        atomic_fetch_sub_explicit(&prof_live, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/* Writes the profile of the live samples to the file at path: the totals and
+ * the last interval sampled with, one line per sample, then the mappings of
+ * the process. Counts are given as both in use and allocated, the samples
+ * freed being forgotten. The samples are copied to a mapping of their own
+ * under the lock, and written out after it is released. Allocates no memory.
+ * Returns 0 on success, -1 with errno set otherwise. */
+int prof_dump(const char *path) {
+    struct prof_out out;
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out.fd < 0) {
+        return -1;
+    }
+    out.len = 0;
+    out.error = 0;
+    pthread_mutex_lock(&prof_lock);
+    size_t count = atomic_load_explicit(&prof_live, memory_order_relaxed);
+    size_t copy_bytes = count * sizeof(struct prof_sample);
+    struct prof_sample *copy = NULL;
+    if (count) {
+        copy = mmap(NULL, copy_bytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (copy == MAP_FAILED) {
+            pthread_mutex_unlock(&prof_lock);
+            close(out.fd);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    size_t n_bytes = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < PROF_NUM_BUCKETS; i++) {
+        for (struct prof_sample *sample = prof_buckets[i]; sample;
+                sample = sample->next) {
+            copy[n++] = *sample;
+            n_bytes += sample->n_bytes;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+    prof_printf(&out, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+            count, n_bytes, count, n_bytes,
+            atomic_load_explicit(&prof_rate, memory_order_relaxed));
+    for (size_t i = 0; i < count; i++) {
+        prof_printf(&out, "%6d: %8zu [%6d: %8zu] @", 1, copy[i].n_bytes, 1,
+                copy[i].n_bytes);
+        for (int j = 0; j < copy[i].depth; j++) {
+            prof_printf(&out, " %p", copy[i].stack[j]);
+        }
+        prof_printf(&out, "\n");
+    }
+    if (copy) {
+        munmap(copy, copy_bytes);
+    }
+    prof_printf(&out, "\nMAPPED_LIBRARIES:\n");
+    prof_print_maps(&out);
+    prof_flush(&out);
+    if (close(out.fd) && !out.error) {
+        out.error = errno;
+    }
+    if (out.error) {
+        errno = out.error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Fork handlers: the child gets a usable lock. */
+void prof_prefork() {
+    pthread_mutex_lock(&prof_lock);
+}
+
+void prof_postfork_parent() {
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void prof_postfork_child() {
+    pthread_mutex_init(&prof_lock, NULL);
+}
@@ -0,0 +1,107 @@
+/*
+ * Yet Another Malloc
+ * ya_prof.h
+ */
+
+/* Sampling heap profiler.
+ *
+ * Each thread counts down the bytes it allocates to its next sample, drawn
+ * from the exponential distribution whose mean is the sampling interval, so
+ * that samples form a Poisson process over the bytes allocated: an object of
+ * n bytes is sampled with probability 1 - exp(-n / interval) whatever the
+ * objects around it. A sampled object's backtrace is recorded, with its size,
+ * in a hash table of the live samples keyed by pointer, until it is freed.
+ * Frees only look the table up while samples are live, and only take its lock
+ * when the pointer's bucket is not empty.
+ *
+ * A dump writes the live samples in the heap profile format of gperftools,
+ * which pprof reads and scales back up with the interval: one line per
+ * sample with its count and bytes and its stack of return addresses, then the
+ * mappings of the process for pprof to symbolize them. The dump signal only
+ * flags a dump, written to a numbered file by the next sampled allocation,
+ * so that neither the profile's lock nor file output run in signal handlers.
+ * While sampling is off, threads still check every PROF_RECHECK bytes whether
+ * it was turned on. */
+
+#ifndef YA_PROF_H
+#define YA_PROF_H
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stdatomic.h>
+#include <stddef.h> // for size_t
+#include <stdint.h> // for intptr_t
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* most return addresses recorded per sample */
+#define PROF_MAX_DEPTH 32
+
+/* bytes allocated between checks for sampling while it is off */
+#define PROF_RECHECK ((intptr_t) 1 << 20)
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+// initial-exec: see thread_arena in ya_arena.c
+extern _Thread_local intptr_t prof_left
+        __attribute__((tls_model("initial-exec")));
+
+/* number of live samples */
+extern atomic_size_t prof_live;
+
+/*--------------*/
+/* Declarations */
+/*--------------*/
+
+/* Sets the mean sampling interval in bytes, 0 stopping sampling, the signal
+ * flagging a dump, 0 for none, and the prefix of the files it writes. Must be
+ * called before any thread other than the main one starts. */
+void prof_init(size_t interval, int signal, const char *prefix);
+
+/* Sets the mean sampling interval in bytes, 0 stopping sampling. */
+void prof_set_interval(size_t interval);
+
+/* Samples ptr, allocated with n_bytes usable bytes by the calling thread,
+ * whose count down ran out, and draws the next one. Writes a dump first if
+ * the signal flagged one. */
+void prof_sample(void *ptr, size_t n_bytes);
+
+/* Forgets the sample of ptr, if it is one. */
+void prof_unsample(void *ptr);
+
+/* Writes the profile of the live samples to the file at path.
+ * Returns 0 on success, -1 with errno set otherwise. */
+int prof_dump(const char *path);
+
+/* Fork handlers: the child gets a usable lock. */
+void prof_prefork();
+void prof_postfork_parent();
+void prof_postfork_child();
+
+/*---------*/
+/* Inlines */
+/*---------*/
+
+/* Counts ptr, allocated with n_bytes usable bytes by the calling thread,
+ * towards the next sample. */
+static inline void prof_malloc(void *ptr, size_t n_bytes) {
+    prof_left -= (intptr_t) n_bytes;
+    if (prof_left < 0) {
+        prof_sample(ptr, n_bytes);
+    }
+}
+
+/* Forgets the sample of ptr, about to be freed, if it is one. */
+static inline void prof_free(void *ptr) {
+    if (atomic_load_explicit(&prof_live, memory_order_relaxed)) {
+        prof_unsample(ptr);
+    }
+}
+
+#endif // ndef YA_PROF_H
@@ -0,0 +1,129 @@
+/*
+ * Yet Another Malloc
+ * ya_region.c
+ */
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stdbool.h>
+
+#include "yamalloc.h"
+#include "ya_region.h"
+
+/*---------*/
+/* Helpers */
+/*---------*/
+
+/* Adds a chunk to the region with room for at least n_bytes bytes: a spare
+ * chunk large enough if it has one, or a new one from its parent or the heap.
+ * Doubles the size of the next new chunk up to REGION_CHUNK_MAX.
+ * Returns false in case of failure. */
+static bool region_grow(struct ya_region *region, size_t n_bytes) {
+    struct region_chunk **link = &region->spare;
+    while (*link && (size_t) ((*link)->end - (char *) (*link + 1)) < n_bytes) {
+        link = &(*link)->prev;
+    }
+    struct region_chunk *chunk = *link;
+    if (chunk) {
+        *link = chunk->prev;
+    } else {
+        size_t size = region->next_size;
+        if (n_bytes > size - sizeof(struct region_chunk)) {
+            size = sizeof(struct region_chunk) + n_bytes;
+        } else if (size < REGION_CHUNK_MAX) {
+            region->next_size = 2 * size + sizeof(intptr_t);
+        }
+        chunk = region->parent
+                ? ya_region_alloc(region->parent, size) : malloc(size);
+        if (!chunk) {
+            return false;
+        }
+        chunk->end = (char *) chunk + size;
+    }
+    chunk->prev = region->chunk;
+    region->chunk = chunk;
+    region->ptr = (char *) (chunk + 1);
+    return true;
+}
+
+/*-----------*/
+/* Functions */
+/*-----------*/
+
+/* Creates an empty region taking its chunks from the heap if parent is NULL,
+ * from parent otherwise.
+ * Returns the region or NULL in case of failure. */
+struct ya_region *ya_region_create(struct ya_region *parent) {
+    struct ya_region *region = parent
+            ? ya_region_alloc(parent, sizeof(struct ya_region))
+            : malloc(sizeof(struct ya_region));
+    if (!region) {
+        return NULL;
+    }
+    region->parent = parent;
+    region->chunk = NULL;
+    region->spare = NULL;
+    region->ptr = NULL;
+    region->next_size = REGION_CHUNK_MIN;
+    return region;
+}
+
+/* Allocates n_bytes bytes from the region, adding a chunk if needed. Zero
+ * bytes get the smallest allocation, as with malloc.
+ * Returns a dword-aligned pointer to the memory or NULL in case of failure. */
+void *ya_region_alloc(struct ya_region *region, size_t n_bytes) {
+    if (n_bytes > SIZE_MAX / 2) {
+        return NULL;
+    }
+    if (n_bytes == 0) {
+        n_bytes = 1;
+    }
+    size_t size = (n_bytes + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1);
+    if (!region->chunk || (size_t) (region->chunk->end - region->ptr) < size) {
+        if (!region_grow(region, size)) {
+            return NULL;
+        }
+    }
+    void *ptr = region->ptr;
+    region->ptr += size;
+    return ptr;
+}
+
+/* Returns a mark of the region's allocations so far. */
+struct ya_region_mark ya_region_save(struct ya_region *region) {
+    return (struct ya_region_mark) {region->chunk, region->ptr};
+}
+
+/* Frees everything allocated from the region since mark was saved, giving
+ * the chunks added since back to the heap, or keeping them as spare chunks
+ * of a nested region. Marks saved after mark become invalid. */
+void ya_region_restore(struct ya_region *region, struct ya_region_mark mark) {
+    while (region->chunk != mark.chunk) {
+        struct region_chunk *chunk = region->chunk;
+        region->chunk = chunk->prev;
+        if (region->parent) {
+            chunk->prev = region->spare;
+            region->spare = chunk;
+        } else {
+            free(chunk);
+        }
+    }
+    region->ptr = mark.ptr;
+}
+
+/* Frees everything allocated from the region, giving its chunks back to the
+ * heap, or keeping them as spare chunks of a nested region. The next chunk
+ * keeps the size reached so far. */
+void ya_region_reset(struct ya_region *region) {
+    ya_region_restore(region, (struct ya_region_mark) {NULL, NULL});
+}
+
+/* Resets the region and frees it. */
+void ya_region_destroy(struct ya_region *region) {
+    ya_region_reset(region);
+    if (!region->parent) {
+        free(region);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Yet Another Malloc
+ * ya_region.h
+ */
+
+/* Regions.
+ *
+ * A region hands out memory by bumping a pointer through chunks taken from
+ * the heap with malloc, and gives them all back at once when it is reset or
+ * destroyed, sparing its objects the splitting and coalescing of heap blocks.
+ * Chunks double in size from REGION_CHUNK_MIN to REGION_CHUNK_MAX bytes,
+ * sizes that fill heap blocks exactly and stay below the direct threshold. An
+ * allocation too large for the next chunk gets a chunk of its own. Chunks are
+ * linked from the newest, the one being bumped through, to the oldest.
+ *
+ * A mark records the newest chunk and the bump pointer. Restoring it frees
+ * the chunks added since and rewinds the pointer; resetting a region restores
+ * it to empty. A nested region takes its chunks, and itself, from its parent
+ * instead of the heap: they go back to the heap when the parent is reset or
+ * restored to a mark older than them. Until then, the chunks the nested
+ * region drops when restored or reset stay on its list of spare chunks, which
+ * it reuses before taking more from its parent, so that a nested region reset
+ * over and over does not grow its parent. */
+
+#ifndef YA_REGION_H
+#define YA_REGION_H
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* smallest and largest chunk sizes in bytes, a heap block header short of a
+ * power of two */
+#define REGION_CHUNK_MIN (((size_t) 4 << 10) - sizeof(intptr_t))
+#define REGION_CHUNK_MAX (((size_t) 64 << 10) - sizeof(intptr_t))
+
+/* alignment of region allocations, in bytes, that of malloc */
+#define REGION_ALIGN (2 * sizeof(intptr_t))
+
+/*-------*/
+/* Types */
+/*-------*/
+
+/* Header of a chunk, followed by the memory handed out. */
+struct region_chunk {
+    struct region_chunk *prev; // the chunk added before, NULL for the oldest
+    char *end;                 // end of the chunk
+};
+
+struct ya_region {
+    struct ya_region *parent;   // region chunks come from, NULL for the heap
+    struct region_chunk *chunk; // newest chunk, NULL if none
+    struct region_chunk *spare; // chunks a nested region dropped, linked
+    char *ptr;                  // first free byte of the newest chunk
+    size_t next_size;           // size of the next chunk in bytes
+};
+
+#endif // ndef YA_REGION_H
@@ -0,0 +1,209 @@
+/*
+ * Yet Another Malloc
+ * ya_slab.c
+ */
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stdlib.h> // for abort
+
+#include "ya_debug.h"
+
+#include "ya_slab.h"
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* offset of the end of the run header in a run's page, in bytes */
+#define RUN_HEADER_END (SLAB_RUN_OFFSET + sizeof(struct run))
+
+/*---------*/
+/* Inlines */
+/*---------*/
+
+/* Returns the offset in a run's page of the first object of the class, in
+ * bytes: the first multiple of the class's alignment past the run header. */
+static inline size_t run_start(int cls) {
+    size_t align = slab_align(cls);
+    return (RUN_HEADER_END + align - 1) & -align;
+}
+
+/* Returns the number of objects in a run of the class. */
+static inline int run_count(int cls) {
+    return (SLAB_RUN_SIZE - run_start(cls)) / slab_size(cls);
+}
+
+/* Returns the bits of word of a bitmap of count objects that stand for
+ * objects. */
+static inline uint64_t run_mask(int count, int word) {
+    int bits = count - word * 64;
+    if (bits >= 64) {
+        return ~(uint64_t) 0;
+    }
+    return bits > 0 ? ((uint64_t) 1 << bits) - 1 : 0;
+}
+
+/* Returns a pointer to the first object of the run, of the class. */
+static inline char *run_objects(struct run *run, int cls) {
+    return (char *) run - SLAB_RUN_OFFSET + run_start(cls);
+}
+
+/*---------*/
+/* Helpers */
+/*---------*/
+
+/* Adds the run to the front of its class's list. */
+static void slab_push(struct slab *slab, struct run *run) {
+    struct run *head = slab->partial[run->size_class];
+    run->prev = NULL;
+    run->next = head;
+    if (head) {
+        head->prev = run;
+    }
+    slab->partial[run->size_class] = run;
+}
+
+/* Removes the run from its class's list. */
+static void slab_unlink(struct slab *slab, struct run *run) {
+    if (run->prev) {
+        run->prev->next = run->next;
+    } else {
+        slab->partial[run->size_class] = run->next;
+    }
+    if (run->next) {
+        run->next->prev = run->prev;
+    }
+}
+
+/*-----------*/
+/* Functions */
+/*-----------*/
+
+/* Takes a free object of the class from the slab.
+ * Returns NULL if no run of the class has a free object. */
+void *slab_alloc(struct slab *slab, int cls) {
+    struct run *run = slab->partial[cls];
+    if (!run) {
+        return NULL;
+    }
+    int word = 0;
+    while (!run->free[word]) {
+        word++;
+    }
+    int bit = __builtin_ctzll(run->free[word]);
+    run->free[word] &= run->free[word] - 1;
+    if (--run->n_free == 0) {
+        slab_unlink(slab, run);
+    }
+    return run_objects(run, cls) + (word * 64 + bit) * slab_size(cls);
+}
+
+/* Takes up to count free objects of the class from the slab, storing them in
+ * ptrs, emptying each bitmap word in one pass.
+ * Returns the number of objects taken, less than count if no run of the
+ * class has a free object left. */
+size_t slab_alloc_batch(struct slab *slab, int cls, void **ptrs,
+        size_t count) {
+    size_t done = 0;
+    struct run *run;
+    while (done < count && (run = slab->partial[cls])) {
+        char *objects = run_objects(run, cls);
+        for (int word = 0; word < SLAB_BITMAP_WORDS && done < count; word++) {
+            uint64_t bits = run->free[word];
+            while (bits && done < count) {
+                int i = word * 64 + __builtin_ctzll(bits);
+                ptrs[done++] = objects + i * slab_size(cls);
+                bits &= bits - 1;
+                run->n_free--;
+            }
+            run->free[word] = bits;
+        }
+        if (run->n_free == 0) {
+            slab_unlink(slab, run);
+        }
+    }
+    return done;
+}
+
+/* Turns block, an allocated heap block of SLAB_RUN_WORDS words whose data
+ * starts SLAB_RUN_OFFSET bytes into a page, into a run of the class with
+ * every object free. */
+void slab_add_run(struct slab *slab, int cls, intptr_t *block) {
+    struct run *run = (struct run *) block;
+    int count = run_count(cls);
+    run->recip = (((uint64_t) 1 << 32) + slab_size(cls) - 1) / slab_size(cls);
+    run->size_class = cls;
+    run->n_free = count;
+    for (int word = 0; word < SLAB_BITMAP_WORDS; word++) {
+        run->free[word] = run_mask(count, word);
+    }
+    slab_push(slab, run);
+}
+
+/* Gives the object back to its run.
+ * Returns the run's block if the run is now empty and should go back to the
+ * heap, NULL otherwise. */
+intptr_t *slab_free(struct slab *slab, void *ptr) {
+    struct run *run = slab_run_of(ptr);
+    uint64_t offset = (char *) ptr - run_objects(run, run->size_class);
+    uint32_t i = offset * run->recip >> 32;
+    uint64_t bit = (uint64_t) 1 << i % 64;
+    if (run->free[i / 64] & bit) {
+#ifdef YA_DEBUG
+        ya_debug("slab_free: %p freed twice\n", ptr);
+        abort();
+#endif
+        return NULL; // freed twice: ignored
+    }
+    run->free[i / 64] |= bit;
+    if (run->n_free++ == 0) {
+        slab_push(slab, run);
+    }
+    if (run->n_free == run_count(run->size_class)
+            && (run->prev || run->next)) {
+        // not the class's only run with free objects, so that alternately
+        // allocating and freeing one object does not create and destroy runs
+        slab_unlink(slab, run);
+        return (intptr_t *) run;
+    }
+    return NULL;
+}
+
+#ifdef YA_DEBUG
+/* Checks the runs with free objects for consistency.
+ * Returns -1 on error, the number of such runs otherwise. */
+int slab_check(struct slab *slab) {
+    int n_runs = 0;
+    for (int cls = 0; cls < SLAB_NUM_CLASSES; cls++) {
+        struct run *prev = NULL;
+        for (struct run *run = slab->partial[cls]; run; run = run->next) {
+            int count = run_count(cls);
+            int n_free = 0;
+            for (int word = 0; word < SLAB_BITMAP_WORDS; word++) {
+                n_free += __builtin_popcountll(run->free[word]);
+                if (run->free[word] & ~run_mask(count, word)) {
+                    ya_debug("slab_check: run %p has free bits past its "
+                            "%d objects\n", (void *) run, count);
+                    return -1;
+                }
+            }
+            if (run->size_class != cls || run->prev != prev) {
+                ya_debug("slab_check: run %p is in the wrong list\n",
+                        (void *) run);
+                return -1;
+            }
+            if (n_free != run->n_free || n_free == 0 || n_free > count) {
+                ya_debug("slab_check: run %p has %d free bits, n_free %d\n",
+                        (void *) run, n_free, run->n_free);
+                return -1;
+            }
+            prev = run;
+            n_runs++;
+        }
+    }
+    return n_runs;
+}
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Yet Another Malloc
+ * ya_slab.h
+ */
+
+/* Slab runs for small objects.
+ *
+ * Requests of up to SLAB_MAX_SIZE bytes are rounded up to one of
+ * SLAB_NUM_CLASSES size classes and served from runs: SLAB_RUN_SIZE-aligned
+ * pages dedicated to a single class, whose objects carry no header. A run is
+ * an allocated heap block of SLAB_RUN_WORDS words whose data starts
+ * SLAB_RUN_OFFSET bytes into a page, so that no other block starts in the
+ * page, and the run's header sits at the start of the block's data:
+ *
+ * page     +8     +16                 +80..256               page + 4096
+ * +--------+------+-------------------+------- - - - -------+---------+
+ * | (prev) | head | run header        | objects...          | (tail)  |
+ * +--------+------+-------------------+------- - - - -------+---------+
+ *
+ * Objects start at the first multiple of their class's alignment past the
+ * run header, the largest power of two dividing their size, so that 64-byte
+ * objects are cache-line aligned and aligned requests of up to SLAB_MAX_SIZE
+ * bytes can be served from runs. This costs no object in any class. The page
+ * map entry of a run's page records its class (see ya_pagemap.h and
+ * ya_arena.h), so that free tells objects from blocks. A bitmap in the run
+ * header records which objects are free and is searched with ctz. Each arena
+ * keeps, per class, a list of its runs with at least one free object. A run
+ * left with no allocated object goes back to the heap, unless it is the only
+ * run of its class with free objects. */
+
+#ifndef YA_SLAB_H
+#define YA_SLAB_H
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* largest request served from a run, in bytes */
+#define SLAB_MAX_SIZE 256
+
+/* 16-byte classes up to 128 bytes, 32-byte classes up to SLAB_MAX_SIZE */
+#define SLAB_NUM_CLASSES 12
+
+/* size and alignment of runs, in bytes */
+#define SLAB_RUN_SIZE 4096
+
+/* offset of a run's block in its page, in bytes */
+#define SLAB_RUN_OFFSET (2 * sizeof(intptr_t))
+
+/* size of a run's block, in words */
+#define SLAB_RUN_WORDS ((intptr_t) (SLAB_RUN_SIZE / sizeof(intptr_t)))
+
+/* words in a run's free object bitmap: enough for 16-byte objects */
+#define SLAB_BITMAP_WORDS 4
+
+/*-------*/
+/* Types */
+/*-------*/
+
+/* Header of a run, at the start of its block's data. */
+struct run {
+    struct run *next;     // runs of the same class with free objects
+    struct run *prev;
+    uint32_t recip;       // ceil(2^32 / object size), to divide by it
+    uint16_t size_class;
+    uint16_t n_free;
+    uint64_t free[SLAB_BITMAP_WORDS]; // bit i set iff object i is free
+};
+
+/* The runs of one arena with free objects, per class. */
+struct slab {
+    struct run *partial[SLAB_NUM_CLASSES];
+};
+
+/*---------*/
+/* Inlines */
+/*---------*/
+
+/* Class of requests of 16 * (i - 1) + 1 to 16 * i bytes, for i in
+ * [1, SLAB_MAX_SIZE / 16]. */
+static const uint8_t slab_classes[SLAB_MAX_SIZE / 16 + 1] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+};
+
+/* Object size of each class, in bytes. */
+static const uint16_t slab_sizes[SLAB_NUM_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+};
+
+/* Returns the class of requests of n_bytes bytes, or -1 if they are too
+ * large for a run. Uses a table rather than comparisons, which mispredict
+ * when sizes are mixed. */
+static inline int slab_class(size_t n_bytes) {
+    if (n_bytes > SLAB_MAX_SIZE) {
+        return -1;
+    }
+    return slab_classes[(n_bytes + 15) / 16];
+}
+
+/* Returns the size in bytes of the objects of the class. */
+static inline size_t slab_size(int cls) {
+    return slab_sizes[cls];
+}
+
+/* Returns the alignment in bytes of the objects of the class: the largest
+ * power of two dividing their size. */
+static inline size_t slab_align(int cls) {
+    return slab_size(cls) & -slab_size(cls);
+}
+
+/* Returns the run holding ptr, which must point into a run's page. */
+static inline struct run *slab_run_of(void *ptr) {
+    return (struct run *) (((uintptr_t) ptr & -(uintptr_t) SLAB_RUN_SIZE)
+            + SLAB_RUN_OFFSET);
+}
+
+/*--------------*/
+/* Declarations */
+/*--------------*/
+
+/* Takes a free object of the class from the slab.
+ * Returns NULL if no run of the class has a free object. */
+void *slab_alloc(struct slab *slab, int cls);
+
+/* Takes up to count free objects of the class from the slab, storing them in
+ * ptrs, emptying each bitmap word in one pass.
+ * Returns the number of objects taken, less than count if no run of the
+ * class has a free object left. */
+size_t slab_alloc_batch(struct slab *slab, int cls, void **ptrs,
+        size_t count);
+
+/* Turns block, an allocated heap block of SLAB_RUN_WORDS words whose data
+ * starts SLAB_RUN_OFFSET bytes into a page, into a run of the class with
+ * every object free. */
+void slab_add_run(struct slab *slab, int cls, intptr_t *block);
+
+/* Gives the object back to its run.
+ * Returns the run's block if the run is now empty and should go back to the
+ * heap, NULL otherwise. */
+intptr_t *slab_free(struct slab *slab, void *ptr);
+
+#ifdef YA_DEBUG
+/* Checks the runs with free objects for consistency.
+ * Returns -1 on error, the number of such runs otherwise. */
+int slab_check(struct slab *slab);
+#endif
+
+#endif // ndef YA_SLAB_H
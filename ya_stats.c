@@ -0,0 +1,130 @@
+/*
+ * Yet Another Malloc
+ * ya_stats.c
+ */
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <pthread.h>
+
+#include "ya_stats.h"
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+_Thread_local struct thread_stats thread_stats
+        __attribute__((tls_model("initial-exec")));
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats *stats_threads = NULL; // linked counters
+static struct stats_counters stats_exited;        // totals of exited threads
+static pthread_key_t stats_key;
+static bool stats_key_valid = false;
+
+/*---------*/
+/* Helpers */
+/*---------*/
+
+/* Returns the value of the counter, which another thread may be writing. */
+static inline size_t stats_get(atomic_size_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/* Adds the counters from to the counters to. The lock must be held, unless
+ * to is only written by the calling thread. */
+static void stats_merge(struct stats_counters *to,
+        struct stats_counters *from) {
+    for (int cls = 0; cls < STATS_NUM_CLASSES; cls++) {
+        stats_add(&to->mallocs[cls], stats_get(&from->mallocs[cls]));
+        stats_add(&to->frees[cls], stats_get(&from->frees[cls]));
+    }
+    stats_add(&to->allocated, stats_get(&from->allocated));
+    stats_add(&to->freed, stats_get(&from->freed));
+}
+
+/* Folds the exiting thread's counters into the totals and unlinks them. */
+static void stats_destroy(void *arg) {
+    pthread_mutex_lock(&stats_lock);
+    stats_merge(&stats_exited, &thread_stats.counters);
+    if (thread_stats.prev) {
+        thread_stats.prev->next = thread_stats.next;
+    } else {
+        stats_threads = thread_stats.next;
+    }
+    if (thread_stats.next) {
+        thread_stats.next->prev = thread_stats.prev;
+    }
+    thread_stats.linked = false;
+    thread_stats.exited = true;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*-----------*/
+/* Functions */
+/*-----------*/
+
+/* Creates the key whose destructor folds each thread's counters into the
+ * totals when it exits. Must be called before any thread other than the main
+ * one starts. */
+void stats_init() {
+    stats_key_valid = !pthread_key_create(&stats_key, stats_destroy);
+}
+
+/* Counts for the calling thread when its counters are not linked yet,
+ * linking them, or when it is exiting. */
+void stats_count_slow(int cls, size_t mallocs, size_t frees,
+        size_t allocated, size_t freed) {
+    pthread_mutex_lock(&stats_lock);
+    struct stats_counters *counters = &stats_exited;
+    if (!thread_stats.exited) {
+        // only the main thread may count before stats_init, and it never
+        // runs the destructor anyway
+        if (stats_key_valid) {
+            pthread_setspecific(stats_key, &thread_stats);
+        }
+        thread_stats.prev = NULL;
+        thread_stats.next = stats_threads;
+        if (stats_threads) {
+            stats_threads->prev = &thread_stats;
+        }
+        stats_threads = &thread_stats;
+        thread_stats.linked = true;
+        counters = &thread_stats.counters;
+    }
+    stats_add(&counters->mallocs[cls], mallocs);
+    stats_add(&counters->frees[cls], frees);
+    if (cls == STATS_LARGE) {
+        stats_add(&counters->allocated, allocated);
+        stats_add(&counters->freed, freed);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Stores in sum the counters of every thread, running or exited. */
+void stats_sum(struct stats_counters *sum) {
+    *sum = (struct stats_counters) {0};
+    pthread_mutex_lock(&stats_lock);
+    stats_merge(sum, &stats_exited);
+    for (struct thread_stats *ts = stats_threads; ts; ts = ts->next) {
+        stats_merge(sum, &ts->counters);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Fork handlers: the child gets a consistent list and a usable lock. The
+ * counters of the threads that do not exist in the child stay linked, their
+ * memory having been copied too. */
+void stats_prefork() {
+    pthread_mutex_lock(&stats_lock);
+}
+
+void stats_postfork_parent() {
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_postfork_child() {
+    pthread_mutex_init(&stats_lock, NULL);
+}
@@ -0,0 +1,138 @@
+/*
+ * Yet Another Malloc
+ * ya_stats.h
+ */
+
+/* Per-thread allocation counters.
+ *
+ * Each thread counts the objects it allocates and frees per slab class and
+ * for blocks, and the usable bytes of the blocks, in thread-local counters that
+ * only it writes, with plain loads and stores rather than atomic
+ * read-modify-write instructions, so that counting costs no contention. A
+ * thread links its counters into a global list on its first count, and folds
+ * them into the totals of exited threads when it exits; what it counts after
+ * that goes straight to the totals. Reading the counters sums the totals and
+ * the list under the list's lock: exact for exited threads, a few operations
+ * behind at most for running ones. Arena-wide figures are kept in the arenas
+ * instead (see ya_arena.h). */
+
+#ifndef YA_STATS_H
+#define YA_STATS_H
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h> // for size_t
+
+#include "ya_slab.h"
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* counters of blocks, after those of the slab classes */
+#define STATS_LARGE SLAB_NUM_CLASSES
+#define STATS_NUM_CLASSES (SLAB_NUM_CLASSES + 1)
+
+/*-------*/
+/* Types */
+/*-------*/
+
+struct stats_counters {
+    atomic_size_t mallocs[STATS_NUM_CLASSES];
+    atomic_size_t frees[STATS_NUM_CLASSES];
+    atomic_size_t allocated; // usable bytes of the blocks allocated
+    atomic_size_t freed;     // usable bytes of the blocks freed
+};
+
+struct thread_stats {
+    struct stats_counters counters;
+    struct thread_stats *next; // other threads' counters
+    struct thread_stats *prev;
+    bool linked; // the counters are in the list
+    bool exited; // the thread is exiting, count in the totals
+};
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+// initial-exec: see thread_arena in ya_arena.c
+extern _Thread_local struct thread_stats thread_stats
+        __attribute__((tls_model("initial-exec")));
+
+/*--------------*/
+/* Declarations */
+/*--------------*/
+
+/* Creates the key whose destructor folds each thread's counters into the
+ * totals when it exits. Must be called before any thread other than the main
+ * one starts. */
+void stats_init();
+
+/* Counts for the calling thread when its counters are not linked yet,
+ * linking them, or when it is exiting. */
+void stats_count_slow(int cls, size_t mallocs, size_t frees,
+        size_t allocated, size_t freed);
+
+/* Stores in sum the counters of every thread, running or exited. */
+void stats_sum(struct stats_counters *sum);
+
+/* Fork handlers: the child gets a consistent list and a usable lock. */
+void stats_prefork();
+void stats_postfork_parent();
+void stats_postfork_child();
+
+/*---------*/
+/* Inlines */
+/*---------*/
+
+/* Adds n to the counter, which only the calling thread writes. */
+static inline void stats_add(atomic_size_t *counter, size_t n) {
+    atomic_store_explicit(counter,
+            atomic_load_explicit(counter, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+/* Counts count objects of the class, a slab class or STATS_LARGE, allocated
+ * by the calling thread. Blocks hold n_bytes usable bytes in all, which
+ * objects of slab classes need not count: their size follows from the
+ * class. */
+static inline void stats_malloc(int cls, size_t count, size_t n_bytes) {
+    if (!thread_stats.linked) {
+        stats_count_slow(cls, count, 0, n_bytes, 0);
+        return;
+    }
+    stats_add(&thread_stats.counters.mallocs[cls], count);
+    if (cls == STATS_LARGE) {
+        stats_add(&thread_stats.counters.allocated, n_bytes);
+    }
+}
+
+/* Counts count objects of the class, a slab class or STATS_LARGE, freed by
+ * the calling thread. Blocks hold n_bytes usable bytes in all. */
+static inline void stats_free(int cls, size_t count, size_t n_bytes) {
+    if (!thread_stats.linked) {
+        stats_count_slow(cls, 0, count, 0, n_bytes);
+        return;
+    }
+    stats_add(&thread_stats.counters.frees[cls], count);
+    if (cls == STATS_LARGE) {
+        stats_add(&thread_stats.counters.freed, n_bytes);
+    }
+}
+
+/* Counts a block resized in place from old_bytes to new_bytes usable bytes by
+ * the calling thread. */
+static inline void stats_resize(size_t old_bytes, size_t new_bytes) {
+    if (new_bytes >= old_bytes) {
+        stats_malloc(STATS_LARGE, 0, new_bytes - old_bytes);
+    } else {
+        stats_free(STATS_LARGE, 0, old_bytes - new_bytes);
+    }
+}
+
+#endif // ndef YA_STATS_H
@@ -0,0 +1,99 @@
+/*
+ * Yet Another Malloc
+ * ya_tcache.c
+ */
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <pthread.h>
+
+#include "ya_tcache.h"
+
+/*-------*/
+/* Types */
+/*-------*/
+
+struct tcache {
+    void **bins[TC_NUM_BINS]; // LIFO lists through the objects' first word
+    int counts[TC_NUM_BINS];
+    bool registered; // the exit destructor will run for this thread
+    bool shut_down;  // the thread is exiting, bypass the cache
+};
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+// initial-exec: see thread_arena in ya_arena.c
+static _Thread_local struct tcache tcache
+        __attribute__((tls_model("initial-exec")));
+
+static int tc_max_count = TC_DEFAULT_COUNT;
+static void (*tc_release)(void *ptr) = NULL;
+static pthread_key_t tc_key;
+static bool tc_key_valid = false;
+
+/*-----------*/
+/* Functions */
+/*-----------*/
+
+/* Gives every object cached by the calling thread back to its arena. */
+void tc_flush() {
+    for (int bin = 0; bin < TC_NUM_BINS; bin++) {
+        void **ptr = tcache.bins[bin];
+        while (ptr) {
+            void **next = *ptr;
+            tc_release(ptr);
+            ptr = next;
+        }
+        tcache.bins[bin] = NULL;
+        tcache.counts[bin] = 0;
+    }
+}
+
+/* Gives every cached object back to its arena when a thread exits. Objects
+ * freed later on by the thread library bypass the cache. */
+static void tc_destroy(void *arg) {
+    tcache.shut_down = true;
+    tc_flush();
+}
+
+/* Sets the maximum number of objects cached per bin, 0 disabling the caches,
+ * and the function called to give each object back to its arena when a thread
+ * exits. Must be called before any thread other than the main one starts. */
+void tc_init(int max_count, void (*release)(void *ptr)) {
+    tc_max_count = max_count > 0 ? max_count : 0;
+    tc_release = release;
+    tc_key_valid = !pthread_key_create(&tc_key, tc_destroy);
+}
+
+/* Pops a cached object from bin, a slab class or a tc_block_bin.
+ * Returns NULL if there is none. */
+void *tc_alloc(int bin) {
+    void **ptr = tcache.bins[bin];
+    if (ptr) {
+        tcache.bins[bin] = *ptr;
+        tcache.counts[bin]--;
+    }
+    return ptr;
+}
+
+/* Caches the allocated object in bin, its slab class or tc_block_bin.
+ * Returns false if the object was not cached and should be freed instead. */
+bool tc_free(void *ptr, int bin) {
+    if (tcache.counts[bin] >= tc_max_count || tcache.shut_down) {
+        return false;
+    }
+    if (!tcache.registered && tc_key_valid) {
+        // only the main thread may cache objects before tc_init, and it never
+        // runs the destructor anyway
+        pthread_setspecific(tc_key, &tcache);
+        tcache.registered = true;
+    }
+    *(void **) ptr = tcache.bins[bin];
+    tcache.bins[bin] = ptr;
+    tcache.counts[bin]++;
+    return true;
+}
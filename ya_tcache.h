@@ -0,0 +1,74 @@
+/*
+ * Yet Another Malloc
+ * ya_tcache.h
+ */
+
+/* Per-thread caches of recently freed small objects and blocks.
+ *
+ * Each thread keeps, for every slab size class and every block size up to
+ * TC_MAX_BLOCK words, a LIFO list of the objects or blocks it freed, threaded
+ * through their first word. Cached memory stays marked as allocated in its
+ * run or heap, so blocks are never coalesced, and a malloc of the same class
+ * or size pops one without taking the arena lock. When a thread exits, its
+ * cache is handed back to the arenas. */
+
+#ifndef YA_TCACHE_H
+#define YA_TCACHE_H
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stdbool.h>
+#include <stdint.h> // for intptr_t
+
+#include "ya_slab.h"
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* smallest and largest cached block sizes in words: block_fit of
+ * SLAB_MAX_SIZE + 1 bytes, and blocks of up to 520 bytes */
+#define TC_MIN_BLOCK 34
+#define TC_MAX_BLOCK 66
+
+/* one bin per slab size class, then one per block size */
+#define TC_NUM_BINS (SLAB_NUM_CLASSES + (TC_MAX_BLOCK - TC_MIN_BLOCK) / 2 + 1)
+
+/* default maximum number of objects cached per bin */
+#define TC_DEFAULT_COUNT 32
+
+/*---------*/
+/* Inlines */
+/*---------*/
+
+/* Returns the bin of blocks of size words, or -1 if they are not cached. */
+static inline int tc_block_bin(intptr_t size) {
+    if (size < TC_MIN_BLOCK || size > TC_MAX_BLOCK) {
+        return -1; // realloc may shrink blocks below TC_MIN_BLOCK
+    }
+    return SLAB_NUM_CLASSES + (size - TC_MIN_BLOCK) / 2;
+}
+
+/*--------------*/
+/* Declarations */
+/*--------------*/
+
+/* Sets the maximum number of objects cached per bin, 0 disabling the caches,
+ * and the function called to give each object back to its arena when a thread
+ * exits. Must be called before any thread other than the main one starts. */
+void tc_init(int max_count, void (*release)(void *ptr));
+
+/* Pops a cached object from bin, a slab class or a tc_block_bin.
+ * Returns NULL if there is none. */
+void *tc_alloc(int bin);
+
+/* Gives every object cached by the calling thread back to its arena. */
+void tc_flush();
+
+/* Caches the allocated object in bin, its slab class or tc_block_bin.
+ * Returns false if the object was not cached and should be freed instead. */
+bool tc_free(void *ptr, int bin);
+
+#endif // ndef YA_TCACHE_H
@@ -0,0 +1,320 @@
+/*
+ * Yet Another Malloc
+ * ya_trace.c
+ */
+
+/*---------------------*/
+/* Feature test macros */
+/*---------------------*/
+
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h> // for snprintf
+#include <stdlib.h> // for atexit
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "yamalloc.h"
+#include "ya_trace.h"
+
+/*-------*/
+/* Types */
+/*-------*/
+
+/* Ring buffer of a thread's records, which the thread appends to and which
+ * the lock's holder writes out. */
+struct trace_buffer {
+    struct trace_record records[TRACE_RECORDS];
+    atomic_size_t head;        // records appended
+    atomic_size_t tail;        // records written or dropped
+    struct trace_buffer *next; // other threads' buffers, or free ones
+    struct trace_buffer *prev;
+};
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+atomic_bool trace_on = false;
+
+// initial-exec: see thread_arena in ya_arena.c
+static _Thread_local struct trace_buffer *trace_buffer
+        __attribute__((tls_model("initial-exec"))) = NULL;
+static _Thread_local uint32_t trace_thread
+        __attribute__((tls_model("initial-exec"))) = UINT32_MAX;
+static _Thread_local bool trace_exited
+        __attribute__((tls_model("initial-exec"))) = false;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buffer *trace_buffers = NULL; // linked buffers
+static struct trace_buffer *trace_pool = NULL;    // buffers of exited threads
+static pthread_key_t trace_key;
+static bool trace_key_valid = false;
+static int trace_fd = -1;        // the trace file, while tracing
+static int trace_error = 0;      // errno of its first failed write
+static uint64_t trace_epoch = 0; // monotonic time at the start, in ns
+static uint32_t trace_threads = 0; // indices handed out
+static bool trace_exit_set = false;
+
+/*---------*/
+/* Helpers */
+/*---------*/
+
+/* Returns the monotonic time in nanoseconds. */
+static uint64_t trace_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Writes n_bytes bytes from data to the trace file, unless a write failed
+ * already. The lock must be held. */
+static void trace_write(const void *data, size_t n_bytes) {
+    const char *bytes = data;
+    while (n_bytes && !trace_error) {
+        ssize_t n = write(trace_fd, bytes, n_bytes);
+        if (n >= 0) {
+            bytes += n;
+            n_bytes -= n;
+        } else if (errno != EINTR) {
+            trace_error = errno;
+        }
+    }
+}
+
+/* Writes the records appended to buf since its last flush, or drops them if
+ * not tracing. The lock must be held. */
+static void trace_flush(struct trace_buffer *buf) {
+    size_t head = atomic_load_explicit(&buf->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&buf->tail, memory_order_relaxed);
+    while (trace_fd >= 0 && tail != head) {
+        size_t start = tail % TRACE_RECORDS;
+        size_t count = head - tail;
+        if (count > TRACE_RECORDS - start) {
+            count = TRACE_RECORDS - start; // up to the end of the ring
+        }
+        trace_write(&buf->records[start], count * sizeof(struct trace_record));
+        tail += count;
+    }
+    atomic_store_explicit(&buf->tail, head, memory_order_release);
+}
+
+/* Gives the calling thread an index and a buffer, linked to the others.
+ * Returns the buffer, or NULL if no memory is left for it. */
+static struct trace_buffer *trace_attach() {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_thread == UINT32_MAX) {
+        trace_thread = trace_threads++;
+    }
+    struct trace_buffer *buf = trace_pool;
+    if (buf) {
+        trace_pool = buf->next;
+    } else {
+        buf = mmap(NULL, sizeof(struct trace_buffer), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) {
+            pthread_mutex_unlock(&trace_lock);
+            return NULL;
+        }
+    }
+    atomic_store_explicit(&buf->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&buf->tail, 0, memory_order_relaxed);
+    buf->prev = NULL;
+    buf->next = trace_buffers;
+    if (trace_buffers) {
+        trace_buffers->prev = buf;
+    }
+    trace_buffers = buf;
+    trace_buffer = buf;
+    pthread_mutex_unlock(&trace_lock);
+    // may allocate, which records through trace_buffer
+    if (trace_key_valid) {
+        pthread_setspecific(trace_key, buf);
+    }
+    return buf;
+}
+
+/* Writes the exiting thread's records and gives its buffer back to the
+ * pool. Records of its later calls are written one by one. */
+static void trace_destroy(void *arg) {
+    struct trace_buffer *buf = arg;
+    pthread_mutex_lock(&trace_lock);
+    trace_flush(buf);
+    if (buf->prev) {
+        buf->prev->next = buf->next;
+    } else {
+        trace_buffers = buf->next;
+    }
+    if (buf->next) {
+        buf->next->prev = buf->prev;
+    }
+    buf->next = trace_pool;
+    trace_pool = buf;
+    trace_buffer = NULL;
+    trace_exited = true;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Stops tracing at exit. */
+static void trace_stop_at_exit() {
+    ya_trace_stop();
+}
+
+/*-----------*/
+/* Functions */
+/*-----------*/
+
+/* Creates the key whose destructor writes each thread's buffer when it
+ * exits, and starts tracing into the file at path unless path is NULL, its
+ * first "%p" replaced by the process ID. Must be called before any thread
+ * other than the main one starts. */
+void trace_init(const char *path) {
+    trace_key_valid = !pthread_key_create(&trace_key, trace_destroy);
+    if (!path) {
+        return;
+    }
+    char buf[256];
+    const char *pid = strstr(path, "%p");
+    if (pid) {
+        snprintf(buf, sizeof(buf), "%.*s%d%s", (int) (pid - path), path,
+                (int) getpid(), pid + 2);
+        path = buf;
+    }
+    ya_trace_start(path);
+}
+
+/* Appends a record of the operation op by the calling thread, which returned
+ * or freed ptr, with the argument arg and the size size. */
+void trace_append(int op, const void *ptr, uintptr_t arg, size_t size) {
+    // reads trace_epoch after the start that set it
+    if (!atomic_load_explicit(&trace_on, memory_order_acquire)
+            || (!ptr && op != TRACE_REALLOC)) {
+        return; // nothing allocated nor freed
+    }
+    struct trace_record record = {
+        .time = trace_now_ns() - trace_epoch,
+        .size = size,
+        .ptr = (uintptr_t) ptr,
+        .arg = arg,
+        .op = op,
+    };
+    struct trace_buffer *buf = trace_buffer;
+    if (!buf && !trace_exited) {
+        buf = trace_attach();
+    }
+    if (!buf) {
+        pthread_mutex_lock(&trace_lock);
+        if (trace_thread == UINT32_MAX) {
+            trace_thread = trace_threads++;
+        }
+        record.thread = trace_thread;
+        if (trace_fd >= 0) {
+            trace_write(&record, sizeof(record));
+        }
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    record.thread = trace_thread;
+    size_t head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&buf->tail, memory_order_acquire)
+            == TRACE_RECORDS) {
+        pthread_mutex_lock(&trace_lock);
+        trace_flush(buf);
+        pthread_mutex_unlock(&trace_lock);
+    }
+    buf->records[head % TRACE_RECORDS] = record;
+    atomic_store_explicit(&buf->head, head + 1, memory_order_release);
+}
+
+/* Fork handlers: the child gets a usable lock, and does not trace. */
+void trace_prefork() {
+    pthread_mutex_lock(&trace_lock);
+}
+
+void trace_postfork_parent() {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_postfork_child() {
+    pthread_mutex_init(&trace_lock, NULL);
+    atomic_store_explicit(&trace_on, false, memory_order_relaxed);
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+/* Starts recording every allocation and free into the file at path.
+ * Returns 0 on success, -1 with errno set otherwise. */
+int ya_trace_start(const char *path) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        pthread_mutex_unlock(&trace_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    struct trace_header header = {.record_size = sizeof(struct trace_record)};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    trace_error = 0;
+    trace_write(&header, sizeof(header));
+    if (trace_error) {
+        close(trace_fd);
+        trace_fd = -1;
+        pthread_mutex_unlock(&trace_lock);
+        errno = trace_error;
+        return -1;
+    }
+    // drops the records of calls that raced with the last stop
+    for (struct trace_buffer *buf = trace_buffers; buf; buf = buf->next) {
+        atomic_store_explicit(&buf->tail,
+                atomic_load_explicit(&buf->head, memory_order_relaxed),
+                memory_order_relaxed);
+    }
+    trace_epoch = trace_now_ns();
+    // not tracing yet: atexit's allocations go unrecorded
+    if (!trace_exit_set) {
+        trace_exit_set = !atexit(trace_stop_at_exit);
+    }
+    atomic_store_explicit(&trace_on, true, memory_order_release);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+/* Stops recording, writing every thread's buffered records.
+ * Returns 0 on success, -1 with errno set if a write failed. */
+int ya_trace_stop(void) {
+    atomic_store_explicit(&trace_on, false, memory_order_relaxed);
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return 0;
+    }
+    for (struct trace_buffer *buf = trace_buffers; buf; buf = buf->next) {
+        trace_flush(buf);
+    }
+    int error = trace_error;
+    if (close(trace_fd) && !error) {
+        error = errno;
+    }
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_lock);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Yet Another Malloc
+ * ya_trace.h
+ */
+
+/* Allocation trace recorder.
+ *
+ * While tracing, malloc, free and its sized variants, calloc, realloc and the
+ * aligned allocation functions append a record of each call to a ring buffer
+ * of the calling thread: the operation, the thread's index, the time since
+ * tracing started, the size requested and the pointers returned and passed,
+ * which identify the objects. A thread writes its buffer to the trace file
+ * when it fills up and when the thread exits, and stopping the trace writes
+ * every thread's buffer, so that the file holds the records grouped in runs
+ * by thread after a struct trace_header; yareplay.c sorts them back by time.
+ *
+ * Frees are stamped before they free and allocations after they allocate, so
+ * that sorting by time orders the reuse of memory across threads, but for a
+ * realloc that moves racing with an allocation of the memory it frees.
+ * Records of operations racing with ya_trace_stop may be lost. */
+
+#ifndef YA_TRACE_H
+#define YA_TRACE_H
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* first bytes of a trace file */
+#define TRACE_MAGIC "YATRACE1"
+
+/* records buffered per thread */
+#define TRACE_RECORDS 1024
+
+/*-------*/
+/* Types */
+/*-------*/
+
+enum trace_op {
+    TRACE_MALLOC,
+    TRACE_FREE,    // and its sized variants
+    TRACE_CALLOC,  // size is the total
+    TRACE_REALLOC,
+    TRACE_ALIGNED, // posix_memalign, aligned_alloc, memalign, valloc, pvalloc
+    TRACE_OPS
+};
+
+struct trace_header {
+    char magic[8];        // TRACE_MAGIC, without its terminating null byte
+    uint32_t record_size; // sizeof(struct trace_record)
+    uint32_t reserved;
+};
+
+struct trace_record {
+    uint64_t time;   // nanoseconds since tracing started
+    uint64_t size;   // bytes requested, 0 for frees
+    uint64_t ptr;    // pointer returned, or freed by a free
+    uint64_t arg;    // pointer passed to realloc, or alignment
+    uint32_t thread; // index of the calling thread, from 0
+    uint32_t op;     // enum trace_op
+};
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+/* whether calls are being recorded */
+extern atomic_bool trace_on;
+
+/*--------------*/
+/* Declarations */
+/*--------------*/
+
+/* Creates the key whose destructor writes each thread's buffer when it
+ * exits, and starts tracing into the file at path unless path is NULL. Must
+ * be called before any thread other than the main one starts. */
+void trace_init(const char *path);
+
+/* Appends a record of the operation op by the calling thread, which returned
+ * or freed ptr, with the argument arg and the size size. */
+void trace_append(int op, const void *ptr, uintptr_t arg, size_t size);
+
+/* Fork handlers: the child gets a usable lock, and does not trace. */
+void trace_prefork();
+void trace_postfork_parent();
+void trace_postfork_child();
+
+/*---------*/
+/* Inlines */
+/*---------*/
+
+/* Returns true iff calls are being recorded. */
+static inline bool trace_enabled() {
+    return __builtin_expect(
+            atomic_load_explicit(&trace_on, memory_order_relaxed), false);
+}
+
+/* Records the operation op by the calling thread, if tracing. */
+static inline void trace_add(int op, const void *ptr, uintptr_t arg,
+        size_t size) {
+    if (trace_enabled()) {
+        trace_append(op, ptr, arg, size);
+    }
+}
+
+#endif // ndef YA_TRACE_H
@@ -0,0 +1,465 @@
+/*
+ * Yet Another Malloc
+ * yabench.c
+ * Benchmarks, built without YA_DEBUG
+ */
+
+/*---------------------*/
+/* Feature test macros */
+/*---------------------*/
+
+#define _DEFAULT_SOURCE // for clock_gettime
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <pthread.h>
+#include <sys/resource.h> // for getrusage
+#include <stdio.h>
+#include <stdlib.h> // for getenv
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "yamalloc.h"
+
+/*---------*/
+/* Helpers */
+/*---------*/
+
+/* Returns the current monotonic time in nanoseconds. */
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns the resident set size of the process in bytes. */
+static size_t rss_bytes() {
+    size_t pages = 0;
+    size_t resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* xorshift64, good enough to pick sizes */
+static uint64_t rand_state = 88172645463325252ULL;
+
+static uint64_t rand_next() {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+/* Returns a random size in [min, max]. */
+static size_t rand_size(size_t min, size_t max) {
+    return min + rand_next() % (max - min + 1);
+}
+
+/*------------*/
+/* Benchmarks */
+/*------------*/
+
+/* Measures the latency of small malloc/free pairs while n_live small blocks
+ * are kept allocated, with a free hole between every two of them. */
+static void bench_live_heap(size_t n_live) {
+    const size_t n_ops = 100000;
+    void **live = malloc(n_live * sizeof(void *));
+    void **ops = malloc(n_ops * sizeof(void *));
+    for (size_t i = 0; i < n_live; i++) {
+        live[i] = malloc(rand_size(16, 256));
+    }
+    for (size_t i = 0; i < n_live; i += 2) {
+        free(live[i]);
+        live[i] = NULL;
+    }
+    double start = now_ns();
+    for (size_t i = 0; i < n_ops; i++) {
+        ops[i] = malloc(rand_size(16, 256));
+    }
+    double mid = now_ns();
+    for (size_t i = 0; i < n_ops; i++) {
+        free(ops[i]);
+    }
+    double end = now_ns();
+    printf("live_heap %8zu live: malloc %8.1f ns, free %8.1f ns\n",
+            n_live / 2, (mid - start) / n_ops, (end - mid) / n_ops);
+    for (size_t i = 1; i < n_live; i += 2) {
+        free(live[i]);
+    }
+    free(ops);
+    free(live);
+}
+
+/* Replaces random blocks of random sizes in a pool of long-lived blocks,
+ * and reports the throughput and the growth of the resident set relative to
+ * the peak number of live bytes. */
+static void bench_fragmentation() {
+    const size_t n_slots = 20000;
+    const size_t n_ops = 2000000;
+    size_t rss_base = rss_bytes();
+    void **slots = malloc(n_slots * sizeof(void *));
+    size_t *sizes = malloc(n_slots * sizeof(size_t));
+    memset(slots, 0, n_slots * sizeof(void *));
+    memset(sizes, 0, n_slots * sizeof(size_t));
+    size_t live = 0;
+    size_t peak = 0;
+    double start = now_ns();
+    for (size_t i = 0; i < n_ops; i++) {
+        size_t slot = rand_next() % n_slots;
+        free(slots[slot]);
+        live -= sizes[slot];
+        uint64_t kind = rand_next() % 100;
+        if (kind < 80) {
+            sizes[slot] = rand_size(16, 512);
+        } else if (kind < 98) {
+            sizes[slot] = rand_size(512, 8192);
+        } else {
+            sizes[slot] = rand_size(8192, 65536);
+        }
+        slots[slot] = malloc(sizes[slot]);
+        live += sizes[slot];
+        if (live > peak) {
+            peak = live;
+        }
+    }
+    double end = now_ns();
+    size_t heap = rss_bytes() - rss_base;
+    const char *policy = getenv("YA_POLICY");
+    printf("fragmentation (%s fit): %6.2f Mops/s, rss %7zu KB, "
+            "peak live %7zu KB, rss / peak live %.3f\n",
+            policy ? policy : "first", n_ops * 1e3 / (end - start),
+            heap >> 10, peak >> 10, (double) heap / peak);
+    for (size_t i = 0; i < n_slots; i++) {
+        free(slots[i]);
+    }
+    free(sizes);
+    free(slots);
+    size_t freed = rss_bytes() - rss_base;
+    malloc_trim(0);
+    printf("fragmentation: rss %7zu KB after free, %7zu KB after trim\n",
+            freed >> 10, (rss_bytes() - rss_base) >> 10);
+}
+
+/* Each thread of bench_threads keeps a small window of live blocks, replacing
+ * one at a time. */
+static void *bench_threads_main(void *arg) {
+    const size_t n_ops = 1000000;
+    void *window[16] = {0};
+    uint64_t state = (uint64_t) arg * 0x9e3779b97f4a7c15ULL + 1;
+    for (size_t i = 0; i < n_ops; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        size_t slot = state % 16;
+        free(window[slot]);
+        window[slot] = malloc(16 + (state >> 32) % 240);
+    }
+    for (size_t slot = 0; slot < 16; slot++) {
+        free(window[slot]);
+    }
+    return NULL;
+}
+
+/* Measures the aggregate small malloc/free throughput of 1 to max_threads
+ * threads. */
+static void bench_threads(int max_threads) {
+    const char *count = getenv("YA_TCACHE_COUNT");
+    for (int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        pthread_t threads[n_threads];
+        double start = now_ns();
+        for (intptr_t i = 0; i < n_threads; i++) {
+            pthread_create(&threads[i], NULL, bench_threads_main, (void *) i);
+        }
+        for (int i = 0; i < n_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double end = now_ns();
+        printf("threads %2d (tcache count %s): %7.2f Mops/s\n",
+                n_threads, count ? count : "default",
+                n_threads * 1e6 * 1e3 / (end - start));
+    }
+}
+
+/* Measures growing a buffer by realloc from 4 KB to 256 MB, touching each new
+ * page, then allocating and freeing a 1 MB temporary buffer repeatedly. */
+static void bench_direct() {
+    const size_t n_temps = 10000;
+    const char *threshold = getenv("YA_MMAP_THRESHOLD");
+    double start = now_ns();
+    char *buf = NULL;
+    size_t old_size = 0;
+    for (size_t size = 4096; size <= (256 << 20); size += size / 4) {
+        buf = realloc(buf, size);
+        for (size_t i = old_size; i < size; i += 4096) {
+            buf[i] = 1;
+        }
+        old_size = size;
+    }
+    free(buf);
+    double mid = now_ns();
+    for (size_t i = 0; i < n_temps; i++) {
+        char *volatile temp = malloc(1 << 20);
+        temp[0] = 1;
+        free(temp);
+    }
+    double end = now_ns();
+    printf("direct (threshold %s): realloc growth %7.2f ms, "
+            "1 MB malloc/free %8.1f ns\n", threshold ? threshold : "adaptive",
+            (mid - start) / 1e6, (end - mid) / n_temps);
+}
+
+/* Repeatedly fills then frees 4 MB of 64 KB blocks, the pattern that makes
+ * immediate purging pay a page fault for every page reused, and reports the
+ * throughput and how many bytes were purged and reused. */
+static void bench_decay() {
+    const size_t n_rounds = 2000;
+    const size_t n_blocks = 64;
+    const size_t size = 64 << 10;
+    void *blocks[n_blocks];
+    const char *decay = getenv("YA_DECAY_MS");
+    double start = now_ns();
+    for (size_t round = 0; round < n_rounds; round++) {
+        for (size_t i = 0; i < n_blocks; i++) {
+            blocks[i] = malloc(size);
+            memset(blocks[i], 1, size);
+        }
+        for (size_t i = 0; i < n_blocks; i++) {
+            free(blocks[i]);
+        }
+    }
+    double end = now_ns();
+    size_t purged, reused;
+    ya_decay_stats(&purged, &reused);
+    printf("decay (%s ms): %8.1f us per round, purged %7zu MB, reused %7zu MB\n",
+            decay ? decay : "default", (end - start) / n_rounds / 1e3,
+            purged >> 20, reused >> 20);
+}
+
+/* Reports the resident bytes per object of 1M objects of each small size. */
+static void bench_overhead() {
+    const size_t n_objects = 1000000;
+    const size_t sizes[] = {8, 16, 24, 32, 48, 64, 128};
+    void **objects = malloc(n_objects * sizeof(void *));
+    memset(objects, 0, n_objects * sizeof(void *));
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t rss_base = rss_bytes();
+        for (size_t j = 0; j < n_objects; j++) {
+            objects[j] = malloc(sizes[i]);
+            memset(objects[j], 1, sizes[i]);
+        }
+        size_t rss = rss_bytes() - rss_base;
+        printf("overhead %3zu bytes: %6.1f bytes per object\n",
+                sizes[i], (double) rss / n_objects);
+        for (size_t j = 0; j < n_objects; j++) {
+            free(objects[j]);
+        }
+        malloc_trim(0);
+    }
+    free(objects);
+}
+
+/* Compares allocating then freeing batches of same-size objects one call at
+ * a time and with ya_malloc_batch and ya_free_batch. */
+static void bench_batch() {
+    const size_t n_rounds = 500;
+    const size_t n_objects = 2000;
+    const size_t sizes[] = {64, 512, 2048};
+    void **objects = malloc(n_objects * sizeof(void *));
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double start = now_ns();
+        for (size_t round = 0; round < n_rounds; round++) {
+            for (size_t j = 0; j < n_objects; j++) {
+                objects[j] = malloc(sizes[i]);
+            }
+            for (size_t j = 0; j < n_objects; j++) {
+                free(objects[j]);
+            }
+        }
+        double mid = now_ns();
+        for (size_t round = 0; round < n_rounds; round++) {
+            ya_malloc_batch(sizes[i], n_objects, objects);
+            ya_free_batch(objects, n_objects);
+        }
+        double end = now_ns();
+        printf("batch %4zu bytes: single calls %6.1f ns, batch %6.1f ns "
+                "per malloc/free\n", sizes[i],
+                (mid - start) / n_rounds / n_objects,
+                (end - mid) / n_rounds / n_objects);
+    }
+    free(objects);
+}
+
+/* Compares allocating request-scoped objects of random small sizes then
+ * freeing them all with malloc/free and with a region. */
+static void bench_region() {
+    const size_t n_rounds = 500;
+    const size_t n_objects = 10000;
+    void **objects = malloc(n_objects * sizeof(void *));
+    double start = now_ns();
+    for (size_t round = 0; round < n_rounds; round++) {
+        for (size_t i = 0; i < n_objects; i++) {
+            objects[i] = malloc(rand_size(16, 512));
+        }
+        for (size_t i = 0; i < n_objects; i++) {
+            free(objects[i]);
+        }
+    }
+    double mid = now_ns();
+    struct ya_region *region = ya_region_create(NULL);
+    for (size_t round = 0; round < n_rounds; round++) {
+        for (size_t i = 0; i < n_objects; i++) {
+            objects[i] = ya_region_alloc(region, rand_size(16, 512));
+        }
+        ya_region_reset(region);
+    }
+    ya_region_destroy(region);
+    double end = now_ns();
+    printf("region: malloc/free %6.1f ns, region alloc/reset %6.1f ns "
+            "per object\n", (mid - start) / n_rounds / n_objects,
+            (end - mid) / n_rounds / n_objects);
+    free(objects);
+}
+
+/* Measures alloc/free ping-pong of blocks too large for the thread cache,
+ * with a few live blocks of mixed sizes around, and reports how many requests
+ * the fast bins served. */
+static void bench_pingpong() {
+    const size_t n_ops = 1000000;
+    const size_t sizes[] = {600, 1000};
+    void *live[64];
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (size_t j = 0; j < 64; j++) {
+            live[j] = malloc(rand_size(600, 1000));
+        }
+        double start = now_ns();
+        for (size_t j = 0; j < n_ops; j++) {
+            void *volatile block = malloc(sizes[i]);
+            free(block);
+            size_t k = rand_next() % 64;
+            free(live[k]);
+            live[k] = malloc(rand_size(600, 1000));
+        }
+        double end = now_ns();
+        for (size_t j = 0; j < 64; j++) {
+            free(live[j]);
+        }
+        size_t hits, consolidations;
+        ya_fast_stats(&hits, &consolidations);
+        printf("pingpong %4zu bytes: %6.1f ns per op, fast bin hits %zu, "
+                "consolidations %zu\n", sizes[i], (end - start) / n_ops,
+                hits, consolidations);
+    }
+}
+
+/* Grows the heap to 512 MB of 32 KB blocks, touching every page, then reads
+ * one word of a random block over and over, and reports the time and the
+ * page faults each took. */
+static void bench_growth() {
+    const size_t n_blocks = (512 << 20) / (32 << 10);
+    const size_t n_reads = 10000000;
+    void **blocks = malloc(n_blocks * sizeof(void *));
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long faults = usage.ru_minflt;
+    double start = now_ns();
+    for (size_t i = 0; i < n_blocks; i++) {
+        blocks[i] = malloc(32 << 10);
+        memset(blocks[i], 1, 32 << 10);
+    }
+    double mid = now_ns();
+    getrusage(RUSAGE_SELF, &usage);
+    faults = usage.ru_minflt - faults;
+    size_t sum = 0;
+    for (size_t i = 0; i < n_reads; i++) {
+        size_t j = rand_next();
+        sum += ((char *) blocks[j % n_blocks])[(j >> 32) % (32 << 10)];
+    }
+    double end = now_ns();
+    const char *huge = getenv("YA_HUGE_PAGES");
+    printf("growth (huge pages %s): grow to 512 MB %7.1f ms, %7ld faults, "
+            "random reads %5.1f ns%s\n", huge ? huge : "default",
+            (mid - start) / 1e6, faults, (end - mid) / n_reads,
+            sum ? "" : " ");
+    for (size_t i = 0; i < n_blocks; i++) {
+        free(blocks[i]);
+    }
+    free(blocks);
+}
+
+/* Measures small malloc/free pairs among live blocks while the heap profiler
+ * samples at the interval set with YA_PROF_INTERVAL, if any, and the time to
+ * dump the profile. */
+static void bench_prof() {
+    const size_t n_ops = 10000000;
+    void *live[1024];
+    for (size_t i = 0; i < 1024; i++) {
+        live[i] = malloc(rand_size(16, 2048));
+    }
+    double start = now_ns();
+    for (size_t i = 0; i < n_ops; i++) {
+        size_t k = rand_next() % 1024;
+        free(live[k]);
+        live[k] = malloc(rand_size(16, 2048));
+    }
+    double mid = now_ns();
+    ya_prof_dump("/dev/null");
+    double end = now_ns();
+    for (size_t i = 0; i < 1024; i++) {
+        free(live[i]);
+    }
+    const char *interval = getenv("YA_PROF_INTERVAL");
+    printf("prof (interval %s): %5.1f ns per op, dump %5.2f ms\n",
+            interval ? interval : "off", (mid - start) / n_ops,
+            (end - mid) / 1e6);
+}
+
+/* Runs the benchmark named on the command line, or all of them. */
+int main(int argc, char **argv) {
+    const char *name = argc > 1 ? argv[1] : NULL;
+    if (!name || !strcmp(name, "fragmentation")) {
+        bench_fragmentation();
+    }
+    if (!name || !strcmp(name, "live_heap")) {
+        for (size_t n_live = 2000; n_live <= 2000000; n_live *= 10) {
+            bench_live_heap(n_live);
+        }
+    }
+    if (!name || !strcmp(name, "overhead")) {
+        bench_overhead();
+    }
+    if (!name || !strcmp(name, "direct")) {
+        bench_direct();
+    }
+    if (!name || !strcmp(name, "decay")) {
+        bench_decay();
+    }
+    if (!name || !strcmp(name, "batch")) {
+        bench_batch();
+    }
+    if (!name || !strcmp(name, "region")) {
+        bench_region();
+    }
+    if (!name || !strcmp(name, "pingpong")) {
+        bench_pingpong();
+    }
+    if (!name || !strcmp(name, "growth")) {
+        bench_growth();
+    }
+    if (!name || !strcmp(name, "prof")) {
+        bench_prof();
+    }
+    if (!name || !strcmp(name, "threads")) {
+        bench_threads(argc > 2 ? atoi(argv[2]) : 8);
+    }
+    return 0;
+}
@@ -7,70 +7,972 @@
 /* Includes */
 /*----------*/
 
+#include <errno.h>
+#include <malloc.h> // for struct mallinfo2
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h> // for vsnprintf
+#include <stdlib.h> // for getenv and abort
+#include <string.h>
+#include <unistd.h> // for sysconf
+
 #include "yamalloc.h"
 #include "ya_debug.h"
+#include "ya_arena.h"
 #include "ya_block.h"
 #include "ya_freelist.h"
+#include "ya_latency.h"
+#include "ya_prof.h"
+#include "ya_slab.h"
+#include "ya_stats.h"
+#include "ya_tcache.h"
+#include "ya_trace.h"
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+/* pointers released at once by ya_free_batch, sorted on the stack */
+#define RELEASE_BATCH 64
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+static pthread_once_t ya_once = PTHREAD_ONCE_INIT;
+static bool background_thread = false;
 
 /*----------------------*/
 /* Function definitions */
 /*----------------------*/
 
-/* Splits block both at the block level and in the free list. */
-void split(intptr_t *block, intptr_t size) {
-    fl_mend_split(block, block_split(block, size));
+/* Splits block at the block level, adding the remainder to the arena's free
+ * list. block must not be in the free list. */
+void split(struct arena *arena, intptr_t *block, intptr_t size) {
+    uint64_t since = block_dirty_since(block);
+    intptr_t *next = block_split(block, size);
+    if (next) {
+        block_set_dirty(next, since);
+        fl_free(&arena->fl, next);
+        arena->splits++;
+        lat_take(YA_LAT_SPLIT);
+    }
+}
+
+/* Returns the older of two times since which blocks are dirty, 0 meaning
+ * clean. */
+static inline uint64_t oldest_dirty(uint64_t a, uint64_t b) {
+    return !a || (b && b < a) ? b : a;
 }
 
 /* Coalesces block with neighbors if possible, both at the block level and in
- * the free list. */
-void join(intptr_t *block) {
-    fl_join(block);
-    block_join(block);
+ * the arena's free list. block must not be in the free list.
+ * Returns a pointer to the coalesced block, dirty since the oldest time its
+ * free neighbors were, or clean: the caller marks freed memory dirty. */
+intptr_t *join(struct arena *arena, intptr_t *block) {
+    uint64_t since = 0;
+    intptr_t *next = block_next(block);
+    if (!block_is_alloc(next)) {
+        since = block_dirty_since(next);
+        arena->coalesces++;
+        lat_take(YA_LAT_COALESCE);
+    }
+    if (!block_prev_alloc(block)) {
+        since = oldest_dirty(since, block_dirty_since(block_prev(block)));
+        arena->coalesces++;
+        lat_take(YA_LAT_COALESCE);
+    }
+    fl_join(&arena->fl, block);
+    block = block_join(block);
+    block_set_dirty(block, since);
+    return block;
 }
 
-/* Allocates enough memory to store at least size bytes.
- * Returns a dword-aligned pointer to the memory or NULL in case of failure. */
-void *malloc(size_t n_bytes) {
-    if (n_bytes == 0) {
-        return NULL;
+/* Coalesces the allocated block with its free neighbors and adds the result
+ * to the arena's free list, marking the freed memory dirty. The arena's lock
+ * must be held. */
+static void heap_join(struct arena *arena, intptr_t *block) {
+    lat_take(YA_LAT_FIT);
+    intptr_t size = block_size(block);
+    block_free(block);
+    intptr_t *joined = join(arena, block);
+    fl_free(&arena->fl, joined);
+    arena_dirty(arena, joined, block, size);
+}
+
+/* Consolidates the arena's fast bins: coalesces every block in them and adds
+ * it to the free list. The arena's lock must be held.
+ * Returns false if the fast bins were empty. */
+static bool fast_consolidate(struct arena *arena) {
+    if (!arena->fast_bytes) {
+        return false;
     }
-    if (heap_start == NULL || heap_end == NULL) {
-        if (!heap_init()) {
+    for (int bin = 0; bin < FAST_NUM_BINS; bin++) {
+        intptr_t *block = arena->fast[bin];
+        while (block) {
+            intptr_t *next = (intptr_t *) block[0];
+            block[-1] &= ~TAG_FAST;
+            heap_join(arena, block);
+            block = next;
+        }
+        arena->fast[bin] = NULL;
+    }
+    arena->fast_bytes = 0;
+    arena->fast_consolidations++;
+    return true;
+}
+
+/* Finds a free block of at least size words in the arena's free list,
+ * consolidating the fast bins first if there is none. The arena's lock must
+ * be held.
+ * Returns the block, still in the free list, or NULL if there is none. */
+static intptr_t *heap_find(struct arena *arena, intptr_t size) {
+    intptr_t *block = fl_find(&arena->fl, size);
+    if (!block && fast_consolidate(arena)) {
+        block = fl_find(&arena->fl, size);
+    }
+    return block;
+}
+
+/* Selects the allocation policy from the YA_POLICY environment variable,
+ * "first" (the default) or "best". */
+static void ya_init() {
+    const char *policy = getenv("YA_POLICY");
+    if (policy && !strcmp(policy, "best")) {
+        fl_init(FL_BEST_FIT);
+    } else {
+        fl_init(FL_FIRST_FIT);
+    }
+}
+
+/* Allocates a block of size words from the arena's heap. The arena's lock
+ * must be held. Unless fresh is NULL, sets it to the first of the block's
+ * words from which on all of them but its last are known to be zero, or to
+ * NULL if none is.
+ * Returns the block or NULL in case of failure. */
+static intptr_t *heap_malloc(struct arena *arena, intptr_t size,
+        intptr_t **fresh) {
+    if (fresh) {
+        *fresh = NULL;
+    }
+    int bin = fast_bin(size);
+    intptr_t *block = bin >= 0 ? arena->fast[bin] : NULL;
+    if (block) {
+        arena->fast[bin] = (intptr_t *) block[0];
+        block[-1] &= ~TAG_FAST;
+        arena->fast_bytes -= size * sizeof(intptr_t);
+        arena->fast_hits++;
+        lat_take(YA_LAT_FAST);
+        return block;
+    }
+    lat_take(YA_LAT_FIT);
+    block = heap_find(arena, size);
+    if (!block) {
+        lat_take(YA_LAT_EXTEND);
+        struct segment *seg = arena->segments;
+        intptr_t *end = seg ? seg->end : NULL;
+        block = arena_extend(arena, size);
+        if (!block) {
             return NULL;
         }
+        if (fresh) {
+            // the pages past a segment's end are untouched or were dropped,
+            // but for the free list words and time written if the block
+            // starts there, and its footer
+            *fresh = (arena->segments == seg ? end : arena->segments->start)
+                    + 5;
+        }
     }
-    intptr_t size = block_fit(n_bytes);
-    intptr_t *block = block_find(size);
+    fl_alloc(&arena->fl, block);
+    if (block_dirty_since(block)) {
+        arena->reused += size * sizeof(intptr_t);
+    }
+    split(arena, block, size);
+    block_alloc(block);
+    return block;
+}
+
+/* Allocates a block of size words from the arena's heap whose address is
+ * offset bytes past a multiple of align bytes, a power of two of at least a
+ * dword. The arena's lock must be held.
+ * Returns the block or NULL in case of failure. */
+static intptr_t *heap_malloc_aligned(struct arena *arena, intptr_t size,
+        size_t align, size_t offset) {
+    intptr_t align_words = align / sizeof(intptr_t);
+    intptr_t *block = heap_find(arena, size + align_words + MIN_BLOCK_SIZE);
     if (!block) {
-        block = heap_extend(n_bytes);
+        lat_take(YA_LAT_EXTEND);
+        block = arena_extend(arena, size + align_words + MIN_BLOCK_SIZE);
+        if (!block) {
+            return NULL;
+        }
     }
-    split(block, size);
+    fl_alloc(&arena->fl, block);
+    uint64_t since = block_dirty_since(block);
+    intptr_t gap = (intptr_t *) (round_to((intptr_t) block - offset, align)
+            + offset) - block;
+    if (gap > 0 && gap < MIN_BLOCK_SIZE) {
+        gap += align_words; // leave room for a free block before
+    }
+    if (gap > 0) {
+        // give the part before the aligned block back to the free list
+        intptr_t *aligned = block_split(block, gap);
+        fl_free(&arena->fl, block);
+        arena->splits++;
+        block = aligned;
+        block_set_dirty(block, since);
+    }
+    if (since) {
+        arena->reused += size * sizeof(intptr_t);
+    }
+    split(arena, block, size);
     block_alloc(block);
-    fl_alloc(block);
     return block;
 }
 
+/* Allocates up to count blocks of size words from the arena's heap, storing
+ * them in ptrs. Each free block found, preferably one large enough for the
+ * whole batch, is carved into as many blocks as it holds, the remainder going
+ * back to the free list once. The arena's lock must be held.
+ * Returns the number of blocks allocated, less than count in case of
+ * failure. */
+static size_t heap_malloc_batch(struct arena *arena, intptr_t size,
+        void **ptrs, size_t count) {
+    intptr_t max_count = arena_max_block() / size;
+    size_t done = 0;
+    while (done < count) {
+        intptr_t want = size * (count - done < (size_t) max_count
+                ? (intptr_t) (count - done) : max_count);
+        intptr_t *block = fl_find(&arena->fl, want);
+        if (!block) {
+            block = heap_find(arena, size);
+        }
+        if (!block) {
+            block = arena_extend(arena, want);
+            if (!block) {
+                break;
+            }
+        }
+        fl_alloc(&arena->fl, block);
+        uint64_t since = block_dirty_since(block);
+        intptr_t flags = block_flags(block);
+        intptr_t left = block_size(block);
+        intptr_t *piece = block;
+        size_t first = done;
+        while (true) {
+            ptrs[done++] = piece;
+            left -= size;
+            if (done == count || left < size) {
+                break;
+            }
+            block_init(piece, size, flags | TAG_ALLOC);
+            flags = TAG_PREV_ALLOC;
+            piece += size;
+        }
+        // the last piece takes what is left, then is split like any block
+        block_init(piece, size + left, flags);
+        intptr_t *next = block_split(piece, size);
+        if (next) {
+            block_set_dirty(next, since);
+            fl_free(&arena->fl, next);
+            arena->splits++;
+        }
+        block_alloc(piece);
+        if (since) {
+            arena->reused += (done - first) * size * sizeof(intptr_t);
+        }
+    }
+    return done;
+}
+
+/* Returns true iff block is an allocated block of its segment's heap, not
+ * already freed to a fast bin. */
+static inline bool heap_block_valid(intptr_t *block) {
+    struct segment *seg = segment_of(block);
+    return block >= seg->start && block < seg->end
+            && (block[-1] & (TAG_ALLOC | TAG_FAST)) == TAG_ALLOC;
+}
+
+/* Gives the allocated block back to the arena's heap, through the fast bins
+ * if it is small enough. The arena's lock must be held. */
+static void heap_free(struct arena *arena, intptr_t *block) {
+    if (!heap_block_valid(block)) {
+#ifdef YA_DEBUG
+        struct segment *seg = segment_of(block);
+        if (block >= seg->start && block < seg->end
+                && (block[-1] & TAG_FAST)) {
+            ya_debug("heap_free: %p freed twice to a fast bin\n", block);
+            abort();
+        }
+#endif
+        return; // TODO: provoke segfault
+    }
+    intptr_t size = block_size(block);
+    int bin = fast_bin(size);
+    if (bin >= 0 && fast_budget()) {
+        block[-1] |= TAG_FAST;
+        block[0] = (intptr_t) arena->fast[bin];
+        arena->fast[bin] = block;
+        arena->fast_bytes += size * sizeof(intptr_t);
+        lat_take(YA_LAT_FAST);
+        if (arena->fast_bytes > fast_budget()) {
+            fast_consolidate(arena);
+        }
+        return;
+    }
+    heap_join(arena, block);
+}
+
+/* Carves a new run of the slab class cls out of the arena's heap. The
+ * arena's lock must be held.
+ * Returns false in case of failure. */
+static bool small_add_run(struct arena *arena, int cls) {
+    intptr_t *run = heap_malloc_aligned(arena, SLAB_RUN_WORDS, SLAB_RUN_SIZE,
+            SLAB_RUN_OFFSET);
+    if (!run) {
+        return false;
+    }
+    page_set_run(run, cls);
+    slab_add_run(&arena->slab, cls, run);
+    return true;
+}
+
+/* Allocates an object of the slab class cls, carving a new run out of the
+ * arena's heap if needed. The arena's lock must be held.
+ * Returns the object or NULL in case of failure. */
+static void *small_malloc(struct arena *arena, int cls) {
+    lat_take(YA_LAT_SLAB);
+    void *ptr = slab_alloc(&arena->slab, cls);
+    if (!ptr && small_add_run(arena, cls)) {
+        ptr = slab_alloc(&arena->slab, cls);
+    }
+    return ptr;
+}
+
+/* Allocates up to count objects of the slab class cls, storing them in ptrs
+ * and carving new runs out of the arena's heap as needed. The arena's lock
+ * must be held.
+ * Returns the number of objects allocated, less than count in case of
+ * failure. */
+static size_t small_malloc_batch(struct arena *arena, int cls, void **ptrs,
+        size_t count) {
+    size_t done = slab_alloc_batch(&arena->slab, cls, ptrs, count);
+    while (done < count && small_add_run(arena, cls)) {
+        done += slab_alloc_batch(&arena->slab, cls, ptrs + done,
+                count - done);
+    }
+    return done;
+}
+
+/* Gives the small object back to its run, and the run back to the arena's
+ * heap if it is no longer needed. The arena's lock must be held. */
+static void small_free(struct arena *arena, void *ptr) {
+    lat_take(YA_LAT_SLAB);
+    intptr_t *run = slab_free(&arena->slab, ptr);
+    if (run) {
+        page_set_run(run, -1);
+        heap_free(arena, run);
+    }
+}
+
+/* Gives the allocated object or block back to the run, heap or segment it
+ * came from. Ignores pointers to memory that is not ours. */
+static void release(void *ptr) {
+    uintptr_t entry = pagemap_get(ptr);
+    struct segment *seg = entry_segment(entry);
+    if (!seg) {
+        return; // not ours
+    }
+    struct arena *arena = seg->arena;
+    if (!arena) {
+        lat_take(YA_LAT_DIRECT);
+        direct_free(ptr);
+        return;
+    }
+    pthread_mutex_lock(&arena->lock);
+    if (entry_class(entry) >= 0) {
+        small_free(arena, ptr);
+    } else {
+        heap_free(arena, ptr);
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* Sorts count pointers by address, with an insertion sort: batches are
+ * mostly allocated, hence freed, in address order. */
+static void sort_pointers(void **ptrs, int count) {
+    for (int i = 1; i < count; i++) {
+        void *ptr = ptrs[i];
+        int j = i;
+        for (; j > 0 && (uintptr_t) ptrs[j - 1] > (uintptr_t) ptr; j--) {
+            ptrs[j] = ptrs[j - 1];
+        }
+        ptrs[j] = ptr;
+    }
+}
+
+/* Gives count allocated objects or blocks, all ours, back to the runs, heaps
+ * or segments they came from, in address order. Each arena's lock is taken
+ * once per stretch of pointers into it, and neighboring heap blocks are
+ * joined before going back to the free list together. Sorts ptrs. */
+static void release_batch(void **ptrs, int count) {
+    sort_pointers(ptrs, count);
+    struct arena *locked = NULL;
+    intptr_t *pending = NULL; // allocated blocks joined so far
+    for (int i = 0; i < count; i++) {
+        uintptr_t entry = pagemap_get(ptrs[i]);
+        struct arena *arena = entry_segment(entry)->arena;
+        if (arena != locked) {
+            if (pending) {
+                heap_free(locked, pending);
+                pending = NULL;
+            }
+            if (locked) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            if (arena) {
+                pthread_mutex_lock(&arena->lock);
+            }
+            locked = arena;
+        }
+        intptr_t *block = ptrs[i];
+        if (!arena) {
+            direct_free(block);
+        } else if (entry_class(entry) >= 0) {
+            small_free(arena, block);
+        } else if (!heap_block_valid(block)) {
+#ifdef YA_DEBUG
+            ya_debug("release_batch: %p is not an allocated block\n", block);
+            abort();
+#endif
+            continue; // freed twice or invalid: ignored
+        } else if (pending && block_next(pending) == block) {
+            block_init(pending, block_size(pending) + block_size(block),
+                    block_flags(pending));
+        } else {
+            if (pending) {
+                heap_free(arena, pending);
+            }
+            pending = block;
+        }
+    }
+    if (pending) {
+        heap_free(locked, pending);
+    }
+    if (locked) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/* Fork handlers: the child gets consistent heaps and usable locks. */
+static void ya_prefork() {
+    trace_prefork();
+    prof_prefork();
+    lat_prefork();
+    for (int i = 0; i < arena_count(); i++) {
+        pthread_mutex_lock(&arena_at(i)->lock);
+    }
+    stats_prefork();
+}
+
+static void ya_postfork_parent() {
+    trace_postfork_parent();
+    prof_postfork_parent();
+    lat_postfork_parent();
+    stats_postfork_parent();
+    for (int i = 0; i < arena_count(); i++) {
+        pthread_mutex_unlock(&arena_at(i)->lock);
+    }
+}
+
+static void ya_postfork_child() {
+    trace_postfork_child();
+    prof_postfork_child();
+    lat_postfork_child();
+    stats_postfork_child();
+    for (int i = 0; i < arena_count(); i++) {
+        pthread_mutex_init(&arena_at(i)->lock, NULL);
+    }
+    if (background_thread) {
+        decay_start();
+    }
+}
+
+/* Sets up the arenas, 4 per CPU unless set with the YA_ARENAS environment
+ * variable, the direct threshold, adaptive unless set in bytes with the
+ * YA_MMAP_THRESHOLD environment variable, the thread caches, whose size per
+ * bin may be set with the YA_TCACHE_COUNT environment variable, the
+ * per-thread statistics, the fast bin budget, set in bytes per arena with the
+ * YA_FAST_BYTES environment variable, 0 disabling the fast bins, the use of
+ * transparent huge pages, disabled by setting the YA_HUGE_PAGES environment
+ * variable to 0, the decay time, set in milliseconds with the YA_DECAY_MS
+ * environment variable, the heap profiler, sampling every YA_PROF_INTERVAL
+ * bytes on average if set, dumping to files named after YA_PROF_PREFIX on the
+ * signal numbered YA_PROF_SIGNAL, the latency histograms of instrumented
+ * builds, dumped at exit to the file named by YA_LATENCY_DUMP if set, the
+ * trace recorder, tracing into the file named by YA_TRACE if set, "%p"
+ * standing in it for the process ID, and the fork handlers. Starts the
+ * background decay thread if the YA_BACKGROUND_THREAD environment variable is
+ * set to 1. Runs before main, while the process is still single-threaded. */
+__attribute__((constructor))
+static void ya_constructor() {
+    const char *arenas = getenv("YA_ARENAS");
+    arena_setup(arenas ? atoi(arenas) : 4 * sysconf(_SC_NPROCESSORS_ONLN));
+    const char *threshold = getenv("YA_MMAP_THRESHOLD");
+    direct_setup(threshold ? strtoull(threshold, NULL, 0) : 0);
+    const char *count = getenv("YA_TCACHE_COUNT");
+    tc_init(count ? atoi(count) : TC_DEFAULT_COUNT, release);
+    stats_init();
+    const char *fast = getenv("YA_FAST_BYTES");
+    fast_setup(fast ? strtoull(fast, NULL, 0) : FAST_DEFAULT_BYTES);
+    const char *huge = getenv("YA_HUGE_PAGES");
+    huge_pages_setup(!huge || strcmp(huge, "0"));
+    const char *decay = getenv("YA_DECAY_MS");
+    decay_setup(decay ? atol(decay) : DECAY_DEFAULT_MS);
+    const char *interval = getenv("YA_PROF_INTERVAL");
+    const char *signal = getenv("YA_PROF_SIGNAL");
+    prof_init(interval ? strtoull(interval, NULL, 0) : 0,
+            signal ? atoi(signal) : 0, getenv("YA_PROF_PREFIX"));
+#ifdef YA_INSTRUMENT
+    lat_init(getenv("YA_LATENCY_DUMP"));
+#endif
+    trace_init(getenv("YA_TRACE"));
+    pthread_atfork(ya_prefork, ya_postfork_parent, ya_postfork_child);
+    const char *background = getenv("YA_BACKGROUND_THREAD");
+    background_thread = background && !strcmp(background, "1");
+    if (background_thread) {
+        decay_start();
+    }
+}
+
+/* Returns the number of bytes usable at ptr, an object of the slab class cls
+ * or a block if cls is -1. */
+static inline size_t object_size(void *ptr, int cls) {
+    if (cls >= 0) {
+        return slab_size(cls);
+    }
+    return (block_size(ptr) - 1) * sizeof(intptr_t);
+}
+
+/* Counts ptr, an object of the slab class cls or a block if cls is -1, as
+ * allocated by the calling thread, unless it is NULL, and samples it if its
+ * turn came.
+ * Returns ptr. */
+static inline void *count_malloc(void *ptr, int cls) {
+    if (!ptr) {
+        return NULL;
+    }
+    size_t n_bytes = object_size(ptr, cls);
+    if (cls >= 0) {
+        stats_malloc(cls, 1, 0);
+    } else {
+        stats_malloc(STATS_LARGE, 1, n_bytes);
+    }
+    prof_malloc(ptr, n_bytes);
+    return ptr;
+}
+
+/* Counts ptr, an object of the slab class cls or a block if cls is -1, as
+ * freed by the calling thread, and forgets its sample. */
+static inline void count_free(void *ptr, int cls) {
+    if (cls >= 0) {
+        stats_free(cls, 1, 0);
+    } else {
+        stats_free(STATS_LARGE, 1, object_size(ptr, -1));
+    }
+    prof_free(ptr);
+}
+
+/* Allocates enough memory to store at least n_bytes bytes, as a small object
+ * or a block. Zero bytes get the smallest object rather than NULL, which
+ * callers like gnulib's xmalloc would take for a failure.
+ * Returns a dword-aligned pointer to the memory or NULL in case of failure. */
+static void *allocate(size_t n_bytes) {
+    if (n_bytes == 0) {
+        n_bytes = 1;
+    }
+    int cls = slab_class(n_bytes);
+    if (cls >= 0) {
+        void *ptr = tc_alloc(cls);
+        if (ptr) {
+            return count_malloc(ptr, cls);
+        }
+        pthread_once(&ya_once, ya_init);
+        struct arena *arena = arena_get();
+        pthread_mutex_lock(&arena->lock);
+        ptr = small_malloc(arena, cls);
+        pthread_mutex_unlock(&arena->lock);
+        return count_malloc(ptr, cls);
+    }
+    intptr_t size = block_fit(n_bytes);
+    int bin = tc_block_bin(size);
+    intptr_t *block = bin >= 0 ? tc_alloc(bin) : NULL;
+    if (block) {
+        return count_malloc(block, -1);
+    }
+    if (direct_wanted(size)) {
+        lat_take(YA_LAT_DIRECT);
+        return count_malloc(direct_alloc(size, 2 * sizeof(intptr_t)), -1);
+    }
+    pthread_once(&ya_once, ya_init);
+    struct arena *arena = arena_get();
+    pthread_mutex_lock(&arena->lock);
+    block = heap_malloc(arena, size, NULL);
+    pthread_mutex_unlock(&arena->lock);
+    return count_malloc(block, -1);
+}
+
+/* Allocates like allocate, recording the latency as that of a malloc. */
+static inline void *allocate_timed(size_t n_bytes) {
+    uint64_t start = lat_start();
+    void *ptr = allocate(n_bytes);
+    lat_end(YA_LAT_MALLOC, start);
+    return ptr;
+}
+
+/* Allocates enough memory to store at least size bytes.
+ * Returns a dword-aligned pointer to the memory or NULL in case of failure. */
+void *malloc(size_t n_bytes) {
+    // checked first, for untraced calls to end in a tail call
+    if (trace_enabled()) {
+        void *ptr = allocate_timed(n_bytes);
+        trace_append(TRACE_MALLOC, ptr, 0, n_bytes);
+        return ptr;
+    }
+    return allocate_timed(n_bytes);
+}
+
+/* Returns the number of bytes usable at ptr, which has the page map entry
+ * entry. */
+static size_t usable_size(void *ptr, uintptr_t entry) {
+    return object_size(ptr, entry_class(entry));
+}
+
+/* Frees the memory pointed to by ptr, n_bytes bytes as requested from the
+ * allocator, or 0 if the size is unknown. Small objects get their class from
+ * the page map entry, and blocks of a known size get their thread cache bin
+ * without reading their header. With YA_DEBUG, aborts if n_bytes cannot be
+ * the size requested for ptr. */
+static inline void deallocate(void *ptr, size_t n_bytes) {
+    uintptr_t entry = pagemap_get(ptr);
+    if (!entry) {
+        return; // NULL or not ours, like memory from before we were loaded
+    }
+    int cls = entry_class(entry);
+#ifdef YA_DEBUG
+    if (n_bytes && (n_bytes > usable_size(ptr, entry)
+                || (cls >= 0 && slab_class(n_bytes) != cls))) {
+        ya_debug("deallocate: %p freed with size %zu, has %zu usable bytes\n",
+                ptr, n_bytes, usable_size(ptr, entry));
+        abort();
+    }
+#endif
+    count_free(ptr, cls);
+    int bin = cls;
+    if (cls < 0) {
+        // a block may be larger than block_fit(n_bytes) if it was not split,
+        // which only matters to the cache as a few bytes wasted
+        bin = tc_block_bin(n_bytes ? block_fit(n_bytes) : block_size(ptr));
+    }
+    if (bin >= 0 && tc_free(ptr, bin)) {
+        return;
+    }
+    release(ptr);
+}
+
+/* Frees ptr like deallocate, recording the latency as that of a free, and
+ * the call if tracing. */
+static inline void deallocate_timed(void *ptr, size_t n_bytes) {
+    trace_add(TRACE_FREE, ptr, 0, 0);
+    uint64_t start = lat_start();
+    deallocate(ptr, n_bytes);
+    lat_end(YA_LAT_FREE, start);
+}
+
 /* Frees the memory block pointed to by ptr, which must have been allocated
  * through a call to malloc, calloc or realloc before. Otherwise, undefined
  * behavior occurs. */
 void free(void *ptr) {
-    intptr_t *block = ptr;
-    if (block < heap_start || block > heap_end || !block_is_alloc(block)) {
-        return; // TODO: provoke segfault
+    deallocate_timed(ptr, 0);
+}
+
+/* Like free, for memory allocated with malloc(n_bytes), calloc or realloc
+ * with a total of n_bytes bytes. */
+void free_sized(void *ptr, size_t n_bytes) {
+    deallocate_timed(ptr, n_bytes);
+}
+
+/* Like free, for memory allocated with aligned_alloc(alignment, n_bytes). */
+void free_aligned_sized(void *ptr, size_t alignment, size_t n_bytes) {
+    if (alignment <= SLAB_MAX_SIZE
+            && round_to(n_bytes, alignment) <= SLAB_MAX_SIZE) {
+        n_bytes = round_to(n_bytes, alignment); // as in allocate_aligned
     }
-    block_free(block);
-    fl_free(block);
-    join(block);
+    deallocate_timed(ptr, n_bytes);
+}
+
+/* Counts the count objects of the slab class cls, or blocks if cls is -1, at
+ * ptrs as allocated by the calling thread, and samples those whose turn came.
+ * Returns count. */
+static size_t count_malloc_batch(void **ptrs, size_t count, int cls) {
+    size_t n_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t object_bytes = object_size(ptrs[i], cls);
+        prof_malloc(ptrs[i], object_bytes);
+        n_bytes += object_bytes;
+    }
+    stats_malloc(cls >= 0 ? cls : STATS_LARGE, count, n_bytes);
+    return count;
+}
+
+/* Allocates up to count blocks of n_bytes bytes each, storing pointers to
+ * them in ptrs, with one pass over the thread cache and one over the arena.
+ * Zero bytes get the smallest objects, as with allocate.
+ * Returns the number of blocks allocated, less than count in case of
+ * failure. */
+static size_t malloc_batch(size_t n_bytes, size_t count, void **ptrs) {
+    if (n_bytes == 0) {
+        n_bytes = 1;
+    }
+    int cls = slab_class(n_bytes);
+    intptr_t size = cls >= 0 ? 0 : block_fit(n_bytes);
+    int bin = cls >= 0 ? cls : tc_block_bin(size);
+    size_t done = 0;
+    while (bin >= 0 && done < count && (ptrs[done] = tc_alloc(bin))) {
+        done++;
+    }
+    if (done == count) {
+        return count_malloc_batch(ptrs, done, cls);
+    }
+    if (cls < 0 && direct_wanted(size)) {
+        while (done < count
+                && (ptrs[done] = direct_alloc(size, 2 * sizeof(intptr_t)))) {
+            done++;
+        }
+        return count_malloc_batch(ptrs, done, cls);
+    }
+    pthread_once(&ya_once, ya_init);
+    struct arena *arena = arena_get();
+    pthread_mutex_lock(&arena->lock);
+    if (cls >= 0) {
+        done += small_malloc_batch(arena, cls, ptrs + done, count - done);
+    } else {
+        done += heap_malloc_batch(arena, size, ptrs + done, count - done);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return count_malloc_batch(ptrs, done, cls);
+}
+
+/* Allocates up to count blocks of n_bytes bytes each like malloc_batch,
+ * recording the calls if tracing.
+ * Returns the number of blocks allocated. */
+size_t ya_malloc_batch(size_t n_bytes, size_t count, void **ptrs) {
+    size_t done = malloc_batch(n_bytes, count, ptrs);
+    if (trace_enabled()) {
+        for (size_t i = 0; i < done; i++) {
+            trace_append(TRACE_MALLOC, ptrs[i], 0, n_bytes);
+        }
+    }
+    return done;
+}
+
+/* Frees the count blocks pointed to by ptrs, like as many calls to free but
+ * taking each arena's lock once per stretch of pointers into it and joining
+ * neighboring blocks before they go back to the free list. Leaves ptrs
+ * untouched. */
+void ya_free_batch(void **ptrs, size_t count) {
+    if (trace_enabled()) {
+        for (size_t i = 0; i < count; i++) {
+            trace_append(TRACE_FREE, ptrs[i], 0, 0);
+        }
+    }
+    void *batch[RELEASE_BATCH];
+    int n = 0;
+    for (size_t i = 0; i < count; i++) {
+        void *ptr = ptrs[i];
+        uintptr_t entry = pagemap_get(ptr);
+        if (!entry) {
+            continue; // NULL or not ours, as in deallocate
+        }
+        int cls = entry_class(entry);
+        count_free(ptr, cls);
+        int bin = cls >= 0 ? cls : tc_block_bin(block_size(ptr));
+        if (bin >= 0 && tc_free(ptr, bin)) {
+            continue;
+        }
+        batch[n++] = ptr;
+        if (n == RELEASE_BATCH) {
+            release_batch(batch, n);
+            n = 0;
+        }
+    }
+    release_batch(batch, n);
+}
+
+/* Allocates enough memory to store at least n_bytes bytes like allocate,
+ * and clears them. Direct segments are fresh from the kernel, and so are the
+ * words of heap blocks carved past the end of their segment, which need not
+ * be cleared again.
+ * Returns a dword-aligned pointer to the memory or NULL in case of failure. */
+static void *allocate_zeroed(size_t n_bytes) {
+    intptr_t size = block_fit(n_bytes);
+    if (n_bytes == 0 || slab_class(n_bytes) >= 0 || tc_block_bin(size) >= 0) {
+        // not malloc, which compilers would merge with memset into a call to
+        // calloc
+        void *ptr = allocate(n_bytes);
+        if (ptr) {
+            memset(ptr, 0, n_bytes);
+        }
+        return ptr;
+    }
+    if (direct_wanted(size)) {
+        lat_take(YA_LAT_DIRECT);
+        return count_malloc(direct_alloc(size, 2 * sizeof(intptr_t)), -1);
+    }
+    pthread_once(&ya_once, ya_init);
+    struct arena *arena = arena_get();
+    pthread_mutex_lock(&arena->lock);
+    intptr_t *fresh;
+    intptr_t *block = heap_malloc(arena, size, &fresh);
+    pthread_mutex_unlock(&arena->lock);
+    if (block) {
+        char *clean = (char *) block + n_bytes;
+        if (fresh && (char *) fresh < clean) {
+            clean = fresh > block ? (char *) fresh : (char *) block;
+        }
+        memset(block, 0, clean - (char *) block);
+        block[size-2] = 0; // the footer it had while free
+    }
+    return count_malloc(block, -1);
 }
 
 /* Allocates enough memory to store an array of nmemb elements,
  * each size bytes large, and clears the memory.
- * Returns the pointer to the allocated memory or NULL in case of failure. */
+ * Returns the pointer to the allocated memory or NULL in case of failure,
+ * setting errno to ENOMEM if nmemb * size overflows. */
 void *calloc(size_t nmemb, size_t n_bytes) {
-    intptr_t *block = malloc(n_bytes * nmemb);
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, n_bytes, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint64_t start = lat_start();
+    void *ptr = allocate_zeroed(total);
+    lat_end(YA_LAT_CALLOC, start);
+    trace_add(TRACE_CALLOC, ptr, 0, total);
+    return ptr;
+}
+
+/* Tries to resize the block to new_size words without moving it. The arena's
+ * lock must be held.
+ * Returns true on success. */
+static bool heap_resize(struct arena *arena, intptr_t *block,
+        intptr_t new_size) {
     intptr_t size = block_size(block);
-    block_clear(block);
-    return block;
+    if (new_size == size) {
+        return true; // don't change anything
+    }
+    if (new_size < size) {
+        intptr_t *next = block_split(block, new_size);
+        block_alloc(block);
+        if (next) {
+            arena->splits++;
+            // coalesce the leftovers with the following block
+            intptr_t *joined = join(arena, next);
+            fl_free(&arena->fl, joined);
+            arena_dirty(arena, joined, next, size - new_size);
+        }
+        return true;
+    }
+    struct segment *seg = segment_of(block);
+    intptr_t *next = block_next(block);
+    if (next == seg->end ||
+            (!block_is_alloc(next) && block_next(next) == seg->end)) {
+        // grow the segment's heap so that block may be extended, then fall
+        // into the next if clause
+        intptr_t *last = segment_extend(arena, seg, new_size - size);
+        if (last) {
+            next = last;
+        }
+    }
+    // try to use next free block
+    intptr_t next_size = block_size(next);
+    if (!block_is_alloc(next) && new_size <= size + next_size) {
+        fl_alloc(&arena->fl, next); // remove the next block from the free list
+        // try to split the next block at the right size
+        split(arena, next, new_size - size);
+        block_join_next(block); // coalesce
+        arena->coalesces++;
+        block_alloc(block); // mark block as allocated
+        return true;
+    }
+    return false;
+}
+
+/* Tries to resize the block to new_size words within its heap or direct
+ * segment.
+ * Returns a pointer to the block, which may have moved, or NULL in case of
+ * failure, leaving the block untouched. */
+static intptr_t *resize(intptr_t *block, intptr_t new_size) {
+    struct arena *arena = segment_of(block)->arena;
+    if (!arena) {
+        lat_take(YA_LAT_DIRECT);
+        return direct_realloc(block, new_size);
+    }
+    pthread_mutex_lock(&arena->lock);
+    bool resized = heap_resize(arena, block, new_size);
+    pthread_mutex_unlock(&arena->lock);
+    return resized ? block : NULL;
+}
+
+/* Resizes the memory pointed to by ptr to n_bytes bytes, in place if
+ * possible, like realloc.
+ * Returns a pointer to the memory, which may have moved, or NULL. */
+static void *reallocate(void *ptr, size_t n_bytes) {
+    if (!ptr) {
+        return allocate(n_bytes);
+    }
+    if (n_bytes == 0) {
+        deallocate(ptr, 0);
+        return NULL;
+    }
+    uintptr_t entry = pagemap_get(ptr);
+    if (!entry) {
+        return NULL; // not ours
+    }
+    int cls = entry_class(entry);
+    lat_take(YA_LAT_INPLACE);
+    if (cls >= 0) {
+        if (slab_class(n_bytes) == cls) {
+            return ptr;
+        }
+    } else {
+        size_t old_bytes = object_size(ptr, -1);
+        intptr_t *block = resize(ptr, block_fit(n_bytes));
+        if (block) {
+            size_t new_bytes = object_size(block, -1);
+            stats_resize(old_bytes, new_bytes);
+            // sampled again, as a new allocation
+            prof_free(ptr);
+            prof_malloc(block, new_bytes);
+            return block;
+        }
+    }
+    size_t old_bytes = usable_size(ptr, entry);
+    // resizing failed, so allocate new memory and copy
+    lat_take(YA_LAT_COPY);
+    void *new_ptr = allocate(n_bytes);
+    if (!new_ptr) {
+        return NULL;
+    }
+    size_t copy = old_bytes < n_bytes ? old_bytes : n_bytes;
+    if (copy >= DIRECT_THRESHOLD_MIN && !segment_of(new_ptr)->arena) {
+        // the copy would fault the fresh pages in one at a time
+        direct_populate(new_ptr, copy);
+    }
+    memcpy(new_ptr, ptr, copy);
+    deallocate(ptr, 0);
+    return new_ptr;
 }
 
 /* Resizes the previously allocated memory pointed to by ptr to size.
@@ -80,85 +982,368 @@ void *calloc(size_t nmemb, size_t n_bytes) {
  * realloc, undefined behavior occurs.
  *  */
 void *realloc(void *ptr, size_t n_bytes) {
-    if (!ptr) {
-        return malloc(n_bytes);
+    uint64_t start = lat_start();
+    void *new_ptr = reallocate(ptr, n_bytes);
+    lat_end(YA_LAT_REALLOC, start);
+    trace_add(TRACE_REALLOC, new_ptr, (uintptr_t) ptr, n_bytes);
+    return new_ptr;
+}
+
+/* Like realloc(ptr, nmemb * size), failing with ENOMEM if the product
+ * overflows. */
+void *reallocarray(void *ptr, size_t nmemb, size_t n_bytes) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, n_bytes, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+/* Allocates enough memory to store at least n_bytes bytes aligned on align
+ * bytes, a power of two. Small objects whose size is a multiple of align are
+ * naturally aligned on it. Blocks are carved out of the heap at the right
+ * alignment, giving the slack before them back to the free list.
+ * Returns a pointer to the memory or NULL in case of failure. */
+static void *allocate_aligned(size_t align, size_t n_bytes) {
+    if (align <= 2 * sizeof(intptr_t)) {
+        return allocate(n_bytes);
+    }
+    if (align > SEGMENT_SIZE / 2) {
+        return NULL;
     }
     if (n_bytes == 0) {
-        free(ptr);
+        n_bytes = 1;
+    }
+    if (align <= SLAB_MAX_SIZE && round_to(n_bytes, align) <= SLAB_MAX_SIZE) {
+        return allocate(round_to(n_bytes, align));
+    }
+    intptr_t size = block_fit(n_bytes);
+    intptr_t align_words = align / sizeof(intptr_t);
+    if (direct_wanted(size)
+            || size + align_words + MIN_BLOCK_SIZE > arena_max_block()) {
+        return count_malloc(direct_alloc(size, align), -1);
+    }
+    pthread_once(&ya_once, ya_init);
+    struct arena *arena = arena_get();
+    pthread_mutex_lock(&arena->lock);
+    intptr_t *block = heap_malloc_aligned(arena, size, align, 0);
+    pthread_mutex_unlock(&arena->lock);
+    return count_malloc(block, -1);
+}
+
+/* Allocates like allocate_aligned, recording the call if tracing. */
+static void *allocate_aligned_traced(size_t align, size_t n_bytes) {
+    void *ptr = allocate_aligned(align, n_bytes);
+    trace_add(TRACE_ALIGNED, ptr, align, n_bytes);
+    return ptr;
+}
+
+/* Returns true iff n is a power of two. */
+static inline bool is_power_of_2(size_t n) {
+    return n && !(n & (n - 1));
+}
+
+/* Allocates size bytes aligned on alignment, a power of two multiple of
+ * sizeof(void *), storing the pointer in *memptr.
+ * Returns 0 on success, EINVAL for an invalid alignment, ENOMEM otherwise. */
+int posix_memalign(void **memptr, size_t alignment, size_t n_bytes) {
+    if (!is_power_of_2(alignment) || alignment % sizeof(void *)) {
+        return EINVAL;
+    }
+    void *ptr = allocate_aligned_traced(alignment, n_bytes);
+    if (!ptr && n_bytes) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+/* Allocates size bytes aligned on alignment, a power of two. */
+void *aligned_alloc(size_t alignment, size_t n_bytes) {
+    if (!is_power_of_2(alignment)) {
+        errno = EINVAL;
         return NULL;
     }
-    intptr_t *block = ptr;
-    if (block < heap_start) {
-        return NULL; // TODO: provoke segfault
+    return allocate_aligned_traced(alignment, n_bytes);
+}
+
+/* Allocates size bytes aligned on alignment rounded up to a power of two. */
+void *memalign(size_t alignment, size_t n_bytes) {
+    size_t align = 1;
+    while (align < alignment && align) {
+        align <<= 1;
     }
-    intptr_t new_size = block_fit(n_bytes);
-    intptr_t size = block_size(block); // segfault if ptr after heap end
-    if (new_size == size) {
-        return ptr; // don't change anything
+    return align ? allocate_aligned_traced(align, n_bytes) : NULL;
+}
+
+/* Allocates size bytes aligned on a page. */
+void *valloc(size_t n_bytes) {
+    return allocate_aligned_traced(sysconf(_SC_PAGESIZE), n_bytes);
+}
+
+/* Allocates size bytes rounded up to a whole number of pages, aligned on a
+ * page. */
+void *pvalloc(size_t n_bytes) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t rounded = (n_bytes + page - 1) & -page;
+    if (rounded < n_bytes) {
+        errno = ENOMEM;
+        return NULL;
     }
-    if (new_size < size) {
-        intptr_t *next = block_split(block, new_size);
-        if (next) {
-            fl_free(next); // add the next from the free list
-            fl_join_next(next);
-            block_join_next(next); // coalesce the leftovers
-        }
-        block_alloc(block);
-        // no need to remove it from the free list, it wasn't in it
-        return block;
+    return allocate_aligned_traced(page, rounded ? rounded : page);
+}
+
+/* Returns the number of bytes usable at ptr, at least the size requested,
+ * or 0 if ptr is NULL or was not allocated here. */
+size_t malloc_usable_size(void *ptr) {
+    uintptr_t entry = pagemap_get(ptr);
+    return entry ? usable_size(ptr, entry) : 0;
+}
+
+/* Gives the calling thread's cached blocks back to the heap, then returns as
+ * much free memory as possible to the system, keeping pad bytes at the end of
+ * each arena's heap.
+ * Returns 1 if any memory was released, 0 otherwise. */
+int malloc_trim(size_t pad) {
+    tc_flush();
+    size_t released = 0;
+    for (int i = 0; i < arena_count(); i++) {
+        struct arena *arena = arena_at(i);
+        pthread_mutex_lock(&arena->lock);
+        fast_consolidate(arena);
+        released += arena_trim(arena, pad);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    return released > 0;
+}
+
+/* Reports the number of bytes purged or trimmed so far, and the number of
+ * dirty bytes allocated again before they decayed. */
+void ya_decay_stats(size_t *purged, size_t *reused) {
+    *purged = 0;
+    *reused = 0;
+    for (int i = 0; i < arena_count(); i++) {
+        struct arena *arena = arena_at(i);
+        pthread_mutex_lock(&arena->lock);
+        *purged += arena->purged;
+        *reused += arena->reused;
+        pthread_mutex_unlock(&arena->lock);
     }
-    intptr_t *next = block + size;
-    if (next == heap_end || next == fl_get_end()) {
-        // grow the heap and extend block
-        next = heap_extend(n_bytes);
-        // then fall into next if clause which will use the newly extended
-        // heap to extend the block without moving it
+}
+
+/* Reports the number of heap requests served from the fast bins so far, and
+ * the number of times the fast bins were consolidated. */
+void ya_fast_stats(size_t *hits, size_t *consolidations) {
+    *hits = 0;
+    *consolidations = 0;
+    for (int i = 0; i < arena_count(); i++) {
+        struct arena *arena = arena_at(i);
+        pthread_mutex_lock(&arena->lock);
+        *hits += arena->fast_hits;
+        *consolidations += arena->fast_consolidations;
+        pthread_mutex_unlock(&arena->lock);
     }
-    // try to use next free block
-    if (next < heap_end) {
-        intptr_t next_size = block_size(next);
-        if (!block_is_alloc(next) && new_size <= size + next_size) {
-            // try to split the next block at the right size
-            split(next, new_size - size);
-            fl_alloc(next); // remove the next block from the free list
-            block_join_next(block); // coalesce
-            block_alloc(block); // mark block as allocated
-            return block;
+}
+
+/* Stores the allocator's statistics in stats: the sum of every thread's
+ * counts, then the figures of each arena, read under its lock, and those of
+ * the direct segments. */
+void ya_stats(struct ya_stats *stats) {
+    _Static_assert(YA_STATS_CLASSES == SLAB_NUM_CLASSES,
+            "YA_STATS_CLASSES must match the slab classes");
+    *stats = (struct ya_stats) {0};
+    struct stats_counters sum;
+    stats_sum(&sum);
+    size_t allocated = sum.allocated;
+    size_t freed = sum.freed;
+    for (int cls = 0; cls < SLAB_NUM_CLASSES; cls++) {
+        stats->small[cls].size = slab_size(cls);
+        stats->small[cls].mallocs = sum.mallocs[cls];
+        stats->small[cls].frees = sum.frees[cls];
+        allocated += sum.mallocs[cls] * slab_size(cls);
+        freed += sum.frees[cls] * slab_size(cls);
+    }
+    stats->large.mallocs = sum.mallocs[STATS_LARGE];
+    stats->large.frees = sum.frees[STATS_LARGE];
+    // frees counted before the allocations they undo were summed
+    stats->allocated_bytes = allocated > freed ? allocated - freed : 0;
+    for (int i = 0; i < arena_count(); i++) {
+        struct arena *arena = arena_at(i);
+        pthread_mutex_lock(&arena->lock);
+        for (struct segment *seg = arena->segments; seg; seg = seg->next) {
+            stats->mapped_bytes += seg->committed - (char *) seg;
+            stats->heap_bytes += (char *) seg->end - (char *) seg->start;
+            intptr_t *last = segment_last_free(seg);
+            if (last) {
+                stats->releasable_bytes += block_size(last) * sizeof(intptr_t);
+            }
         }
+        stats->free_bytes += arena->fl.n_words * sizeof(intptr_t);
+        stats->free_blocks += arena->fl.n_blocks;
+        stats->fast_bytes += arena->fast_bytes;
+        stats->splits += arena->splits;
+        stats->coalesces += arena->coalesces;
+        pthread_mutex_unlock(&arena->lock);
+    }
+    stats->direct_bytes = sys_stats.direct_bytes;
+    stats->direct_segments = sys_stats.direct_segments;
+    stats->mapped_bytes += stats->direct_bytes;
+    stats->maps = sys_stats.maps;
+    stats->unmaps = sys_stats.unmaps;
+    stats->commits = sys_stats.commits;
+}
+
+/* Appends the text formatted like printf to the text of length *len in buf,
+ * holding size bytes, as far as it fits, and adds its length to *len. */
+static void append(char *buf, size_t size, size_t *len,
+        const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(*len < size ? buf + *len : NULL,
+            *len < size ? size - *len : 0, format, args);
+    va_end(args);
+    if (n > 0) {
+        *len += n;
+    }
+}
+
+/* Writes the allocator's statistics as a JSON object into buf, holding size
+ * bytes, truncated if needed but always terminated unless size is 0.
+ * Returns the length of the whole object, like snprintf. */
+size_t ya_stats_json(char *buf, size_t size) {
+    struct ya_stats stats;
+    ya_stats(&stats);
+    const struct {
+        const char *name;
+        size_t value;
+    } fields[] = {
+        {"mapped_bytes", stats.mapped_bytes},
+        {"heap_bytes", stats.heap_bytes},
+        {"allocated_bytes", stats.allocated_bytes},
+        {"free_bytes", stats.free_bytes},
+        {"free_blocks", stats.free_blocks},
+        {"fast_bytes", stats.fast_bytes},
+        {"releasable_bytes", stats.releasable_bytes},
+        {"direct_bytes", stats.direct_bytes},
+        {"direct_segments", stats.direct_segments},
+        {"maps", stats.maps},
+        {"unmaps", stats.unmaps},
+        {"commits", stats.commits},
+        {"splits", stats.splits},
+        {"coalesces", stats.coalesces},
+    };
+    size_t len = 0;
+    append(buf, size, &len, "{");
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        append(buf, size, &len, "\"%s\":%zu,", fields[i].name,
+                fields[i].value);
     }
-    // resizing failed, so allocate a whole new block and copy
-    intptr_t *new_block = malloc(n_bytes);
-    for (int i = 0; i < size; i++) {
-        new_block[i] = block[i];
+    append(buf, size, &len, "\"small\":[");
+    for (int cls = 0; cls < YA_STATS_CLASSES; cls++) {
+        append(buf, size, &len, "%s{\"size\":%zu,\"mallocs\":%zu,"
+                "\"frees\":%zu}", cls ? "," : "", stats.small[cls].size,
+                stats.small[cls].mallocs, stats.small[cls].frees);
     }
-    free(block);
-    return new_block;
+    append(buf, size, &len, "],\"large\":{\"mallocs\":%zu,\"frees\":%zu}}",
+            stats.large.mallocs, stats.large.frees);
+    return len;
+}
+
+/* Returns the allocator's statistics in the format of glibc, whose free
+ * space counts the fast bins and whose allocated space is the rest of the
+ * heaps. */
+struct mallinfo2 mallinfo2(void) {
+    struct ya_stats stats;
+    ya_stats(&stats);
+    size_t free_bytes = stats.free_bytes + stats.fast_bytes;
+    return (struct mallinfo2) {
+        .arena = stats.heap_bytes,
+        .ordblks = stats.free_blocks,
+        .hblks = stats.direct_segments,
+        .hblkhd = stats.direct_bytes,
+        .fsmblks = stats.fast_bytes,
+        .uordblks = stats.heap_bytes - free_bytes,
+        .fordblks = free_bytes,
+        .keepcost = stats.releasable_bytes,
+    };
+}
+
+/* Samples allocations for the heap profile, one every interval bytes
+ * allocated on average, 0 stopping sampling. */
+void ya_prof_set_interval(size_t interval) {
+    prof_set_interval(interval);
+}
+
+/* Writes the heap profile of the live sampled allocations to the file at
+ * path, in the format of gperftools' heap profiler, read by pprof.
+ * Returns 0 on success, -1 with errno set otherwise. */
+int ya_prof_dump(const char *path) {
+    return prof_dump(path);
+}
+
+/* C++14 sized operator delete and delete[], and their C++17 aligned
+ * variants, which libstdc++ would otherwise forward to free, dropping the
+ * size. Defined under their mangled names, size_t being unsigned long and
+ * std::align_val_t passed as one. */
+YA_EXPORT void ya_delete_sized(void *ptr, size_t n_bytes)
+        __asm__("_ZdlPvm");
+YA_EXPORT void ya_delete_array_sized(void *ptr, size_t n_bytes)
+        __asm__("_ZdaPvm");
+YA_EXPORT void ya_delete_aligned_sized(void *ptr, size_t n_bytes,
+        size_t alignment) __asm__("_ZdlPvmSt11align_val_t");
+YA_EXPORT void ya_delete_array_aligned_sized(void *ptr, size_t n_bytes,
+        size_t alignment) __asm__("_ZdaPvmSt11align_val_t");
+
+void ya_delete_sized(void *ptr, size_t n_bytes) {
+    deallocate_timed(ptr, n_bytes);
+}
+
+void ya_delete_array_sized(void *ptr, size_t n_bytes) {
+    deallocate_timed(ptr, n_bytes);
+}
+
+void ya_delete_aligned_sized(void *ptr, size_t n_bytes, size_t alignment) {
+    free_aligned_sized(ptr, alignment, n_bytes);
+}
+
+void ya_delete_array_aligned_sized(void *ptr, size_t n_bytes,
+        size_t alignment) {
+    free_aligned_sized(ptr, alignment, n_bytes);
 }
 
 #ifdef YA_DEBUG
-/* Print all blocks in the heap */
+/* Print all blocks in every arena */
 void ya_print_blocks() {
-    ya_debug("All blocks:\n");
-    block_print_range(heap_start, heap_end);
-    ya_debug("Free blocks:\n");
-    fl_debug_print();
+    for (int i = 0; i < arena_count(); i++) {
+        struct arena *arena = arena_at(i);
+        pthread_mutex_lock(&arena->lock);
+        if (arena->segments) {
+            ya_debug("Arena %d:\n", i);
+            arena_print(arena);
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
 }
 
 /* Checks internal state for errors.
  * Returns -1 on error, 0 otherwise. */
 int ya_check() {
-    int heap_free = heap_check();
-    if (heap_free == -1) {
-        return -1;
-    }
-    int fl_free = fl_check();
-    if (fl_free == -1) {
-        return -1;
-    }
-    if (fl_free != heap_free) {
-        ya_debug("ya_check: heap_check reports %d free blocks, fl_check %d\n",
-                heap_free, fl_free);
-        return -1;
+    for (int i = 0; i < arena_count(); i++) {
+        struct arena *arena = arena_at(i);
+        pthread_mutex_lock(&arena->lock);
+        int heap_free = arena_check(arena);
+        int fl_free = fl_check(&arena->fl);
+        int runs = slab_check(&arena->slab);
+        pthread_mutex_unlock(&arena->lock);
+        if (heap_free == -1 || fl_free == -1 || runs == -1) {
+            return -1;
+        }
+        if (fl_free != heap_free) {
+            ya_debug("ya_check: arena %d: arena_check reports %d free blocks, "
+                    "fl_check %d\n", i, heap_free, fl_free);
+            return -1;
+        }
     }
     return 0;
 }
@@ -8,12 +8,244 @@
 
 #include <stddef.h> // for size_t
 
-void *malloc(size_t size);
+/* The shared library is built with hidden visibility, exporting only the
+ * functions declared here. */
+#define YA_EXPORT __attribute__((visibility("default")))
 
-void free(void *ptr);
+YA_EXPORT void *malloc(size_t size);
 
-void *calloc(size_t nmemb, size_t size);
+YA_EXPORT void free(void *ptr);
 
-void *realloc(void *ptr, size_t size);
+/* Like free, for memory allocated with malloc(size), calloc or realloc with a
+ * total of size bytes, sparing the lookup of the size. */
+YA_EXPORT void free_sized(void *ptr, size_t size);
+
+/* Like free, for memory allocated with aligned_alloc(alignment, size). */
+YA_EXPORT void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+YA_EXPORT void *calloc(size_t nmemb, size_t size);
+
+YA_EXPORT void *realloc(void *ptr, size_t size);
+
+/* Allocates up to count blocks of size bytes each, storing pointers to them
+ * in ptrs, faster than as many calls to malloc. Like malloc(0), a size of 0
+ * gets distinct objects of the smallest size.
+ * Returns the number of blocks allocated, less than count if memory ran
+ * out. */
+YA_EXPORT size_t ya_malloc_batch(size_t size, size_t count, void **ptrs);
+
+/* Frees the count blocks pointed to by ptrs, faster than as many calls to
+ * free. */
+YA_EXPORT void ya_free_batch(void **ptrs, size_t count);
+
+/* Like realloc(ptr, nmemb * size), failing with ENOMEM if the product
+ * overflows. */
+YA_EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size);
+
+/* Allocates size bytes aligned on alignment, a power of two multiple of
+ * sizeof(void *), storing the pointer in *memptr.
+ * Returns 0 on success, EINVAL for an invalid alignment, ENOMEM otherwise. */
+YA_EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/* Allocates size bytes aligned on alignment, a power of two. */
+YA_EXPORT void *aligned_alloc(size_t alignment, size_t size);
+
+/* Allocates size bytes aligned on alignment rounded up to a power of two. */
+YA_EXPORT void *memalign(size_t alignment, size_t size);
+
+/* Allocates size bytes aligned on a page. */
+YA_EXPORT void *valloc(size_t size);
+
+/* Allocates size bytes rounded up to a whole number of pages, aligned on a
+ * page. */
+YA_EXPORT void *pvalloc(size_t size);
+
+/* Returns the number of bytes usable at ptr, at least the size requested,
+ * or 0 if ptr is NULL or was not allocated here. */
+YA_EXPORT size_t malloc_usable_size(void *ptr);
+
+/* A region: memory bump-allocated from chunks of the heap and freed all at
+ * once. */
+struct ya_region;
+
+/* A point in a region's allocations to roll back to. */
+struct ya_region_mark {
+    void *chunk;
+    char *ptr;
+};
+
+/* Creates an empty region taking its chunks from the heap if parent is NULL,
+ * from the region parent otherwise, so that it is freed with it.
+ * Returns the region or NULL in case of failure. */
+YA_EXPORT struct ya_region *ya_region_create(struct ya_region *parent);
+
+/* Allocates size bytes from the region, a size of 0 getting the smallest
+ * allocation as with malloc(0).
+ * Returns a dword-aligned pointer to the memory or NULL in case of failure. */
+YA_EXPORT void *ya_region_alloc(struct ya_region *region, size_t size);
+
+/* Returns a mark of the region's allocations so far. */
+YA_EXPORT struct ya_region_mark ya_region_save(struct ya_region *region);
+
+/* Frees everything allocated from the region since mark was saved. Marks
+ * saved after mark become invalid. A nested region keeps the memory it frees
+ * for its next allocations rather than taking more from its parent. */
+YA_EXPORT void ya_region_restore(struct ya_region *region,
+        struct ya_region_mark mark);
+
+/* Frees everything allocated from the region, which stays usable. */
+YA_EXPORT void ya_region_reset(struct ya_region *region);
+
+/* Frees everything allocated from the region, and the region. A nested
+ * region is also freed when its parent is reset or restored to a mark saved
+ * before its creation, and must not be used after that. */
+YA_EXPORT void ya_region_destroy(struct ya_region *region);
+
+/* Returns free memory to the system, keeping pad bytes at the end of each
+ * heap. Returns 1 if any memory was released, 0 otherwise. */
+YA_EXPORT int malloc_trim(size_t pad);
+
+/* Reports the number of bytes returned to the system so far, and the number
+ * of freed bytes allocated again before they were returned. */
+YA_EXPORT void ya_decay_stats(size_t *purged, size_t *reused);
+
+/* Reports the number of heap requests served from the fast bins of freed
+ * blocks not coalesced yet, and the number of times the fast bins were
+ * consolidated. */
+YA_EXPORT void ya_fast_stats(size_t *hits, size_t *consolidations);
+
+/* Number of size classes of small objects. */
+#define YA_STATS_CLASSES 12
+
+/* Counts of the objects of one size class. */
+struct ya_class_stats {
+    size_t size;    // object size in bytes, 0 for blocks
+    size_t mallocs; // objects allocated so far
+    size_t frees;   // objects freed so far
+};
+
+/* Allocator statistics. Figures in bytes count whole blocks and objects,
+ * including what they hold past the size requested. */
+struct ya_stats {
+    size_t mapped_bytes;     // accessible memory: committed heap segments
+                             // and direct segments
+    size_t heap_bytes;       // memory in the arenas' heaps
+    size_t allocated_bytes;  // memory allocated and not freed
+    size_t free_bytes;       // memory in free heap blocks
+    size_t free_blocks;      // number of free heap blocks
+    size_t fast_bytes;       // memory in freed blocks not coalesced yet
+    size_t releasable_bytes; // memory in free blocks ending heaps
+    size_t direct_bytes;     // memory in direct segments
+    size_t direct_segments;  // number of direct segments
+    size_t maps;             // calls to mmap and mremap
+    size_t unmaps;           // calls to munmap
+    size_t commits;          // calls to mprotect making heap pages accessible
+    size_t splits;           // heap blocks split
+    size_t coalesces;        // free heap blocks coalesced with a neighbor
+    struct ya_class_stats small[YA_STATS_CLASSES]; // small object classes
+    struct ya_class_stats large;                   // blocks
+};
+
+/* Stores the allocator's statistics in stats. Counting is always on and
+ * costs no contention: each thread counts its own allocations, and the
+ * counts are merged here. */
+YA_EXPORT void ya_stats(struct ya_stats *stats);
+
+/* Writes the allocator's statistics as a JSON object into buf, holding size
+ * bytes, truncated if needed but always terminated unless size is 0.
+ * Returns the length of the whole object, like snprintf. */
+YA_EXPORT size_t ya_stats_json(char *buf, size_t size);
+
+/* Defined by <malloc.h>. */
+struct mallinfo2;
+
+/* Returns the allocator's statistics in the format of glibc: arena,
+ * ordblks, fsmblks, uordblks, fordblks and keepcost describe the heaps,
+ * hblks and hblkhd the direct segments, and smblks and usmblks are 0. */
+YA_EXPORT struct mallinfo2 mallinfo2(void);
+
+/* Samples allocations for the heap profile, one every interval bytes
+ * allocated on average, 0 stopping sampling, as the YA_PROF_INTERVAL
+ * environment variable does at startup. Each thread picks the interval up
+ * within a megabyte of allocations. Samples stay in the profile until they
+ * are freed. */
+YA_EXPORT void ya_prof_set_interval(size_t interval);
+
+/* Writes the heap profile of the sampled allocations not freed yet to the
+ * file at path, in the format of gperftools' heap profiler: pprof reads it,
+ * symbolizes it and scales it back up. Setting the YA_PROF_SIGNAL environment
+ * variable to a signal number has that signal write the profile to
+ * <YA_PROF_PREFIX>.<pid>.<n>.heap, "yamalloc" being the default prefix, at
+ * the next sampled allocation.
+ * Returns 0 on success, -1 with errno set otherwise. */
+YA_EXPORT int ya_prof_dump(const char *path);
+
+/* Operations whose latencies builds with YA_INSTRUMENT defined record. */
+enum {
+    YA_LAT_MALLOC,
+    YA_LAT_FREE, // and its sized variants
+    YA_LAT_CALLOC,
+    YA_LAT_REALLOC,
+    YA_LAT_OPS
+};
+
+/* Internal paths, from the fastest: each operation is recorded under the
+ * slowest one it took. */
+enum {
+    YA_LAT_CACHE,    // thread cache hit
+    YA_LAT_SLAB,     // small object taken from or given back to a run
+    YA_LAT_FAST,     // block taken from or given to a fast bin
+    YA_LAT_FIT,      // block taken whole from or put whole into the free list
+    YA_LAT_SPLIT,    // block split off one from the free list
+    YA_LAT_COALESCE, // blocks coalesced into the free list
+    YA_LAT_INPLACE,  // resized in place
+    YA_LAT_COPY,     // moved to a new allocation
+    YA_LAT_EXTEND,   // heap extended
+    YA_LAT_DIRECT,   // direct segment mapped, remapped or unmapped
+    YA_LAT_PATHS
+};
+
+/* Stands for every path in the functions below. */
+#define YA_LAT_ANY_PATH (-1)
+
+/* Number of buckets of latency histograms: 8 per power of two up to 2^40
+ * ticks, after 8 for 0 to 7 ticks. */
+#define YA_LAT_BUCKETS 304
+
+/* Stores in counts, unless it is NULL, the histogram of the durations of op
+ * that took path, or any path if path is YA_LAT_ANY_PATH, over every thread.
+ * Returns the number of operations counted, 0 if built without
+ * YA_INSTRUMENT. */
+YA_EXPORT size_t ya_latency(int op, int path, size_t counts[YA_LAT_BUCKETS]);
+
+/* Returns the shortest duration in nanoseconds counted in bucket, or 0 if
+ * there is no such bucket. */
+YA_EXPORT double ya_latency_bucket_ns(int bucket);
+
+/* Returns the duration in nanoseconds under which lie a fraction q of those
+ * of op that took path, or any path if path is YA_LAT_ANY_PATH, rounded up to
+ * the bound of its bucket, or 0 if none was recorded. */
+YA_EXPORT double ya_latency_quantile(int op, int path, double q);
+
+/* Writes a table of the latencies recorded so far to the file at path, or to
+ * standard error if path is "-": count, mean and quantiles of each operation
+ * by path taken. Builds with YA_INSTRUMENT defined write it at exit to the
+ * file named by the YA_LATENCY_DUMP environment variable, if set.
+ * Returns 0 on success, -1 with errno set otherwise. */
+YA_EXPORT int ya_latency_dump(const char *path);
+
+/* Starts recording every call to malloc, free and its sized variants,
+ * calloc, realloc, the aligned allocation functions and the batch functions
+ * into the trace file at path, which yareplay replays, as the YA_TRACE
+ * environment variable does at startup, its first "%p" standing for the
+ * process ID. Tracing stops at exit, and in the child of a fork.
+ * Returns 0 on success, -1 with errno set otherwise, EBUSY if already
+ * tracing. */
+YA_EXPORT int ya_trace_start(const char *path);
+
+/* Stops recording, writing the records every thread buffered to the trace
+ * file and closing it.
+ * Returns 0 on success, -1 with errno set if writing failed. */
+YA_EXPORT int ya_trace_stop(void);
 
 #endif // def YAMALLOC_H
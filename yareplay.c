@@ -0,0 +1,486 @@
+/*
+ * Yet Another Malloc
+ * yareplay.c
+ * Replays allocation traces recorded with YA_TRACE, see ya_trace.h, against
+ * yamalloc, or the system allocator when built with REPLAY_SYSTEM defined
+ */
+
+/*---------------------*/
+/* Feature test macros */
+/*---------------------*/
+
+#define _DEFAULT_SOURCE // for clock_gettime and getopt
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <fcntl.h>
+#include <malloc.h> // for memalign
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ya_trace.h"
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+#ifdef REPLAY_SYSTEM
+#define REPLAY_ALLOCATOR "system"
+#else
+#define REPLAY_ALLOCATOR "yamalloc"
+#endif
+
+/* no object */
+#define REPLAY_NONE UINT32_MAX
+
+/* stands in the object table for an allocation that failed */
+#define REPLAY_FAILED ((void *) -1)
+
+/* operations between two samples of the resident set size */
+#define REPLAY_RSS_PERIOD 4096
+
+/* bytes allocated at once past which the resident set size is sampled too */
+#define REPLAY_RSS_SIZE (1 << 20)
+
+/*-------*/
+/* Types */
+/*-------*/
+
+/* An operation to replay, its objects numbered in the order of allocation. */
+struct replay_op {
+    uint64_t size;   // bytes requested
+    uint64_t align;  // alignment of TRACE_ALIGNED
+    uint32_t id;     // object allocated, or freed by TRACE_FREE
+    uint32_t old;    // object reallocated, or REPLAY_NONE
+    uint32_t op;     // enum trace_op
+    uint32_t thread; // index of the replaying thread, from 0
+};
+
+/* The operations of a trace, in the order recorded. */
+struct replay {
+    struct replay_op *ops;
+    size_t n_ops;
+    uint32_t n_objects;
+    uint32_t n_threads;
+    size_t peak_live;   // most bytes requested and not freed at once
+    size_t n_skipped;   // records of frees of unknown objects, or invalid
+    _Atomic(void *) *objects;
+};
+
+/* A thread replaying the operations of one recorded thread, or of all. */
+struct replayer {
+    struct replay *replay;
+    struct replay_op *ops;
+    size_t n_ops;
+    pthread_t pthread;
+    size_t peak_rss;
+    size_t n_failed;
+};
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+static atomic_bool replay_go = false;
+
+/*---------*/
+/* Helpers */
+/*---------*/
+
+/* Returns the current monotonic time in nanoseconds. */
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns the resident set size of the process in bytes, without
+ * allocating. */
+static size_t rss_bytes() {
+    char buf[64] = {0};
+    size_t pages = 0;
+    size_t resident = 0;
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, buf, sizeof(buf) - 1) <= 0
+                || sscanf(buf, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        close(fd);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Orders records by time, then by position in the file. */
+static int record_compare(const void *a, const void *b) {
+    const struct trace_record *ra = a;
+    const struct trace_record *rb = b;
+    if (ra->time != rb->time) {
+        return ra->time < rb->time ? -1 : 1;
+    }
+    // position in the file, saved in size by load_records
+    return ra->size < rb->size ? -1 : ra->size > rb->size;
+}
+
+/* Reads the records of the trace file at path into *records, sorted by
+ * time.
+ * Returns their number, or -1 after printing an error. */
+static ssize_t load_records(const char *path, struct trace_record **records) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    struct trace_header header;
+    struct stat st;
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+            || header.record_size != sizeof(struct trace_record)
+            || fstat(fileno(file), &st)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        fclose(file);
+        return -1;
+    }
+    size_t n = (st.st_size - sizeof(header)) / sizeof(struct trace_record);
+    *records = malloc(n * sizeof(struct trace_record) + 1);
+    if (!*records
+            || fread(*records, sizeof(struct trace_record), n, file) != n) {
+        fprintf(stderr, "%s: cannot read %zu records\n", path, n);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    // sorted by time, each thread's records staying in order, but with the
+    // sizes set aside
+    uint64_t *sizes = malloc(n * sizeof(uint64_t) + 1);
+    if (!sizes) {
+        fprintf(stderr, "%s: cannot sort %zu records\n", path, n);
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        sizes[i] = (*records)[i].size;
+        (*records)[i].size = i;
+    }
+    qsort(*records, n, sizeof(struct trace_record), record_compare);
+    for (size_t i = 0; i < n; i++) {
+        (*records)[i].size = sizes[(*records)[i].size];
+    }
+    free(sizes);
+    return n;
+}
+
+/* Hash table of the live objects by pointer, with open addressing and
+ * linear probing. Deleted entries keep their slot, which n_slots being more
+ * than the number of insertions leaves enough of. */
+struct object_table {
+    uint64_t *ptrs; // 0 for an empty slot
+    uint32_t *ids;  // REPLAY_NONE for a deleted entry
+    size_t mask;
+};
+
+/* Returns the slot of ptr in the table, or the empty one it would go to. */
+static size_t table_slot(struct object_table *table, uint64_t ptr) {
+    size_t slot = (ptr * 0x9e3779b97f4a7c15ULL >> 20) & table->mask;
+    while (table->ptrs[slot] && table->ptrs[slot] != ptr) {
+        slot = (slot + 1) & table->mask;
+    }
+    return slot;
+}
+
+/* Removes ptr from the table.
+ * Returns its object, or REPLAY_NONE if it is not live. */
+static uint32_t table_remove(struct object_table *table, uint64_t ptr) {
+    size_t slot = table_slot(table, ptr);
+    uint32_t id = table->ptrs[slot] ? table->ids[slot] : REPLAY_NONE;
+    if (table->ptrs[slot]) {
+        table->ids[slot] = REPLAY_NONE;
+    }
+    return id;
+}
+
+/* Turns the n sorted records into the operations of replay, numbering the
+ * objects and the threads.
+ * Returns 0 on success, -1 if out of memory. */
+static int prepare(struct replay *replay, struct trace_record *records,
+        size_t n) {
+    size_t n_slots = 1;
+    while (n_slots <= 2 * n) {
+        n_slots <<= 1;
+    }
+    uint32_t max_thread = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (records[i].thread > max_thread && records[i].thread < n) {
+            max_thread = records[i].thread;
+        }
+    }
+    struct object_table table = {
+        .ptrs = calloc(n_slots, sizeof(uint64_t)),
+        .ids = malloc(n_slots * sizeof(uint32_t)),
+        .mask = n_slots - 1,
+    };
+    uint32_t *threads = malloc((max_thread + 1) * sizeof(uint32_t));
+    uint64_t *sizes = malloc(n * sizeof(uint64_t) + 1);
+    replay->ops = malloc(n * sizeof(struct replay_op) + 1);
+    if (!table.ptrs || !table.ids || !threads || !sizes || !replay->ops) {
+        return -1;
+    }
+    memset(threads, 0xff, (max_thread + 1) * sizeof(uint32_t));
+    size_t live = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct trace_record *record = &records[i];
+        if (record->op >= TRACE_OPS || record->thread > max_thread) {
+            replay->n_skipped++;
+            continue;
+        }
+        struct replay_op op = {
+            .size = record->size,
+            .id = REPLAY_NONE,
+            .old = REPLAY_NONE,
+            .op = record->op,
+        };
+        if (record->op == TRACE_FREE) {
+            op.id = table_remove(&table, record->ptr);
+            if (op.id == REPLAY_NONE) {
+                replay->n_skipped++; // allocated before tracing started
+                continue;
+            }
+            live -= sizes[op.id];
+        } else if (record->op == TRACE_REALLOC && record->arg) {
+            op.old = table_remove(&table, record->arg);
+            if (op.old == REPLAY_NONE) {
+                replay->n_skipped++; // replayed as a malloc
+            } else {
+                live -= sizes[op.old];
+            }
+        }
+        if (record->op != TRACE_FREE && record->ptr) {
+            // a pointer still live was freed by another thread too close
+            // to its allocation for their times to order them: its object
+            // stays allocated
+            size_t slot = table_slot(&table, record->ptr);
+            table.ptrs[slot] = record->ptr;
+            table.ids[slot] = replay->n_objects;
+            op.id = replay->n_objects++;
+            sizes[op.id] = record->size;
+            live += record->size;
+        }
+        if (record->op == TRACE_ALIGNED) {
+            op.align = record->arg;
+        }
+        if (threads[record->thread] == REPLAY_NONE) {
+            threads[record->thread] = replay->n_threads++;
+        }
+        op.thread = threads[record->thread];
+        replay->ops[replay->n_ops++] = op;
+        if (live > replay->peak_live) {
+            replay->peak_live = live;
+        }
+    }
+    free(table.ptrs);
+    free(table.ids);
+    free(threads);
+    free(sizes);
+    size_t n_bytes = (replay->n_objects + 1) * sizeof(void *);
+    replay->objects = calloc(1, n_bytes);
+    if (!replay->objects) {
+        return -1;
+    }
+    // faulted in now, calloc having maybe left it to the kernel, for its
+    // pages to count in the resident set before the replay
+    for (size_t i = 0; i < n_bytes; i += 4096) {
+        ((volatile char *) replay->objects)[i] = 0;
+    }
+    return 0;
+}
+
+/* Sorts the operations of replay by thread, each thread's staying in order,
+ * for the replayers, one per thread, to take theirs.
+ * Returns 0 on success, -1 if out of memory. */
+static int split(struct replay *replay, struct replayer *replayers) {
+    struct replay_op *ops = malloc(replay->n_ops * sizeof(struct replay_op)
+            + 1);
+    if (!ops) {
+        return -1;
+    }
+    for (size_t i = 0; i < replay->n_ops; i++) {
+        replayers[replay->ops[i].thread].n_ops++;
+    }
+    size_t offset = 0;
+    for (uint32_t thread = 0; thread < replay->n_threads; thread++) {
+        replayers[thread].ops = ops + offset;
+        offset += replayers[thread].n_ops;
+        replayers[thread].n_ops = 0;
+    }
+    for (size_t i = 0; i < replay->n_ops; i++) {
+        struct replayer *replayer = &replayers[replay->ops[i].thread];
+        replayer->ops[replayer->n_ops++] = replay->ops[i];
+    }
+    free(replay->ops);
+    replay->ops = ops;
+    return 0;
+}
+
+/* Returns the pointer to the object id, waiting for another thread to
+ * allocate it if needed, or NULL if there is none. */
+static void *object_get(struct replay *replay, uint32_t id) {
+    if (id == REPLAY_NONE) {
+        return NULL;
+    }
+    void *ptr;
+    while (!(ptr = atomic_load_explicit(&replay->objects[id],
+                    memory_order_acquire))) {
+        sched_yield();
+    }
+    return ptr != REPLAY_FAILED ? ptr : NULL;
+}
+
+/* Writes a byte to every page of the n_bytes bytes at ptr, as a program
+ * using them would. */
+static void touch(char *ptr, size_t n_bytes) {
+    for (size_t i = 0; i < n_bytes; i += 4096) {
+        ptr[i] = 1;
+    }
+}
+
+/* Replays the operations of the replayer in order. */
+static void *replay_run(void *arg) {
+    struct replayer *replayer = arg;
+    struct replay *replay = replayer->replay;
+    while (!atomic_load_explicit(&replay_go, memory_order_acquire)) {
+        sched_yield();
+    }
+    for (size_t i = 0; i < replayer->n_ops; i++) {
+        struct replay_op *op = &replayer->ops[i];
+        void *ptr = NULL;
+        switch (op->op) {
+        case TRACE_MALLOC:
+            ptr = malloc(op->size);
+            break;
+        case TRACE_FREE:
+            free(object_get(replay, op->id));
+            continue;
+        case TRACE_CALLOC:
+            ptr = calloc(1, op->size);
+            break;
+        case TRACE_REALLOC:
+            ptr = realloc(object_get(replay, op->old), op->size);
+            break;
+        case TRACE_ALIGNED:
+            ptr = memalign(op->align, op->size);
+            break;
+        }
+        if (op->id != REPLAY_NONE) {
+            if (ptr) {
+                touch(ptr, op->size);
+            } else if (op->size) {
+                replayer->n_failed++;
+            }
+            atomic_store_explicit(&replay->objects[op->id],
+                    ptr ? ptr : REPLAY_FAILED, memory_order_release);
+        }
+        if ((i + 1) % REPLAY_RSS_PERIOD == 0
+                || op->size >= REPLAY_RSS_SIZE) {
+            size_t rss = rss_bytes();
+            if (rss > replayer->peak_rss) {
+                replayer->peak_rss = rss;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*------*/
+/* Main */
+/*------*/
+
+int main(int argc, char **argv) {
+    bool threaded = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        if (opt == 't') {
+            threaded = true;
+        } else {
+            optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-t] trace\n"
+                "Replays the trace in one thread, or with -t each thread "
+                "recorded in a thread.\n", argv[0]);
+        return 2;
+    }
+    struct trace_record *records;
+    ssize_t n = load_records(argv[optind], &records);
+    struct replay replay = {0};
+    if (n < 0) {
+        return 1;
+    }
+    if (prepare(&replay, records, n)) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    free(records);
+
+    int n_replayers = threaded ? replay.n_threads : 1;
+    struct replayer *replayers = calloc(n_replayers + 1,
+            sizeof(struct replayer));
+    if (!replayers || (threaded && split(&replay, replayers))) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    if (!threaded) {
+        replayers[0].ops = replay.ops;
+        replayers[0].n_ops = replay.n_ops;
+    }
+    size_t rss_base = rss_bytes();
+    for (int i = 0; i < n_replayers; i++) {
+        replayers[i].replay = &replay;
+        replayers[i].peak_rss = rss_base;
+        if (threaded) {
+            pthread_create(&replayers[i].pthread, NULL, replay_run,
+                    &replayers[i]);
+        }
+    }
+    double start = now_ns();
+    atomic_store_explicit(&replay_go, true, memory_order_release);
+    if (!threaded) {
+        replay_run(&replayers[0]);
+    }
+    for (int i = 0; threaded && i < n_replayers; i++) {
+        pthread_join(replayers[i].pthread, NULL);
+    }
+    double elapsed = now_ns() - start;
+
+    size_t peak_rss = rss_bytes();
+    size_t n_failed = 0;
+    for (int i = 0; i < n_replayers; i++) {
+        if (replayers[i].peak_rss > peak_rss) {
+            peak_rss = replayers[i].peak_rss;
+        }
+        n_failed += replayers[i].n_failed;
+    }
+    size_t heap = peak_rss > rss_base ? peak_rss - rss_base : 0;
+    printf("replay (%s, %s): %zu ops by %u recorded threads, "
+            "%6.2f Mops/s, peak rss %7zu KB, peak live %7zu KB, "
+            "rss / peak live %.3f\n", REPLAY_ALLOCATOR,
+            threaded ? "threaded" : "one thread", replay.n_ops,
+            replay.n_threads,
+            replay.n_ops / elapsed * 1e3, heap >> 10, replay.peak_live >> 10,
+            replay.peak_live ? (double) heap / replay.peak_live : 0.0);
+    if (replay.n_skipped || n_failed) {
+        printf("  %zu invalid records or frees of unknown objects, "
+                "%zu allocations failed\n", replay.n_skipped, n_failed);
+    }
+    return 0;
+}
@@ -0,0 +1,576 @@
+/*
+ * Yet Another Malloc
+ * yasuite.c
+ * Standard allocator benchmarks, using only the standard interface so as to
+ * compare yamalloc with the system allocator, which they run against when
+ * built with SUITE_SYSTEM defined
+ */
+
+/*---------------------*/
+/* Feature test macros */
+/*---------------------*/
+
+#define _DEFAULT_SOURCE // for clock_gettime and MAP_ANONYMOUS
+
+/*----------*/
+/* Includes */
+/*----------*/
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h> // for getrusage
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __x86_64__
+#include <x86intrin.h> // for __rdtsc
+#endif
+
+/*-----------*/
+/* Constants */
+/*-----------*/
+
+#ifdef SUITE_SYSTEM
+#define SUITE_ALLOCATOR "system"
+#else
+#define SUITE_ALLOCATOR "yamalloc"
+#endif
+
+/* one operation in SAMPLE_EVERY is timed on its own for the latencies,
+ * unless the benchmark has few */
+#define SAMPLE_EVERY 16
+
+/* most threads of a benchmark */
+#define MAX_THREADS 64
+
+/*-------*/
+/* Types */
+/*-------*/
+
+/* Durations in ticks of a thread's timed operations, in memory of their own
+ * so as not to count in the allocator's. */
+struct samples {
+    uint32_t *ticks;
+    size_t count;
+    size_t capacity;
+    size_t every; // operations per sample
+};
+
+/* A benchmark run: its samples by thread, and the start of its clocks. */
+struct run {
+    struct samples samples[MAX_THREADS];
+    int n_threads;
+    size_t rss_base;
+    double start_ns;
+    uint64_t start_ticks;
+};
+
+/*---------*/
+/* Globals */
+/*---------*/
+
+/* ticks between two back-to-back reads of the cycle counter, taken off the
+ * durations */
+static uint64_t tick_overhead = 0;
+
+/*---------*/
+/* Helpers */
+/*---------*/
+
+/* Returns the current monotonic time in nanoseconds. */
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns the cycle counter: the time stamp counter on x86-64, the
+ * monotonic clock in nanoseconds elsewhere. */
+static inline uint64_t ticks() {
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+/* Measures tick_overhead, the least of many tries. */
+static void ticks_calibrate() {
+    tick_overhead = UINT64_MAX;
+    for (int i = 0; i < 100000; i++) {
+        uint64_t start = ticks();
+        uint64_t duration = ticks() - start;
+        if (duration < tick_overhead) {
+            tick_overhead = duration;
+        }
+    }
+}
+
+/* Returns the resident set size of the process in bytes, without
+ * allocating. */
+static size_t rss_bytes() {
+    char buf[64] = {0};
+    size_t pages = 0;
+    size_t resident = 0;
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, buf, sizeof(buf) - 1) <= 0
+                || sscanf(buf, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        close(fd);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Returns the largest resident set size of the process so far in bytes. */
+static size_t peak_rss_bytes() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss * 1024;
+}
+
+/* Returns the next number of the xorshift64 sequence in *state. */
+static inline uint64_t rand_next(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* Returns a random size in [min, max]. */
+static inline size_t rand_size(uint64_t *state, size_t min, size_t max) {
+    return min + rand_next(state) % (max - min + 1);
+}
+
+/* Returns a random size in [min, max), each power of two as likely. */
+static inline size_t rand_size_log(uint64_t *state, size_t min, size_t max) {
+    uint64_t r = rand_next(state);
+    int n_powers = 63 - __builtin_clzll(max / min);
+    size_t low = min << (r % n_powers);
+    return low + (r >> 32) % low;
+}
+
+/* Maps n_bytes bytes outside of the allocator, faulted in.
+ * Exits on failure. */
+static void *map(size_t n_bytes) {
+    char *ptr = mmap(NULL, n_bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    for (size_t i = 0; i < n_bytes; i += 4096) {
+        ptr[i] = 0;
+    }
+    return ptr;
+}
+
+/* Starts a run of n_threads threads of n_ops operations each, one in every
+ * timed, after mapping their samples. */
+static void run_start(struct run *run, int n_threads, size_t n_ops,
+        size_t every) {
+    run->n_threads = n_threads;
+    for (int i = 0; i < n_threads; i++) {
+        struct samples *samples = &run->samples[i];
+        samples->capacity = n_ops / every + 1;
+        samples->ticks = map(samples->capacity * sizeof(uint32_t));
+        samples->count = 0;
+        samples->every = every;
+    }
+    run->rss_base = rss_bytes();
+    run->start_ns = now_ns();
+    run->start_ticks = ticks();
+}
+
+/* Returns the start of the i-th operation if it is to be timed, 0
+ * otherwise. */
+static inline uint64_t sample_start(struct samples *samples, size_t i) {
+    return i % samples->every ? 0 : ticks();
+}
+
+/* Records the duration of the operation started at start, if timed. */
+static inline void sample_end(struct samples *samples, uint64_t start) {
+    if (start && samples->count < samples->capacity) {
+        uint64_t duration = ticks() - start;
+        duration = duration > tick_overhead ? duration - tick_overhead : 0;
+        samples->ticks[samples->count++] =
+                duration < UINT32_MAX ? duration : UINT32_MAX;
+    }
+}
+
+/* Returns the bytes handled per nanosecond, that is GB/s, by the timed
+ * operations of the run, each handling n_bytes bytes. */
+static double run_bandwidth(struct run *run, size_t n_bytes) {
+    double ns_per_tick = (now_ns() - run->start_ns)
+            / (ticks() - run->start_ticks);
+    uint64_t total = 0;
+    size_t count = 0;
+    for (int i = 0; i < run->n_threads; i++) {
+        for (size_t j = 0; j < run->samples[i].count; j++) {
+            total += run->samples[i].ticks[j];
+        }
+        count += run->samples[i].count;
+    }
+    return total ? count * n_bytes / (total * ns_per_tick) : 0;
+}
+
+static int ticks_compare(const void *a, const void *b) {
+    uint32_t ta = *(const uint32_t *) a;
+    uint32_t tb = *(const uint32_t *) b;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* Ends the run of n_ops operations named name, and prints their throughput,
+ * the median and 99th percentile of their latencies, and the growth of the
+ * resident set at its peak, with extra appended. */
+static void run_end(struct run *run, const char *name, size_t n_ops,
+        const char *extra) {
+    double elapsed = now_ns() - run->start_ns;
+    double ns_per_tick = elapsed / (ticks() - run->start_ticks);
+    size_t peak = peak_rss_bytes();
+    size_t count = 0;
+    for (int i = 0; i < run->n_threads; i++) {
+        count += run->samples[i].count;
+    }
+    uint32_t *all = map(count * sizeof(uint32_t) + 1);
+    count = 0;
+    for (int i = 0; i < run->n_threads; i++) {
+        memcpy(all + count, run->samples[i].ticks,
+                run->samples[i].count * sizeof(uint32_t));
+        count += run->samples[i].count;
+    }
+    qsort(all, count, sizeof(uint32_t), ticks_compare);
+    double p50 = count ? all[count / 2] * ns_per_tick : 0;
+    double p99 = count ? all[count * 99 / 100] * ns_per_tick : 0;
+    printf("%-20s %-8s %10.0f ops/s, p50 %7.0f ns, p99 %9.0f ns, "
+            "peak rss %7zu KB%s\n", name, SUITE_ALLOCATOR,
+            n_ops / elapsed * 1e9, p50, p99,
+            (peak > run->rss_base ? peak - run->rss_base : 0) >> 10, extra);
+    fflush(stdout);
+}
+
+/*------------*/
+/* Benchmarks */
+/*------------*/
+
+/* Allocates and frees blocks of n_bytes bytes over and over. */
+static void bench_pingpong(int n_bytes) {
+    const size_t n_ops = 4000000;
+    struct run run;
+    run_start(&run, 1, n_ops, SAMPLE_EVERY);
+    for (size_t i = 0; i < n_ops; i++) {
+        uint64_t start = sample_start(&run.samples[0], i);
+        char *volatile block = malloc(n_bytes);
+        block[0] = 1;
+        free(block);
+        sample_end(&run.samples[0], start);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "pingpong %d", n_bytes);
+    run_end(&run, name, n_ops, "");
+}
+
+/* Replaces random blocks among n_slots long-lived ones with blocks from 16
+ * bytes to 16 KB, each power of two as likely. */
+static void bench_churn(int n_slots) {
+    const size_t n_ops = 4000000;
+    uint64_t state = 88172645463325252ULL;
+    char **slots = map(n_slots * sizeof(char *));
+    struct run run;
+    run_start(&run, 1, n_ops, SAMPLE_EVERY);
+    for (size_t i = 0; i < n_ops; i++) {
+        size_t slot = rand_next(&state) % n_slots;
+        size_t n_bytes = rand_size_log(&state, 16, 16384);
+        uint64_t start = sample_start(&run.samples[0], i);
+        free(slots[slot]);
+        slots[slot] = malloc(n_bytes);
+        sample_end(&run.samples[0], start);
+        slots[slot][0] = 1;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "churn %d", n_slots);
+    run_end(&run, name, n_ops, "");
+}
+
+/* Queue of blocks from a producer thread to a consumer thread. */
+struct prodcons {
+    _Atomic(char *) ring[1024];
+    atomic_size_t head; // blocks produced
+    atomic_size_t tail; // blocks consumed
+    size_t n_ops;
+    uint64_t seed;
+    struct samples *produced;
+    struct samples *consumed;
+};
+
+static void *prodcons_producer(void *arg) {
+    struct prodcons *queue = arg;
+    uint64_t state = queue->seed;
+    for (size_t i = 0; i < queue->n_ops; i++) {
+        size_t n_bytes = rand_size(&state, 16, 1024);
+        while (i - atomic_load_explicit(&queue->tail, memory_order_acquire)
+                == 1024) {
+            sched_yield();
+        }
+        uint64_t start = sample_start(queue->produced, i);
+        char *block = malloc(n_bytes);
+        sample_end(queue->produced, start);
+        block[0] = 1;
+        atomic_store_explicit(&queue->ring[i % 1024], block,
+                memory_order_relaxed);
+        atomic_store_explicit(&queue->head, i + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void *prodcons_consumer(void *arg) {
+    struct prodcons *queue = arg;
+    for (size_t i = 0; i < queue->n_ops; i++) {
+        while (atomic_load_explicit(&queue->head, memory_order_acquire) == i) {
+            sched_yield();
+        }
+        char *block = atomic_load_explicit(&queue->ring[i % 1024],
+                memory_order_relaxed);
+        atomic_store_explicit(&queue->tail, i + 1, memory_order_release);
+        uint64_t start = sample_start(queue->consumed, i);
+        free(block);
+        sample_end(queue->consumed, start);
+    }
+    return NULL;
+}
+
+/* Has n_pairs producer threads allocate blocks of random sizes that as many
+ * consumer threads free, as in larson's server simulation, so that every
+ * block is freed by another thread than the one that allocated it. */
+static void bench_prodcons(int n_pairs) {
+    const size_t n_ops = 1000000;
+    if (n_pairs < 1 || n_pairs > MAX_THREADS / 2) {
+        n_pairs = n_pairs < 1 ? 1 : MAX_THREADS / 2;
+    }
+    struct prodcons *queues = map(n_pairs * sizeof(struct prodcons));
+    pthread_t threads[MAX_THREADS];
+    struct run run;
+    run_start(&run, 2 * n_pairs, n_ops, SAMPLE_EVERY);
+    for (int i = 0; i < n_pairs; i++) {
+        queues[i].n_ops = n_ops;
+        queues[i].seed = (i + 1) * 0x9e3779b97f4a7c15ULL;
+        queues[i].produced = &run.samples[2 * i];
+        queues[i].consumed = &run.samples[2 * i + 1];
+        pthread_create(&threads[2 * i], NULL, prodcons_producer, &queues[i]);
+        pthread_create(&threads[2 * i + 1], NULL, prodcons_consumer,
+                &queues[i]);
+    }
+    for (int i = 0; i < 2 * n_pairs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "prodcons %d", n_pairs);
+    run_end(&run, name, 2 * n_ops * n_pairs, "");
+}
+
+/* Grows n_buffers buffers in turn by 64 bytes at a time up to 64 KB, as
+ * strings being appended to, then single buffers by doubling from 16 bytes
+ * to 64 MB, as vectors, writing to each new page. */
+static void bench_realloc(int n_buffers) {
+    const size_t max_append = 64 << 10;
+    const size_t max_double = 64 << 20;
+    const size_t n_vectors = 20;
+    char **buffers = map(n_buffers * sizeof(char *));
+    struct run run;
+    size_t n_ops = n_buffers * (max_append / 64);
+    run_start(&run, 1, n_ops, SAMPLE_EVERY);
+    size_t i = 0;
+    for (size_t size = 64; size <= max_append; size += 64) {
+        for (int j = 0; j < n_buffers; j++) {
+            uint64_t start = sample_start(&run.samples[0], i++);
+            buffers[j] = realloc(buffers[j], size);
+            sample_end(&run.samples[0], start);
+            buffers[j][size - 1] = 1;
+        }
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "realloc append %d", n_buffers);
+    run_end(&run, name, n_ops, "");
+    for (int j = 0; j < n_buffers; j++) {
+        free(buffers[j]);
+    }
+
+    // each operation timed, there being few
+    n_ops = n_vectors * (__builtin_ctzll(max_double / 16) + 1);
+    run_start(&run, 1, n_ops, 1);
+    i = 0;
+    for (size_t j = 0; j < n_vectors; j++) {
+        char *vector = NULL;
+        for (size_t size = 16; size <= max_double; size *= 2) {
+            uint64_t start = sample_start(&run.samples[0], i++);
+            vector = realloc(vector, size);
+            sample_end(&run.samples[0], start);
+            for (size_t k = size / 2; k < size; k += 4096) {
+                vector[k] = 1;
+            }
+        }
+        free(vector);
+    }
+    run_end(&run, "realloc double", n_ops, "");
+}
+
+/* Clears blocks of n_bytes bytes with calloc over memory dirtied before,
+ * then grows blocks of n_bytes bytes written to to twice that with realloc
+ * past a block allocated after them, which moves them. Freeing larger blocks
+ * first raises adaptive mmap thresholds, for the blocks to come from the heap
+ * rather than fresh mappings, which calloc need not clear and realloc may
+ * move without copying. Reports the bytes cleared or copied per second by
+ * the calls alone, counting only the reallocs that moved. */
+static void bench_bandwidth(int n_bytes) {
+    const size_t n_ops = ((size_t) 1 << 30) / n_bytes + 16;
+    free(malloc(n_bytes + 65536));
+    free(malloc(2 * n_bytes));
+    free(memset(malloc(n_bytes), 1, n_bytes));
+    // each operation timed, they being long
+    struct run run;
+    run_start(&run, 1, n_ops, 1);
+    for (size_t i = 0; i < n_ops; i++) {
+        uint64_t start = sample_start(&run.samples[0], i);
+        char *volatile block = calloc(1, n_bytes);
+        sample_end(&run.samples[0], start);
+        block[n_bytes - 1] = 1;
+        free(block);
+    }
+    char extra[48];
+    snprintf(extra, sizeof(extra), ", %5.1f GB/s",
+            run_bandwidth(&run, n_bytes));
+    char name[32];
+    snprintf(name, sizeof(name), "calloc %d", n_bytes);
+    run_end(&run, name, n_ops, extra);
+
+    size_t moves = 0;
+    run_start(&run, 1, n_ops, 1);
+    for (size_t i = 0; i < n_ops; i++) {
+        char *block = memset(malloc(n_bytes), 1, n_bytes);
+        char *volatile pin = malloc(4096); // past caches of small objects
+        uint64_t start = ticks();
+        char *moved = realloc(block, 2 * n_bytes);
+        if (moved != block) {
+            sample_end(&run.samples[0], start);
+            moves++;
+        }
+        free(pin);
+        free(moved);
+    }
+    snprintf(extra, sizeof(extra), ", %5.1f GB/s, %zu of %zu moved",
+            run_bandwidth(&run, n_bytes), moves, n_ops);
+    snprintf(name, sizeof(name), "realloc move %d", n_bytes);
+    run_end(&run, name, n_ops, extra);
+}
+
+/* Allocates n_rounds rounds of 50000 blocks, each round's larger than the
+ * last's, freeing every other one, which leaves holes too small for the next
+ * rounds, then frees all. Reports the peak number of bytes live, and the
+ * resident set left after freeing all. */
+static void bench_fragmentation(int n_rounds) {
+    const size_t n_blocks = 50000;
+    uint64_t state = 88172645463325252ULL;
+    char **blocks = map(n_rounds * n_blocks * sizeof(char *));
+    size_t *sizes = map(n_rounds * n_blocks * sizeof(size_t));
+    struct run run;
+    size_t n_ops = 2 * n_rounds * n_blocks;
+    run_start(&run, 1, n_ops, SAMPLE_EVERY);
+    size_t i = 0;
+    size_t live = 0;
+    size_t peak_live = 0;
+    for (int round = 0; round < n_rounds; round++) {
+        size_t first = round * n_blocks;
+        size_t n_bytes = 32 * (round + 1);
+        for (size_t j = first; j < first + n_blocks; j++) {
+            sizes[j] = rand_size(&state, n_bytes - 16, n_bytes + 16);
+            uint64_t start = sample_start(&run.samples[0], i++);
+            blocks[j] = malloc(sizes[j]);
+            sample_end(&run.samples[0], start);
+            blocks[j][0] = 1;
+            live += sizes[j];
+        }
+        peak_live = live > peak_live ? live : peak_live;
+        for (size_t j = first; j < first + n_blocks; j += 2) {
+            uint64_t start = sample_start(&run.samples[0], i++);
+            free(blocks[j]);
+            sample_end(&run.samples[0], start);
+            blocks[j] = NULL;
+            live -= sizes[j];
+        }
+    }
+    for (size_t j = 0; j < n_rounds * n_blocks; j++) {
+        if (blocks[j]) {
+            uint64_t start = sample_start(&run.samples[0], i++);
+            free(blocks[j]);
+            sample_end(&run.samples[0], start);
+        }
+    }
+    size_t left = rss_bytes();
+    char extra[96];
+    snprintf(extra, sizeof(extra), ", peak live %7zu KB, left %7zu KB",
+            peak_live >> 10,
+            (left > run.rss_base ? left - run.rss_base : 0) >> 10);
+    char name[32];
+    snprintf(name, sizeof(name), "fragmentation %d", n_rounds);
+    run_end(&run, name, n_ops, extra);
+}
+
+/*------*/
+/* Main */
+/*------*/
+
+/* Runs bench(arg) in a child process, for the peak resident set to be the
+ * benchmark's alone. */
+static void run_child(void (*bench)(int), int arg) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        bench(arg);
+        exit(0);
+    }
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/* Runs the benchmark named on the command line, or all of them, with the
+ * parameter given after it if any: the number of producer/consumer pairs,
+ * for instance. */
+int main(int argc, char **argv) {
+    const char *name = argc > 1 ? argv[1] : NULL;
+    int arg = argc > 2 ? atoi(argv[2]) : 0;
+    ticks_calibrate();
+    if (!name || !strcmp(name, "pingpong")) {
+        for (int n_bytes = 16; n_bytes <= 16384; n_bytes *= 4) {
+            run_child(bench_pingpong, arg ? arg : n_bytes);
+        }
+    }
+    if (!name || !strcmp(name, "churn")) {
+        run_child(bench_churn, arg ? arg : 10000);
+    }
+    if (!name || !strcmp(name, "prodcons")) {
+        run_child(bench_prodcons, arg ? arg : 2);
+    }
+    if (!name || !strcmp(name, "realloc")) {
+        run_child(bench_realloc, arg ? arg : 1000);
+    }
+    if (!name || !strcmp(name, "bandwidth")) {
+        for (int n_bytes = 4096; n_bytes <= (16 << 20); n_bytes *= 16) {
+            run_child(bench_bandwidth, arg ? arg : n_bytes);
+        }
+    }
+    if (!name || !strcmp(name, "fragmentation")) {
+        run_child(bench_fragmentation, arg ? arg : 12);
+    }
+    return 0;
+}
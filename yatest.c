@@ -4,10 +4,25 @@
  * Author: Titouan Rigoudy
 */
 
+#define _DEFAULT_SOURCE // for usleep
+
+#include <errno.h>
+#include <malloc.h> // for struct mallinfo2
+#include <pthread.h>
+#include <signal.h> // for SIGABRT
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h> // for mkstemp
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "yamalloc.h"
+#include "ya_arena.h"
 #include "ya_debug.h"
+#include "ya_region.h"
+#include "ya_trace.h"
 
 void *print_malloc(size_t size) {
     void *ptr = malloc(size);
@@ -26,6 +41,973 @@ void *print_realloc(void *ptr, size_t size) {
     return new_ptr;
 }
 
+#define NUM_THREADS 4
+#define NUM_SLOTS 64
+#define NUM_OPS 2000
+
+/* blocks each thread leaves behind for the next one to free */
+unsigned char *thread_leftovers[NUM_THREADS][NUM_SLOTS];
+
+/* Allocates and frees blocks of various sizes, checking that their contents
+ * are not clobbered by other threads, then frees the previous thread's
+ * leftovers. Returns NULL on success. */
+void *thread_main(void *arg) {
+    intptr_t id = (intptr_t) arg;
+    unsigned char **slots = thread_leftovers[id];
+    size_t sizes[NUM_SLOTS] = {0};
+    unsigned int seed = id + 1;
+    for (int i = 0; i < NUM_OPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 8) % NUM_SLOTS;
+        for (size_t j = 0; j < sizes[slot]; j++) {
+            if (slots[slot][j] != (unsigned char) slot) {
+                fprintf(stderr, "thread %ld: block %p clobbered\n",
+                        id, slots[slot]);
+                return (void *) -1;
+            }
+        }
+        free(slots[slot]);
+        sizes[slot] = (seed >> 16) % (i % 8 ? 200 : 5000) + 1;
+        slots[slot] = malloc(sizes[slot]);
+        memset(slots[slot], slot, sizes[slot]);
+    }
+    return NULL;
+}
+
+/* Runs NUM_THREADS threads allocating concurrently.
+ * Returns -1 on error, 0 otherwise. */
+int test_threads() {
+    pthread_t threads[NUM_THREADS];
+    for (intptr_t id = 0; id < NUM_THREADS; id++) {
+        pthread_create(&threads[id], NULL, thread_main, (void *) id);
+    }
+    int ret = 0;
+    for (int id = 0; id < NUM_THREADS; id++) {
+        void *thread_ret;
+        pthread_join(threads[id], &thread_ret);
+        if (thread_ret) {
+            ret = -1;
+        }
+    }
+    // free every thread's blocks from the main thread
+    for (int id = 0; id < NUM_THREADS; id++) {
+        for (int slot = 0; slot < NUM_SLOTS; slot++) {
+            free(thread_leftovers[id][slot]);
+        }
+    }
+    if (ya_check()) {
+        return -1;
+    }
+    return ret;
+}
+
+/* Grows and shrinks a direct block, checking its contents survive, then
+ * checks that freeing it raised the adaptive direct threshold.
+ * Returns -1 on error, 0 otherwise. */
+int test_direct() {
+    size_t threshold = direct_threshold();
+    size_t size = 2 * threshold;
+    unsigned char *a = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        a[i] = i % 251;
+    }
+    size_t sizes[] = {4 * size, 64 * size, size / 2 + 1, 3 * size};
+    size_t kept = size;
+    for (int i = 0; i < 4; i++) {
+        a = print_realloc(a, sizes[i]);
+        kept = sizes[i] < kept ? sizes[i] : kept;
+        for (size_t j = 0; j < kept; j++) {
+            if (a[j] != j % 251) {
+                fprintf(stderr, "direct block %p clobbered at %zu\n", a, j);
+                return -1;
+            }
+        }
+    }
+    print_free(a);
+    a = print_malloc(size);
+    print_free(a);
+    if (direct_threshold() < size) {
+        fprintf(stderr, "direct threshold %zu below %zu\n",
+                direct_threshold(), size);
+        return -1;
+    }
+    return 0;
+}
+
+#define SLAB_OBJECTS 20000
+
+/* Allocates small objects of random sizes, checking that they come from runs,
+ * are aligned on their class and do not overlap, resizes some within and
+ * across size classes, then frees them in random order.
+ * Returns -1 on error, 0 otherwise. */
+int test_slab() {
+    static unsigned char *objects[SLAB_OBJECTS];
+    static size_t sizes[SLAB_OBJECTS];
+    unsigned int seed = 42;
+    for (int i = 0; i < SLAB_OBJECTS; i++) {
+        seed = seed * 1103515245 + 12345;
+        sizes[i] = (seed >> 8) % SLAB_MAX_SIZE + 1;
+        objects[i] = malloc(sizes[i]);
+        int cls = entry_class(pagemap_get(objects[i]));
+        if (cls < 0 || (uintptr_t) objects[i] % slab_align(cls)) {
+            fprintf(stderr, "object %p of %zu bytes not in a run\n",
+                    objects[i], sizes[i]);
+            return -1;
+        }
+        memset(objects[i], i % 251, sizes[i]);
+    }
+    for (int i = 0; i < SLAB_OBJECTS; i += 3) {
+        seed = seed * 1103515245 + 12345;
+        size_t size = (seed >> 8) % (2 * SLAB_MAX_SIZE) + 1;
+        objects[i] = realloc(objects[i], size);
+        if (size > sizes[i]) {
+            memset(objects[i] + sizes[i], i % 251, size - sizes[i]);
+        }
+        sizes[i] = size;
+    }
+    if (ya_check()) return -1;
+    for (int i = SLAB_OBJECTS - 1; i > 0; i--) {
+        seed = seed * 1103515245 + 12345;
+        int j = (seed >> 8) % (i + 1);
+        unsigned char *object = objects[j];
+        size_t size = sizes[j];
+        objects[j] = objects[i];
+        sizes[j] = sizes[i];
+        for (size_t k = 0; k < size; k++) {
+            if (object[k] != object[0]) {
+                fprintf(stderr, "object %p clobbered at %zu\n", object, k);
+                return -1;
+            }
+        }
+        free(object);
+    }
+    free(objects[0]);
+    return ya_check();
+}
+
+/* Checks that free and realloc ignore pointers to memory that is not ours:
+ * the stack, static data, a private mapping, and the middle of a direct
+ * block past its first page.
+ * Returns -1 on error, 0 otherwise. */
+int test_foreign() {
+    static char data[64];
+    char local[64];
+    char *mapping = mmap(NULL, 4096, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *direct = malloc(2 * direct_threshold());
+    char *foreign[] = {local + 16, data + 16, mapping + 16, direct + 65536};
+    for (int i = 0; i < 4; i++) {
+        if (pagemap_get(foreign[i])) {
+            fprintf(stderr, "foreign pointer %p in the page map\n",
+                    foreign[i]);
+            return -1;
+        }
+        free(foreign[i]);
+        if (realloc(foreign[i], 100)) {
+            fprintf(stderr, "realloc accepted foreign pointer %p\n",
+                    foreign[i]);
+            return -1;
+        }
+    }
+    free(direct);
+    munmap(mapping, 4096);
+    return ya_check();
+}
+
+/* Checks the aligned allocation functions at alignments from a dword to 4 MB
+ * and sizes from small objects to direct blocks, malloc_usable_size and
+ * reallocarray.
+ * Returns -1 on error, 0 otherwise. */
+int test_api() {
+    size_t sizes[] = {1, 100, 1000, 100000, 4 << 20};
+    for (size_t align = 16; align <= (4 << 20); align *= 4) {
+        for (int i = 0; i < 5; i++) {
+            void *ptrs[3] = {NULL};
+            if (posix_memalign(&ptrs[0], align, sizes[i])) return -1;
+            ptrs[1] = aligned_alloc(align, sizes[i]);
+            ptrs[2] = memalign(align - 1, sizes[i]);
+            for (int j = 0; j < 3; j++) {
+                if (!ptrs[j] || (uintptr_t) ptrs[j] % align
+                        || malloc_usable_size(ptrs[j]) < sizes[i]) {
+                    fprintf(stderr, "%d: %zu bytes aligned on %zu at %p\n",
+                            j, sizes[i], align, ptrs[j]);
+                    return -1;
+                }
+                memset(ptrs[j], 1, sizes[i]);
+            }
+            for (int j = 0; j < 3; j++) {
+                free(ptrs[j]);
+            }
+            if (ya_check()) return -1;
+        }
+    }
+    void *ptr = aligned_alloc(64, 100);
+    if (entry_class(pagemap_get(ptr)) < 0) return -1;
+    free(ptr);
+    if (posix_memalign(&ptr, 24, 100) != EINVAL) return -1;
+    if (aligned_alloc(24, 100)) return -1;
+    size_t page = sysconf(_SC_PAGESIZE);
+    ptr = valloc(100);
+    if ((uintptr_t) ptr % page) return -1;
+    free(ptr);
+    ptr = pvalloc(page + 1);
+    if ((uintptr_t) ptr % page || malloc_usable_size(ptr) < 2 * page) {
+        return -1;
+    }
+    free(ptr);
+    if (malloc_usable_size(NULL) || malloc_usable_size(&ptr)) return -1;
+    ptr = reallocarray(NULL, 10, 10);
+    if (malloc_usable_size(ptr) < 100) return -1;
+    // not a constant, which <malloc.h> has the compiler reject
+    volatile size_t half = SIZE_MAX / 2;
+    if (reallocarray(ptr, half, 3) || errno != ENOMEM) return -1;
+    free(ptr);
+    ptr = malloc(0);
+    void *other = reallocarray(NULL, 0, 32);
+    if (!ptr || !other || ptr == other) return -1;
+    free(ptr);
+    free(other);
+    void *empty[2];
+    if (ya_malloc_batch(0, 2, empty) != 2 || empty[0] == empty[1]) return -1;
+    ya_free_batch(empty, 2);
+    return ya_check();
+}
+
+/* Frees objects and blocks of every kind with free_sized and
+ * free_aligned_sized, checking that cached ones are handed out again.
+ * Returns -1 on error, 0 otherwise. */
+int test_sized() {
+    size_t sizes[] = {1, 16, 100, 256, 257, 300, 520, 4000, 100000, 4 << 20};
+    for (int i = 0; i < 10; i++) {
+        void *ptr = malloc(sizes[i]);
+        free_sized(ptr, sizes[i]);
+        if (sizes[i] <= 520) {
+            if (malloc(sizes[i]) != ptr) {
+                fprintf(stderr, "block of %zu bytes not cached\n", sizes[i]);
+                return -1;
+            }
+            free_sized(ptr, sizes[i]);
+        }
+        ptr = calloc(3, sizes[i]);
+        free_sized(ptr, 3 * sizes[i]);
+        ptr = realloc(malloc(sizes[i]), sizes[i] / 2 + 1);
+        free_sized(ptr, sizes[i] / 2 + 1);
+        for (size_t align = 32; align <= (1 << 20); align *= 8) {
+            ptr = aligned_alloc(align, sizes[i]);
+            free_aligned_sized(ptr, align, sizes[i]);
+        }
+        if (ya_check()) return -1;
+    }
+    free_sized(NULL, 16);
+    return 0;
+}
+
+#define CALLOC_BLOCKS 16
+
+/* Returns true iff the n_bytes bytes at ptr are all zero. */
+static bool all_zero(const unsigned char *ptr, size_t n_bytes) {
+    for (size_t i = 0; i < n_bytes; i++) {
+        if (ptr[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Allocates arrays with calloc over memory dirtied by earlier allocations,
+ * in reused blocks, blocks carved past the end of the heap and direct
+ * segments, checking that they are cleared, and that an overflowing size
+ * fails.
+ * Returns -1 on error, 0 otherwise. */
+int test_calloc() {
+    static unsigned char *blocks[CALLOC_BLOCKS];
+    size_t sizes[] = {10, 300, 1000, 4000, 20000, 70000};
+    for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < CALLOC_BLOCKS; j++) {
+            blocks[j] = malloc(sizes[i]);
+            memset(blocks[j], 0xa5, sizes[i]);
+        }
+        for (int j = 0; j < CALLOC_BLOCKS; j += 2) {
+            free(blocks[j]); // leaves dirty holes
+        }
+        for (int j = 0; j < CALLOC_BLOCKS; j += 2) {
+            // alternately reuses a hole and carves a block past them
+            size_t n_bytes = sizes[i] + (j & 2 ? sizes[i] / 2 : 0);
+            blocks[j] = calloc(1, n_bytes);
+            if (!blocks[j] || !all_zero(blocks[j], n_bytes)) {
+                fprintf(stderr, "calloc(1, %zu) not cleared\n", n_bytes);
+                return -1;
+            }
+            memset(blocks[j], 0xa5, n_bytes);
+        }
+        for (int j = 0; j < CALLOC_BLOCKS; j++) {
+            free(blocks[j]);
+        }
+        if (ya_check()) return -1;
+    }
+    // large enough for the heap to grow, then reused once dirty, and direct
+    size_t large[] = {direct_threshold() - 4096, direct_threshold() + 4096};
+    for (int i = 0; i < 8; i++) {
+        size_t n_bytes = large[i / 4];
+        blocks[i] = calloc(n_bytes, 1);
+        if (!blocks[i] || !all_zero(blocks[i], n_bytes)) {
+            fprintf(stderr, "calloc(%zu, 1) not cleared\n", n_bytes);
+            return -1;
+        }
+        memset(blocks[i], 0xa5, n_bytes);
+        if (i & 1) {
+            free(blocks[i - 1]);
+            free(blocks[i]);
+        }
+    }
+    if (ya_check()) return -1;
+    malloc_trim(0); // for test_trim to see the heap's memory grow
+    volatile size_t nmemb = SIZE_MAX / 2; // hidden from compile-time checks
+    errno = 0;
+    if (calloc(nmemb, 3) || errno != ENOMEM) {
+        fprintf(stderr, "calloc overflow not detected\n");
+        return -1;
+    }
+    return 0;
+}
+
+#define BATCH_COUNT 3000
+
+/* Allocates batches of objects and blocks of several sizes, checking that
+ * they do not overlap, then frees them in batches, shuffled and mixed with
+ * NULL pointers.
+ * Returns -1 on error, 0 otherwise. */
+int test_batch() {
+    static unsigned char *ptrs[4 * BATCH_COUNT];
+    size_t sizes[] = {24, 200, 300, 1000, 5000, 300000};
+    unsigned int seed = 7;
+    for (int i = 0; i < 6; i++) {
+        size_t count = sizes[i] > 100000 ? 20 : BATCH_COUNT;
+        for (int j = 0; j < 4; j++) {
+            void **batch = (void **) ptrs + j * count;
+            if (ya_malloc_batch(sizes[i], count, batch) != count) {
+                fprintf(stderr, "batch of %zu bytes failed\n", sizes[i]);
+                return -1;
+            }
+            for (size_t k = 0; k < count; k++) {
+                if (malloc_usable_size(batch[k]) < sizes[i]) return -1;
+                memset(batch[k], (j * count + k) % 251, sizes[i]);
+            }
+        }
+        if (ya_check()) return -1;
+        for (size_t k = 0; k < 4 * count; k++) {
+            for (size_t l = 0; l < sizes[i]; l++) {
+                if (ptrs[k][l] != k % 251) {
+                    fprintf(stderr, "block %p clobbered at %zu\n", ptrs[k], l);
+                    return -1;
+                }
+            }
+        }
+        // shuffle the second half, punch NULL holes in it
+        for (size_t k = 4 * count - 1; k > 2 * count; k--) {
+            seed = seed * 1103515245 + 12345;
+            size_t l = 2 * count + (seed >> 8) % (k - 2 * count + 1);
+            unsigned char *ptr = ptrs[l];
+            ptrs[l] = ptrs[k];
+            ptrs[k] = ptr;
+        }
+        for (size_t k = 2 * count; k < 4 * count; k += 7) {
+            free(ptrs[k]);
+            ptrs[k] = NULL;
+        }
+        ya_free_batch((void **) ptrs, 4 * count);
+        if (ya_check()) return -1;
+    }
+    return 0;
+}
+
+#define REGION_OBJECTS 10000
+
+/* Returns the number of chunks of the region. */
+static size_t count_chunks(struct ya_region *region) {
+    size_t count = 0;
+    for (struct region_chunk *chunk = region->chunk; chunk;
+            chunk = chunk->prev) {
+        count++;
+    }
+    return count;
+}
+
+/* Allocates objects of random sizes from a region, checking that they are
+ * aligned and do not overlap, rolls back to a mark, allocates from a nested
+ * region, then resets and destroys the regions. Also checks that a nested
+ * region reset over and over does not grow its parent.
+ * Returns -1 on error, 0 otherwise. */
+int test_region() {
+    static unsigned char *objects[REGION_OBJECTS];
+    static size_t sizes[REGION_OBJECTS];
+    unsigned int seed = 3;
+    struct ya_region *region = ya_region_create(NULL);
+    struct ya_region_mark mark = ya_region_save(region);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < REGION_OBJECTS; i++) {
+            seed = seed * 1103515245 + 12345;
+            // a few objects larger than any chunk
+            sizes[i] = i % 1000 == 999 ? 100000 : (seed >> 8) % 512 + 1;
+            objects[i] = ya_region_alloc(region, sizes[i]);
+            if (!objects[i] || (uintptr_t) objects[i] % 16) return -1;
+            memset(objects[i], i % 251, sizes[i]);
+            if (i == REGION_OBJECTS / 2) {
+                mark = ya_region_save(region);
+            }
+        }
+        for (int i = 0; i < REGION_OBJECTS; i++) {
+            for (size_t k = 0; k < sizes[i]; k++) {
+                if (objects[i][k] != i % 251) {
+                    fprintf(stderr, "region object %p clobbered at %zu\n",
+                            objects[i], k);
+                    return -1;
+                }
+            }
+        }
+        ya_region_restore(region, mark);
+        if (ya_region_alloc(region, sizes[REGION_OBJECTS / 2 + 1])
+                != objects[REGION_OBJECTS / 2 + 1]) {
+            fprintf(stderr, "region not rolled back to its mark\n");
+            return -1;
+        }
+        struct ya_region *nested = ya_region_create(region);
+        for (int i = 0; i < REGION_OBJECTS; i++) {
+            memset(ya_region_alloc(nested, 100), 1, 100);
+        }
+        if (round == 0) {
+            ya_region_destroy(nested);
+        }
+        ya_region_reset(region);
+        if (ya_check()) return -1;
+    }
+    // a nested region reset over and over reuses its chunks
+    struct ya_region *nested = ya_region_create(region);
+    size_t chunks = 0;
+    for (int round = 0; round < 100; round++) {
+        for (int i = 0; i < 1000; i++) {
+            memset(ya_region_alloc(nested, 100), 1, 100);
+        }
+        ya_region_reset(nested);
+        if (round == 0) {
+            chunks = count_chunks(region);
+        } else if (count_chunks(region) != chunks) {
+            fprintf(stderr, "nested region grew its parent to %zu chunks\n",
+                    count_chunks(region));
+            return -1;
+        }
+    }
+    void *empty = ya_region_alloc(region, 0);
+    if (!empty || empty == ya_region_alloc(region, 0)) return -1;
+    ya_region_destroy(region);
+    return ya_check();
+}
+
+/* Frees and allocates blocks too large for the thread cache but small enough
+ * for the fast bins, checking that they are reused without coalescing, then
+ * that freeing more than the fast bin budget consolidates them.
+ * Returns -1 on error, 0 otherwise. */
+int test_fast() {
+    static void *blocks[1000];
+    size_t hits, consolidations, old_hits, old_consolidations;
+    ya_fast_stats(&old_hits, &old_consolidations);
+    void *block = malloc(600);
+    for (int i = 0; i < 100; i++) {
+        free(block);
+        if (malloc(600) != block) {
+            fprintf(stderr, "fast bin block %p not reused\n", block);
+            return -1;
+        }
+    }
+    free(block);
+    ya_fast_stats(&hits, &consolidations);
+    if (hits - old_hits < 100) return -1;
+    for (int i = 0; i < 1000; i++) {
+        blocks[i] = malloc(600);
+    }
+    for (int i = 0; i < 1000; i++) {
+        free(blocks[i]);
+    }
+    if (ya_check()) return -1;
+    ya_fast_stats(&hits, &consolidations);
+    if (consolidations == old_consolidations) {
+        fprintf(stderr, "fast bins never consolidated\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Frees a fast bin block twice with another free in between, in a child
+ * process since debug builds abort on it. Otherwise checks that the second
+ * free was ignored and that the heap is still consistent.
+ * Returns -1 on error, 0 otherwise. */
+int test_fast_double_free() {
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        void *a = malloc(800);
+        void *b = malloc(800);
+        free(a);
+        free(b);
+        free(a);
+        void *c = malloc(800);
+        void *d = malloc(800);
+        void *e = malloc(800);
+        _exit(c == e || d == e || ya_check() ? 1 : 0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid) {
+        return -1;
+    }
+#ifdef YA_DEBUG
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT) {
+        fprintf(stderr, "fast bin double free not caught\n");
+        return -1;
+    }
+#else
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "fast bin double free not ignored\n");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+#define STATS_THREAD_OBJECTS 50
+
+/* Allocates STATS_THREAD_OBJECTS objects of 16 bytes, storing them in the
+ * array at arg, and exits. */
+void *stats_thread_main(void *arg) {
+    void **ptrs = arg;
+    for (int i = 0; i < STATS_THREAD_OBJECTS; i++) {
+        ptrs[i] = malloc(16);
+    }
+    return NULL;
+}
+
+/* Checks that the statistics count allocations and frees by class and in
+ * bytes, direct segments, and the allocations of exited threads, and that
+ * mallinfo2 and ya_stats_json agree with them.
+ * Returns -1 on error, 0 otherwise. */
+int test_stats() {
+    struct ya_stats before, during, after;
+    void *small[100], *blocks[10], *ptrs[STATS_THREAD_OBJECTS];
+    size_t direct = 2 * direct_threshold();
+    ya_stats(&before);
+    for (int i = 0; i < 100; i++) {
+        small[i] = malloc(48);
+    }
+    for (int i = 0; i < 10; i++) {
+        blocks[i] = malloc(1000);
+    }
+    void *big = malloc(direct);
+    ya_stats(&during);
+    if (during.small[2].size != 48
+            || during.small[2].mallocs - before.small[2].mallocs != 100
+            || during.large.mallocs - before.large.mallocs != 11
+            || during.allocated_bytes - before.allocated_bytes
+                    < 100 * 48 + 10 * 1000 + direct
+            || during.direct_segments != before.direct_segments + 1
+            || during.direct_bytes - before.direct_bytes < direct
+            || during.maps == before.maps
+            || during.mapped_bytes < during.heap_bytes + during.direct_bytes) {
+        fprintf(stderr, "allocations miscounted\n");
+        return -1;
+    }
+    struct mallinfo2 info = mallinfo2();
+    if (info.arena != info.uordblks + info.fordblks
+            || info.fordblks < info.fsmblks || info.hblks != 1
+            || info.hblkhd != during.direct_bytes) {
+        fprintf(stderr, "mallinfo2 inconsistent\n");
+        return -1;
+    }
+    for (int i = 0; i < 100; i++) {
+        free(small[i]);
+    }
+    for (int i = 0; i < 10; i++) {
+        free(blocks[i]);
+    }
+    free(big);
+    ya_stats(&after);
+    if (after.small[2].frees - before.small[2].frees != 100
+            || after.large.frees - before.large.frees != 11
+            || after.allocated_bytes != before.allocated_bytes
+            || after.direct_segments != before.direct_segments) {
+        fprintf(stderr, "frees miscounted\n");
+        return -1;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, stats_thread_main, ptrs);
+    pthread_join(thread, NULL);
+    ya_stats(&after);
+    if (after.small[0].mallocs - before.small[0].mallocs
+            < STATS_THREAD_OBJECTS) {
+        fprintf(stderr, "exited thread's allocations lost\n");
+        return -1;
+    }
+    for (int i = 0; i < STATS_THREAD_OBJECTS; i++) {
+        free(ptrs[i]);
+    }
+    char json[4096];
+    size_t len = ya_stats_json(NULL, 0);
+    if (len >= sizeof(json) || ya_stats_json(json, sizeof(json)) != len
+            || strlen(json) != len || strncmp(json, "{\"mapped_bytes\":", 16)
+            || strcmp(json + len - 2, "}}")) {
+        fprintf(stderr, "bad statistics: %s\n", json);
+        return -1;
+    }
+    if (ya_stats_json(json, 10) != len || strlen(json) != 9) return -1;
+    return ya_check();
+}
+
+/* Returns the resident set size of the process in bytes. */
+size_t rss_bytes() {
+    size_t pages = 0;
+    size_t resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+#define TRIM_BLOCKS 512
+#define TRIM_BLOCK_SIZE (64 << 10)
+
+/* Returns how much of the resident memory added since base, out of peak, is
+ * still resident, in percent. */
+long residue(long base, long peak) {
+    long ret = ((long) rss_bytes() - base) * 100 / (peak - base);
+    fprintf(stderr, "residue: %ld%%\n", ret);
+    return ret;
+}
+
+/* Fills TRIM_BLOCKS heap blocks. Returns the resident set size after. */
+long trim_fill(void **blocks) {
+    for (int i = 0; i < TRIM_BLOCKS; i++) {
+        blocks[i] = malloc(TRIM_BLOCK_SIZE);
+        memset(blocks[i], 1, TRIM_BLOCK_SIZE);
+    }
+    return rss_bytes();
+}
+
+/* Checks that freed memory goes back to the system: right away with a decay
+ * time of 0, only on malloc_trim with a negative one, and once it has been
+ * free for the decay time otherwise. Also checks that dirty memory allocated
+ * again is counted as reused.
+ * Returns -1 on error, 0 otherwise. */
+int test_trim() {
+    void *blocks[TRIM_BLOCKS];
+    long base, peak;
+    size_t purged, reused, new_purged, new_reused;
+
+    decay_setup(0);
+    base = rss_bytes();
+    peak = trim_fill(blocks);
+    for (int i = 0; i < TRIM_BLOCKS; i++) {
+        free(blocks[i]);
+    }
+    if (residue(base, peak) > 10) return -1;
+
+    // pin the last block so the heap cannot be trimmed
+    decay_setup(-1);
+    base = rss_bytes();
+    peak = trim_fill(blocks);
+    for (int i = 0; i < TRIM_BLOCKS - 1; i++) {
+        free(blocks[i]);
+    }
+    if (residue(base, peak) < 90) return -1;
+    if (!malloc_trim(0)) return -1;
+    if (residue(base, peak) > 10) return -1;
+    free(blocks[TRIM_BLOCKS - 1]);
+
+    decay_setup(50);
+    base = rss_bytes();
+    peak = trim_fill(blocks);
+    for (int i = 0; i < TRIM_BLOCKS; i++) {
+        free(blocks[i]);
+    }
+    if (residue(base, peak) < 90) return -1;
+    ya_decay_stats(&purged, &reused);
+    blocks[0] = malloc(TRIM_BLOCK_SIZE);
+    free(blocks[0]);
+    ya_decay_stats(&new_purged, &new_reused);
+    if (new_reused < reused + TRIM_BLOCK_SIZE) return -1;
+    usleep(100000);
+    // the next free of a large block runs a decay pass
+    blocks[0] = malloc(TRIM_BLOCK_SIZE);
+    free(blocks[0]);
+    if (residue(base, peak) > 10) return -1;
+    ya_decay_stats(&new_purged, &new_reused);
+    if (new_purged < purged + (peak - base) * 9 / 10) return -1;
+
+    decay_setup(DECAY_DEFAULT_MS);
+    return ya_check();
+}
+
+/* Reads the totals of the heap profile at path into count and n_bytes.
+ * Returns -1 if the profile is malformed, 0 otherwise. */
+int read_profile(const char *path, size_t *count, size_t *n_bytes) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[1024];
+    bool stacks = true;
+    bool maps = false;
+    int n_fields = fscanf(file, "heap profile: %zu: %zu [", count, n_bytes);
+    while (fgets(line, sizeof(line), file)) {
+        maps |= !strcmp(line, "MAPPED_LIBRARIES:\n");
+        if (!maps && strchr(line, '[') && !strstr(line, "@ 0x")) {
+            stacks = false;
+        }
+    }
+    fclose(file);
+    return n_fields == 2 && stacks && maps ? 0 : -1;
+}
+
+/* Samples allocations every 4 KB on average, checking that a heap profile
+ * holds a plausible share of the live objects and none once they are freed,
+ * and that a dump to a bad path fails with errno set.
+ * Returns -1 on error, 0 otherwise. */
+int test_prof() {
+    char path[] = "/tmp/yatest-prof-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    void *ptrs[1000];
+    size_t count, n_bytes;
+    ya_prof_set_interval(4096);
+    // allocate past the check of the interval
+    for (int i = 0; i < 2000; i++) {
+        free(malloc(1000));
+    }
+    for (int i = 0; i < 1000; i++) {
+        ptrs[i] = malloc(1000);
+    }
+    ptrs[0] = realloc(ptrs[0], 100000);
+    // about 1 - exp(-1000 / 4096) = 22% of the objects are sampled
+    if (ya_prof_dump(path) || read_profile(path, &count, &n_bytes)
+            || count < 100 || count > 400 || n_bytes < count * 1000
+            || n_bytes > count * 1000 + 100000) {
+        fprintf(stderr, "bad heap profile\n");
+        unlink(path);
+        return -1;
+    }
+    for (int i = 0; i < 1000; i++) {
+        free(ptrs[i]);
+    }
+    ya_prof_set_interval(0);
+    if (ya_prof_dump(path) || read_profile(path, &count, &n_bytes)
+            || count != 0 || n_bytes != 0) {
+        fprintf(stderr, "freed samples left in the heap profile\n");
+        unlink(path);
+        return -1;
+    }
+    unlink(path);
+    if (!ya_prof_dump("/nonexistent/profile") || errno != ENOENT) {
+        fprintf(stderr, "heap profile dump failure not reported\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Times allocations, frees, callocs and reallocs on several paths, checking
+ * that instrumented builds count them consistently by bucket and by path and
+ * that other builds record nothing, that invalid reads return nothing, and
+ * that the histograms can be dumped.
+ * Returns -1 on error, 0 otherwise. */
+int test_latency() {
+    size_t mallocs = ya_latency(YA_LAT_MALLOC, YA_LAT_ANY_PATH, NULL);
+    void *ptrs[100];
+    for (int i = 0; i < 100; i++) {
+        ptrs[i] = malloc(100);
+    }
+    for (int i = 0; i < 100; i++) {
+        free(ptrs[i]);
+    }
+    free(malloc(2 * direct_threshold()));
+    free(calloc(10, 10));
+    void *ptr = realloc(NULL, 5000);
+    ptr = realloc(ptr, 100);
+    free(ptr);
+    size_t counts[YA_LAT_BUCKETS];
+    size_t count = ya_latency(YA_LAT_MALLOC, YA_LAT_ANY_PATH, counts);
+    size_t in_buckets = 0;
+    for (int i = 0; i < YA_LAT_BUCKETS; i++) {
+        in_buckets += counts[i];
+    }
+    size_t by_path = 0;
+    for (int path = 0; path < YA_LAT_PATHS; path++) {
+        by_path += ya_latency(YA_LAT_MALLOC, path, NULL);
+    }
+#ifdef YA_INSTRUMENT
+    if (count - mallocs < 101 || in_buckets != count || by_path != count
+            || !ya_latency(YA_LAT_MALLOC, YA_LAT_DIRECT, NULL)
+            || !ya_latency(YA_LAT_FREE, YA_LAT_DIRECT, NULL)
+            || !ya_latency(YA_LAT_CALLOC, YA_LAT_ANY_PATH, NULL)
+            || !ya_latency(YA_LAT_REALLOC, YA_LAT_ANY_PATH, NULL)
+            || ya_latency_quantile(YA_LAT_MALLOC, YA_LAT_ANY_PATH, 0.5) <= 0
+            || ya_latency_quantile(YA_LAT_MALLOC, YA_LAT_ANY_PATH, 0.5)
+                    > ya_latency_quantile(YA_LAT_MALLOC, YA_LAT_ANY_PATH, 1)
+            || ya_latency_bucket_ns(1) <= 0) {
+        fprintf(stderr, "latencies miscounted\n");
+        return -1;
+    }
+#else
+    if (count || in_buckets || by_path || mallocs
+            || ya_latency_quantile(YA_LAT_MALLOC, YA_LAT_ANY_PATH, 0.5)) {
+        fprintf(stderr, "latencies recorded without YA_INSTRUMENT\n");
+        return -1;
+    }
+#endif
+    if (ya_latency(YA_LAT_OPS, YA_LAT_ANY_PATH, NULL)
+            || ya_latency(YA_LAT_MALLOC, YA_LAT_PATHS, NULL)
+            || ya_latency_bucket_ns(-1)
+            || ya_latency_bucket_ns(YA_LAT_BUCKETS)) {
+        fprintf(stderr, "invalid latency histogram read\n");
+        return -1;
+    }
+    char path[] = "/tmp/yatest-latency-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    char line[256] = "";
+    int dumped = ya_latency_dump(path);
+    FILE *file = fopen(path, "r");
+    if (file) {
+        fgets(line, sizeof(line), file);
+        fclose(file);
+    }
+    unlink(path);
+    if (dumped || strncmp(line, "op ", 3)) {
+        fprintf(stderr, "bad latency dump\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns the number of records of op on ptr with the size and argument
+ * given among the n records, storing the last one's thread in *thread. */
+int count_records(struct trace_record *records, size_t n, int op, void *ptr,
+        size_t size, uintptr_t arg, uint32_t *thread) {
+    int count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (records[i].op == op && records[i].ptr == (uintptr_t) ptr
+                && records[i].size == size && records[i].arg == arg) {
+            *thread = records[i].thread;
+            count++;
+        }
+    }
+    return count;
+}
+
+void *trace_thread(void *arg) {
+    free(arg);
+    return malloc(48);
+}
+
+/* Traces every kind of call, from two threads, checking that a trace cannot
+ * be started twice, that each call is recorded once with its arguments and
+ * thread, in time order per thread, and that calls after the trace stopped
+ * are not.
+ * Returns -1 on error, 0 otherwise. */
+int test_trace() {
+    char path[] = "/tmp/yatest-trace-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    if (ya_trace_start(path)) {
+        return -1;
+    }
+    if (!ya_trace_start(path) || errno != EBUSY) {
+        fprintf(stderr, "trace started twice\n");
+        return -1;
+    }
+    void *p = malloc(100);
+    void *c = calloc(3, 10);
+    void *r = realloc(c, 5000);
+    void *a = aligned_alloc(256, 512);
+    void *batch[4];
+    size_t n_batch = ya_malloc_batch(32, 4, batch);
+    ya_free_batch(batch, n_batch);
+    pthread_t thread;
+    void *t = NULL;
+    pthread_create(&thread, NULL, trace_thread, p);
+    pthread_join(thread, &t);
+    free(t);
+    free(r);
+    free(a);
+    int stopped = ya_trace_stop();
+    free(malloc(77)); // not recorded
+
+    FILE *file = fopen(path, "r");
+    unlink(path);
+    if (stopped || !file) {
+        return -1;
+    }
+    struct trace_header header;
+    struct trace_record records[4096];
+    size_t n = 0;
+    if (fread(&header, sizeof(header), 1, file) == 1) {
+        n = fread(records, sizeof(struct trace_record), 4096, file);
+    }
+    fclose(file);
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+            || header.record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "bad trace header\n");
+        return -1;
+    }
+    uint32_t main_thread, other_thread, ignored;
+    if (count_records(records, n, TRACE_MALLOC, p, 100, 0, &main_thread) != 1
+            || count_records(records, n, TRACE_CALLOC, c, 30, 0, &ignored)
+                    != 1
+            || count_records(records, n, TRACE_REALLOC, r, 5000,
+                    (uintptr_t) c, &ignored) != 1
+            || count_records(records, n, TRACE_ALIGNED, a, 512, 256, &ignored)
+                    != 1
+            || count_records(records, n, TRACE_FREE, p, 0, 0, &other_thread)
+                    != 1
+            || other_thread == main_thread
+            || count_records(records, n, TRACE_MALLOC, t, 48, 0, &ignored)
+                    != 1
+            || count_records(records, n, TRACE_FREE, t, 0, 0, &ignored) != 1
+            || count_records(records, n, TRACE_FREE, r, 0, 0, &ignored) != 1) {
+        fprintf(stderr, "calls missing from the trace\n");
+        return -1;
+    }
+    for (size_t i = 0; i < n_batch; i++) {
+        if (count_records(records, n, TRACE_MALLOC, batch[i], 32, 0,
+                    &ignored) != 1
+                || count_records(records, n, TRACE_FREE, batch[i], 0, 0,
+                    &ignored) != 1) {
+            fprintf(stderr, "batch missing from the trace\n");
+            return -1;
+        }
+    }
+    uint64_t last[64] = {0};
+    for (size_t i = 0; i < n; i++) {
+        if (records[i].size == 77 || records[i].thread >= 64
+                || records[i].time < last[records[i].thread]) {
+            fprintf(stderr, "bad trace record\n");
+            return -1;
+        }
+        last[records[i].thread] = records[i].time;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv) {
     void *a, *b, *c, *d;
     ya_print_blocks();
@@ -71,4 +1053,29 @@ int main(int argc, char **argv) {
     c = print_realloc(c, 500);
     ya_print_blocks();
     if (ya_check()) return -1;
+    // larger than a segment
+    a = print_malloc(100 << 20);
+    ((char *) a)[(50 << 20) - 1] = 1;
+    a = print_realloc(a, 50 << 20);
+    a = print_realloc(a, 200 << 20);
+    if (((char *) a)[(50 << 20) - 1] != 1) return -1;
+    ((char *) a)[(200 << 20) - 1] = 1;
+    print_free(a);
+    if (test_slab()) return -1;
+    if (test_foreign()) return -1;
+    if (test_api()) return -1;
+    if (test_sized()) return -1;
+    if (test_direct()) return -1;
+    if (test_calloc()) return -1;
+    if (test_trim()) return -1;
+    if (test_batch()) return -1;
+    if (test_region()) return -1;
+    if (test_fast()) return -1;
+    if (test_fast_double_free()) return -1;
+    if (test_stats()) return -1;
+    if (test_prof()) return -1;
+    if (test_latency()) return -1;
+    if (test_trace()) return -1;
+    if (ya_check()) return -1;
+    if (test_threads()) return -1;
 }